@@ -1,20 +1,32 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <list>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 #include <bitset>
+#include <limits>
 #include <random>
 
+#include <lib/match_state_reader.hpp>
+#include <lib/random.hpp>
+#include <lib/shm_transport.hpp>
+#include <lib/time_budget.hpp>
+
 extern "C" {
 #include <lib/dealer.h>
 #include <cpp_utilities/src/lib/print_debugger.h>
@@ -61,7 +73,7 @@ namespace Acpc {
 // Thanks to hobbs
 // (http://stackoverflow.com/questions/4169981/logsumexp-implementation-in-c)
 // for this.
-template <typename List> double logsumexp(List nums) {
+template <typename List> double logsumexp(const List &nums) {
   double max_exp = nums[0], sum = 0.0;
   size_t i;
 
@@ -78,6 +90,119 @@ template <typename List> double logsumexp(List nums) {
   return log(sum) + max_exp;
 }
 
+/**
+ * exp(x) to within about 1e-8 relative error, built from a polynomial and
+ * exponent bit manipulation so that loops calling it vectorize.
+ */
+double fastExp(double x) {
+  // exp(x) = 2^k * 2^f, where k is an integer and |f| <= 0.5
+  x = x < -708.0 ? -708.0 : (x > 709.0 ? 709.0 : x);
+  const double y = x * 1.4426950408889634; // log2(e)
+  const double k = std::floor(y + 0.5);
+  const double z = (y - k) * 0.6931471805599453; // ln(2)
+
+  // Taylor series for exp(z), |z| <= ln(2) / 2
+  double p = 1.0 / 5040.0;
+  p = p * z + 1.0 / 720.0;
+  p = p * z + 1.0 / 120.0;
+  p = p * z + 1.0 / 24.0;
+  p = p * z + 1.0 / 6.0;
+  p = p * z + 0.5;
+  p = p * z + 1.0;
+  p = p * z + 1.0;
+
+  const int64_t exponentBits = (static_cast<int64_t>(k) + 1023) << 52;
+  double twoToTheK;
+  memcpy(&twoToTheK, &exponentBits, sizeof(twoToTheK));
+  return p * twoToTheK;
+}
+
+template <bool useFastExp> double maybeFastExp(double x) {
+  return useFastExp ? fastExp(x) : std::exp(x);
+}
+
+/**
+ * logsumexp of each of @p numRows rows of @p rowLength values, laid out
+ * row by row, into @p results.
+ */
+template <bool useFastExp = false, class ArraySize>
+void logsumexp(const double *__restrict rows, ArraySize numRows,
+               ArraySize rowLength, double *__restrict results) {
+  assert(rows);
+  assert(results);
+  assert(rowLength > 0);
+
+  for (size_t i = 0; i < size_t(numRows); ++i) {
+    const double *__restrict row = &rows[i * rowLength];
+
+    double max_exp = row[0];
+    for (size_t j = 1; j < size_t(rowLength); ++j) {
+      max_exp = row[j] > max_exp ? row[j] : max_exp;
+    }
+    double sum = 0.0;
+    for (size_t j = 0; j < size_t(rowLength); ++j) {
+      sum += maybeFastExp<useFastExp>(row[j] - max_exp);
+    }
+    results[i] = std::log(sum) + max_exp;
+  }
+}
+
+/**
+ * Scales each of @p numRows rows of @p rowLength values, laid out row by
+ * row, in place to sum to one. Rows that do not sum to a positive value
+ * become uniform.
+ */
+template <class ArraySize>
+void normalize(double *rows, ArraySize numRows, ArraySize rowLength) {
+  assert(rows);
+  assert(rowLength > 0);
+
+  for (size_t i = 0; i < size_t(numRows); ++i) {
+    double *__restrict row = &rows[i * rowLength];
+
+    double sum = 0.0;
+    for (size_t j = 0; j < size_t(rowLength); ++j) {
+      sum += row[j];
+    }
+    // Branch free so that the loop vectorizes
+    const double scale = sum > 0.0 ? 1.0 / sum : 0.0;
+    const double uniform = sum > 0.0 ? 0.0 : 1.0 / rowLength;
+    for (size_t j = 0; j < size_t(rowLength); ++j) {
+      row[j] = row[j] * scale + uniform;
+    }
+  }
+}
+
+/**
+ * Replaces each of @p numRows rows of @p rowLength log weights, laid out
+ * row by row, in place with the normalized weights, exp(x - logsumexp(row)).
+ * This is the normalization step of a Bayesian update in log space.
+ */
+template <bool useFastExp = false, class ArraySize>
+void normalizeLogWeights(double *rows, ArraySize numRows,
+                         ArraySize rowLength) {
+  assert(rows);
+  assert(rowLength > 0);
+
+  for (size_t i = 0; i < size_t(numRows); ++i) {
+    double *__restrict row = &rows[i * rowLength];
+
+    double max_exp = row[0];
+    for (size_t j = 1; j < size_t(rowLength); ++j) {
+      max_exp = row[j] > max_exp ? row[j] : max_exp;
+    }
+    double sum = 0.0;
+    for (size_t j = 0; j < size_t(rowLength); ++j) {
+      row[j] = maybeFastExp<useFastExp>(row[j] - max_exp);
+      sum += row[j];
+    }
+    const double scale = 1.0 / sum;
+    for (size_t j = 0; j < size_t(rowLength); ++j) {
+      row[j] *= scale;
+    }
+  }
+}
+
 template <class ElemSrc, class ElemDest, class MapFn>
 void map(const std::vector<ElemSrc> &src, std::vector<ElemDest> &dest,
          MapFn mapFn) {
@@ -86,7 +211,7 @@ void map(const std::vector<ElemSrc> &src, std::vector<ElemDest> &dest,
 }
 
 template <class SrcArrayType, class ResultType, class ReduceFn>
-ResultType reduce(const SrcArrayType src, ReduceFn reduceFn,
+ResultType reduce(const SrcArrayType &src, ReduceFn reduceFn,
                   ResultType result) {
   for (auto elem : src) {
     result = reduceFn(result, elem);
@@ -193,15 +318,24 @@ constexpr uint32_t handNum(const MatchState &view) {
 
 typedef double ChipBalance;
 
+/// A nondeterministic seed. Only the first call on each thread touches
+/// std::random_device.
 uint randomRandomSeed() {
-  std::random_device rd;
-  return rd();
+  thread_local Xoshiro256StarStar seeds(
+      (uint64_t(std::random_device()()) << 32) | std::random_device()());
+  return uint(seeds() >> 32);
 }
 
 bool flipCoin(double probTrue, std::mt19937 *randomEngine) {
   assert(randomEngine);
-  std::bernoulli_distribution coin(probTrue);
-  return coin(*randomEngine);
+  // What std::bernoulli_distribution does, without constructing one
+  return std::generate_canonical<double, std::numeric_limits<double>::digits>(
+             *randomEngine) < probTrue;
+}
+
+bool flipCoin(double probTrue, Xoshiro256StarStar *randomEngine) {
+  assert(randomEngine);
+  return randomEngine->flipCoin(probTrue);
 }
 
 bool allOthersFolded(const State &state, const size_t pos,
@@ -251,6 +385,19 @@ public:
   int32_t bigBlind() const { return bigBlind_; }
 
   size_t numCards() const { return game_->numRanks * game_->numSuits; }
+
+  /// Index of @p card among this game's numCards() cards, counting from 0
+  size_t cardIndex(const uint8_t card) const {
+    return (rankOfCard(card) - (MAX_RANKS - game_->numRanks)) *
+               game_->numSuits +
+           suitOfCard(card) - (MAX_SUITS - game_->numSuits);
+  }
+  /// Inverse of cardIndex
+  uint8_t card(const size_t cardIndex) const {
+    return makeCard(cardIndex / game_->numSuits + MAX_RANKS - game_->numRanks,
+                    cardIndex % game_->numSuits + MAX_SUITS -
+                        game_->numSuits);
+  }
   size_t numPrivateCards() const {
     return game_->numHoleCards * game_->numPlayers;
   }
@@ -332,24 +479,53 @@ void replay(const MatchState &view, const GameDef &gameDef,
 #define HOST_NAME_MAX sysconf(_SC_HOST_NAME_MAX);
 #endif
 
+/// The path of a unix domain socket that a dealer on this host listens on
+struct UnixSocketPath {
+  std::string path;
+};
+
+/// A socket already connected to the dealer, like one end of a socketpair
+/// whose other end the dealer holds
+struct ConnectedSocket {
+  int fd;
+};
+
 struct DealerConnection {
   DealerConnection(uint16_t port, const std::string &host = "localhost")
-      : port_(port), host_(), toServer_(nullptr), fromServer_(nullptr) {
+      : port_(port), host_(), unixPath_(), sock_(-1), toServer_(nullptr),
+        fromServer_(nullptr) {
     std::memcpy(host_, host.c_str(), sizeof(*host_) * host.size());
   }
+  explicit DealerConnection(const UnixSocketPath &dealer)
+      : port_(0), host_(), unixPath_(dealer.path), sock_(-1),
+        toServer_(nullptr), fromServer_(nullptr) {}
+  explicit DealerConnection(const ConnectedSocket &dealer)
+      : port_(0), host_(), unixPath_(), sock_(dealer.fd), toServer_(nullptr),
+        fromServer_(nullptr) {}
   virtual ~DealerConnection() {
-    fclose(toServer_);
-    fclose(fromServer_);
+    if (toServer_) {
+      fclose(toServer_);
+    }
+    if (fromServer_) {
+      fclose(fromServer_);
+    }
   };
 
   void connect() {
-    DEBUG_VARIABLE("%s", host_);
-    int sock = connectTo(host_, port_);
+    int sock = sock_;
+    if (sock < 0 && !unixPath_.empty()) {
+      DEBUG_VARIABLE("%s", unixPath_.c_str());
+      sock = connectToUnixSocket(unixPath_.c_str());
+    } else if (sock < 0) {
+      DEBUG_VARIABLE("%s", host_);
+      sock = connectTo(host_, port_);
+    }
     if (sock < 0) {
       exit(EXIT_FAILURE);
     }
+    sock_ = sock;
     toServer_ = fdopen(sock, "w");
-    fromServer_ = fdopen(sock, "r");
+    fromServer_ = fdopen(dup(sock), "r");
     if (!(toServer_ && fromServer_)) {
       fprintf(stderr, "ERROR: could not get socket streams\n");
       exit(EXIT_FAILURE);
@@ -366,12 +542,133 @@ struct DealerConnection {
 
   uint16_t port_;
   char host_[HOST_NAME_MAX];
+  std::string unixPath_;
+  int sock_;
   FILE *toServer_;
   FILE *fromServer_;
 };
 
+/**
+ * One background thread that runs at most one task at a time, for work an
+ * agent can do while it waits, like solving the subgames its opponents'
+ * actions could lead to. Starting a task cancels the one before it. A task
+ * is told it has been cancelled through its flag, which it should check
+ * often, since cancelling waits for it to return.
+ */
+class SpeculationSlot {
+public:
+  typedef std::function<void(const std::atomic<bool> &cancelled)> Task;
+
+  SpeculationSlot()
+      : mutex_(), changed_(), task_(), running_(false), cancelled_(false),
+        stopping_(false), error_(), thread_() {}
+  SpeculationSlot(const SpeculationSlot &) = delete;
+  SpeculationSlot &operator=(const SpeculationSlot &) = delete;
+  virtual ~SpeculationSlot() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      cancelled_ = true;
+    }
+    changed_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  /**
+   * Cancels the current task, if any, and starts @p task in its place.
+   * Rethrows anything the cancelled task threw.
+   */
+  void start(Task task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::exception_ptr error = cancelAndWait(lock);
+    task_ = std::move(task);
+    cancelled_ = false;
+    if (!thread_.joinable()) {
+      thread_ = std::thread([this]() { work(); });
+    }
+    lock.unlock();
+    changed_.notify_all();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  /**
+   * Cancels the current task, if any, and waits for it to return. Rethrows
+   * anything the task threw.
+   */
+  void cancel() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::exception_ptr error = cancelAndWait(lock);
+    lock.unlock();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+protected:
+  /// Returns what the task threw, if anything
+  std::exception_ptr cancelAndWait(std::unique_lock<std::mutex> &lock) {
+    cancelled_ = true;
+    task_ = nullptr;
+    changed_.wait(lock, [this]() { return !running_; });
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    return error;
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      changed_.wait(lock, [this]() { return stopping_ || bool(task_); });
+      if (stopping_) {
+        return;
+      }
+      Task task = std::move(task_);
+      task_ = nullptr;
+      running_ = true;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        task(cancelled_);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      error_ = error;
+      running_ = false;
+      changed_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  Task task_;
+  bool running_;
+  std::atomic<bool> cancelled_;
+  bool stopping_;
+  std::exception_ptr error_;
+  /// Started with the first task
+  std::thread thread_;
+};
+
 class Configuration {
 public:
+  /**
+   * Called on a background thread with each state in which an opponent must
+   * act, for work that can be done before this agent's next decision. The
+   * task is cancelled, and waited for, before the next state is handed to
+   * the agent, so the agent's callbacks never run at the same time as it.
+   */
+  typedef std::function<void(const MatchState &,
+                             const std::atomic<bool> &cancelled)>
+      OpponentToAct;
+  /// Chooses an action, with the time left for the decision in the budget
+  typedef std::function<Action(const MatchState &, const TimeBudget &)>
+      TimedAction;
+
   Configuration(const std::string &gameDefPath, uint16_t port,
                 const std::string &host = "localhost")
       : gameDef_(gameDefPath), dealer_(port, host) {
@@ -382,8 +679,31 @@ public:
       : gameDef_(gameDef), dealer_(port, host) {
     dealer_.connect();
   }
+  Configuration(const GameDef &gameDef, const UnixSocketPath &dealer)
+      : gameDef_(gameDef), dealer_(dealer) {
+    dealer_.connect();
+  }
+  Configuration(const GameDef &gameDef, const ConnectedSocket &dealer)
+      : gameDef_(gameDef), dealer_(dealer) {
+    dealer_.connect();
+  }
+  /// Plays over shared memory with a dealer that plays this agent with
+  /// Dealer::shmAgent, instead of with the text protocol
+  Configuration(const GameDef &gameDef, ShmChannel &dealer)
+      : gameDef_(gameDef), dealer_(0), shm_(&dealer) {}
   virtual ~Configuration(){};
 
+  /// Tracks time against the dealer's @p limits from now on, with deadlines
+  /// @p marginMicros early
+  void setTimeLimits(
+      const TimeLimits &limits,
+      uint64_t marginMicros = TimeBudget::DEFAULT_MARGIN_MICROS) {
+    budget_ = TimeBudget(limits, marginMicros);
+  }
+  const TimeBudget &timeBudget() const { return budget_; }
+
+  /// Reads the next state through the connection's stream. Not to be mixed
+  /// with forEveryMatchState, which reads from the socket itself.
   int nextMatchState(char *line) {
     assert(line);
     while (fgets(line, MAX_LINE_LEN, dealer_.fromServer_)) {
@@ -428,20 +748,112 @@ public:
     fflush(dealer_.toServer_);
   }
 
+  /**
+   * Plays the match, calling @p generateAction whenever this agent must act
+   * and @p doAtEndOfHand with every finished hand. If @p whileOpponentActs
+   * is set, it is started on the speculation slot with every state in which
+   * an opponent must act. Over shared memory, where the dealer only sends
+   * this agent's own turns, that is the state after each of its actions.
+   */
   void
   forEveryMatchState(std::function<Action(const MatchState &)> generateAction,
-                     std::function<void(const MatchState &)> doAtEndOfHand) {
-    int len;
-    char line[MAX_LINE_LEN];
+                     std::function<void(const MatchState &)> doAtEndOfHand,
+                     const OpponentToAct &whileOpponentActs = OpponentToAct()) {
+    forEveryMatchState(
+        [&generateAction](const MatchState &view, const TimeBudget &) {
+          return generateAction(view);
+        },
+        doAtEndOfHand, whileOpponentActs);
+  }
+  /**
+   * Like the above, but @p generateAction is also given the time budget,
+   * whose deadline is the latest it can return without breaking any of the
+   * limits set with setTimeLimits. Each decision is timed from when its
+   * state is read until its action is sent.
+   */
+  void forEveryMatchState(const TimedAction &generateAction,
+                          std::function<void(const MatchState &)> doAtEndOfHand,
+                          const OpponentToAct &whileOpponentActs =
+                              OpponentToAct()) {
+    auto speculate = [this, &whileOpponentActs](const MatchState &view) {
+      speculation_.start(
+          [view, &whileOpponentActs](const std::atomic<bool> &cancelled) {
+            whileOpponentActs(view, cancelled);
+          });
+    };
+
+    if (shm_) {
+      ShmStateRecord record;
+      while (shm_->toAgent.pop(record) && !record.matchOver) {
+        const auto received = TimeBudget::Clock::now();
+        speculation_.cancel();
+        state_ = record.state;
+        if (handFinished()) {
+          budget_.endHand();
+          doAtEndOfHand(state_);
+        } else if (mustAct()) {
+          budget_.startDecision(received);
+          const Action action = generateAction(state_, budget_);
+          assert(isValidAction(gameDef_.game_, &state_.state, 0,
+                               const_cast<Action *>(&action)));
+          shm_->toDealer.push(action);
+          budget_.endDecision();
+          if (whileOpponentActs) {
+            MatchState next = state_;
+            doAction(gameDef_.game_, &action, &next.state);
+            if (!stateFinished(&next.state) &&
+                currentPlayer(gameDef_.game_, &next.state) !=
+                    next.viewingPlayer) {
+              speculate(next);
+            }
+          }
+        }
+      }
+      speculation_.cancel();
+      return;
+    }
 
-    /* play the game! */
-    while ((len = nextMatchState(line)) > 0) {
-      if (handFinished()) {
+    /* play the game! States are read straight from the socket, and only
+       parsed in full when this agent acts or a hand ends */
+    MatchStateReader reader(gameDef_.game_, &state_);
+    int len;
+    while ((len = reader.next(dealer_.sock_)) > 0) {
+      const bool finished = reader.handFinished();
+      if (!finished && !reader.mustAct()) {
+        if (whileOpponentActs) {
+          if (!reader.parse()) {
+            len = -1;
+            break;
+          }
+          speculate(state_);
+        }
+        continue;
+      }
+      const auto received = TimeBudget::Clock::now();
+      speculation_.cancel();
+      if (!reader.parse()) {
+        len = -1;
+        break;
+      }
+      if (finished) {
+        budget_.endHand();
         doAtEndOfHand(state_);
-      } else if (mustAct()) {
-        sendAction(generateAction(state_), line, len);
+      } else {
+        budget_.startDecision(received);
+        Action action = generateAction(state_, budget_);
+        assert(isValidAction(gameDef_.game_, &state_.state, 0, &action));
+        if (!reader.respond(dealer_.sock_, action)) {
+          fprintf(stderr, "ERROR: could not get send response to server\n");
+          exit(EXIT_FAILURE);
+        }
+        budget_.endDecision();
       }
     }
+    speculation_.cancel();
+    if (len < 0) {
+      fprintf(stderr, "ERROR: could not read state_ %s\n", reader.line());
+      exit(EXIT_FAILURE);
+    }
   }
 
   bool mustAct() const {
@@ -459,7 +871,10 @@ public:
 
 protected:
   DealerConnection dealer_;
+  ShmChannel *shm_ = nullptr;
   MatchState state_;
+  SpeculationSlot speculation_;
+  TimeBudget budget_;
 };
 
 constexpr double complementaryProb(double p) { return 1.0 - p; }
@@ -534,7 +949,7 @@ bool actionIsAtEndOfSequence(const Action &action, const MatchState &view) {
 }
 
 template <class Container>
-double regretMatching(const Container regrets, size_t actionIndex) {
+double regretMatching(const Container &regrets, size_t actionIndex) {
   assert(actionIndex < regrets.size());
 
   const double sumOfPosRegrets =
@@ -549,8 +964,79 @@ double regretMatching(const Container regrets, size_t actionIndex) {
               : (1.0 / regrets.size()));
 }
 
+/**
+ * Writes the regret matching strategy for one information set's @p regrets
+ * into @p strategy.
+ */
+template <class ArraySize>
+void regretMatching(const double *__restrict regrets, ArraySize numActions,
+                    double *__restrict strategy) {
+  assert(regrets);
+  assert(strategy);
+  assert(numActions > 0);
+
+  double sumOfPosRegrets = 0.0;
+  for (size_t a = 0; a < size_t(numActions); ++a) {
+    strategy[a] = regrets[a] > 0.0 ? regrets[a] : 0.0;
+    sumOfPosRegrets += strategy[a];
+  }
+  // Branch free so that the loop vectorizes
+  const double scale = sumOfPosRegrets > 0.0 ? 1.0 / sumOfPosRegrets : 0.0;
+  const double uniform = sumOfPosRegrets > 0.0 ? 0.0 : 1.0 / numActions;
+  for (size_t a = 0; a < size_t(numActions); ++a) {
+    strategy[a] = strategy[a] * scale + uniform;
+  }
+}
+
+/**
+ * Regret matching over a contiguous block of @p numInfoSets information
+ * sets, each with @p numActions regrets, laid out row by row. @p strategies
+ * must have room for the same number of elements and may not alias
+ * @p regrets.
+ */
+template <class ArraySize>
+void regretMatching(const double *__restrict regrets, ArraySize numInfoSets,
+                    ArraySize numActions, double *__restrict strategies) {
+  assert(regrets);
+  assert(strategies);
+
+  for (size_t i = 0; i < size_t(numInfoSets); ++i) {
+    regretMatching(&regrets[i * numActions], numActions,
+                   &strategies[i * numActions]);
+  }
+}
+
+/**
+ * Like the batched regretMatching above, but with the number of actions
+ * known at compile time so that the work for each action is unrolled and
+ * the loop over information sets vectorizes.
+ */
+template <size_t numActions, class ArraySize>
+void regretMatching(const double *__restrict regrets, ArraySize numInfoSets,
+                    double *__restrict strategies) {
+  static_assert(numActions > 0, "Information sets must have an action");
+  assert(regrets);
+  assert(strategies);
+
+  for (size_t i = 0; i < size_t(numInfoSets); ++i) {
+    const double *__restrict r = &regrets[i * numActions];
+    double *__restrict s = &strategies[i * numActions];
+
+    double sumOfPosRegrets = 0.0;
+    for (size_t a = 0; a < numActions; ++a) {
+      s[a] = r[a] > 0.0 ? r[a] : 0.0;
+      sumOfPosRegrets += s[a];
+    }
+    const double scale = sumOfPosRegrets > 0.0 ? 1.0 / sumOfPosRegrets : 0.0;
+    const double uniform = sumOfPosRegrets > 0.0 ? 0.0 : 1.0 / numActions;
+    for (size_t a = 0; a < numActions; ++a) {
+      s[a] = s[a] * scale + uniform;
+    }
+  }
+}
+
 template <class Container>
-double normalize(const Container values, size_t subjectIndex) {
+double normalize(const Container &values, size_t subjectIndex) {
   assert(subjectIndex < values.size());
 
   const double sumOfValues =
@@ -566,36 +1052,408 @@ double optimisticAveragingWeight(uint32_t handNum, Count infoSetCount,
   return (handNum - infoSetCount) * probIPlayToCurrentInfoSet;
 }
 
+constexpr uint64_t greatestCommonDivisor(uint64_t a, uint64_t b) {
+  while (b) {
+    const uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+/**
+ * Number of ways to choose @p k items from @p n. Each step divides before it
+ * multiplies, so this only overflows if the result does.
+ */
+constexpr uint64_t choose(const uint64_t n, const uint64_t k) {
+  if (k > n) {
+    return 0;
+  }
+  const uint64_t smallerK = n - k < k ? n - k : k;
+  uint64_t result = 1;
+  for (uint64_t i = 1; i <= smallerK; ++i) {
+    // result * (n - smallerK + i) is a multiple of i
+    const uint64_t g = greatestCommonDivisor(result, i);
+    result = (result / g) * ((n - smallerK + i) / (i / g));
+  }
+  return result;
+}
+
+/**
+ * Enumeration and ranking of every @p k card deal from @p numCards cards,
+ * where a deal is a bit mask of card indices. Ranks are colexicographic, so
+ * they run from 0 to size - 1 and can index flat arrays of per-deal values.
+ */
+template <size_t numCards, size_t k> struct KCardDeals {
+  static_assert(numCards <= 64, "Deals are stored in 64 bit masks");
+  static_assert(k <= numCards, "Cannot deal more cards than there are");
+  static_assert(k < 64, "forEach starts from a mask of the k lowest bits");
+
+  static constexpr uint64_t size = choose(numCards, k);
+
+  static constexpr uint64_t rank(uint64_t deal) {
+    uint64_t r = 0;
+    for (uint64_t i = 1; deal; ++i) {
+      r += choose(__builtin_ctzll(deal), i);
+      deal &= deal - 1;
+    }
+    return r;
+  }
+
+  static constexpr uint64_t unrank(uint64_t r) {
+    uint64_t deal = 0;
+    uint64_t card = numCards;
+    for (uint64_t i = k; i > 0; --i) {
+      do {
+        --card;
+      } while (choose(card, i) > r);
+      r -= choose(card, i);
+      deal |= uint64_t(1) << card;
+    }
+    return deal;
+  }
+
+  /// Calls @p fn with every deal in rank order, without allocating
+  template <class Fn> static void forEach(Fn fn) {
+    if (k == 0) {
+      fn(uint64_t(0));
+      return;
+    }
+    const uint64_t last = unrank(size - 1);
+    uint64_t deal = (uint64_t(1) << k) - 1;
+    while (true) {
+      fn(deal);
+      if (deal == last) {
+        return;
+      }
+      // Gosper's hack: the next larger mask with the same number of bits
+      const uint64_t lowest = deal & -deal;
+      const uint64_t ripple = deal + lowest;
+      deal = ripple | (((deal ^ ripple) >> 2) / lowest);
+    }
+  }
+};
+
+template <size_t numCards, size_t k>
+constexpr uint64_t KCardDeals<numCards, k>::size;
+
 template <size_t numCards> class Deck {
 public:
   constexpr Deck() : cardsRevealed_(){};
   virtual ~Deck(){};
 
   constexpr void reveal(const size_t cardIndex) {
-    cardsRevealed_[cardIndex] = 1;
+    cardsRevealed_[cardIndex / 64] |= uint64_t(1) << (cardIndex % 64);
   }
   constexpr bool isRevealed(const size_t cardIndex) const {
-    return cardsRevealed_[cardIndex];
+    return (cardsRevealed_[cardIndex / 64] >> (cardIndex % 64)) & 1;
+  }
+  constexpr size_t numHiddenCards() const {
+    size_t numRevealed = 0;
+    for (size_t w = 0; w < NUM_WORDS; ++w) {
+      numRevealed += __builtin_popcountll(cardsRevealed_[w]);
+    }
+    return numCards - numRevealed;
+  }
+
+  /// Calls @p fn with the index of each hidden card in ascending order
+  template <class Fn> void forEachHiddenCard(Fn fn) const {
+    for (size_t w = 0; w < NUM_WORDS; ++w) {
+      uint64_t hidden = ~cardsRevealed_[w] & wordMask(w);
+      while (hidden) {
+        fn(w * 64 + __builtin_ctzll(hidden));
+        hidden &= hidden - 1;
+      }
+    }
+  }
+
+  /// Writes the hidden card indices to @p dest, which must have room for
+  /// numHiddenCards() of them, and returns how many were written
+  template <typename CardIndex> size_t hiddenCards(CardIndex *dest) const {
+    size_t i = 0;
+    forEachHiddenCard([dest, &i](size_t card) {
+      dest[i] = CardIndex(card);
+      ++i;
+    });
+    return i;
   }
-  constexpr size_t numHiddenCards() const { return (~cardsRevealed_).count(); }
 
   template <typename CardIndex> std::vector<CardIndex> hiddenCards() const {
     std::vector<CardIndex> hiddenCards_(numHiddenCards());
-    size_t i = 0;
-    for (size_t card = 0; card < cardsRevealed_.size(); ++card) {
-      if (!isRevealed(card)) {
-        hiddenCards_[i] = CardIndex(card);
+    hiddenCards(hiddenCards_.data());
+    return hiddenCards_;
+  }
+
+  /**
+   * Calls @p fn with every combination of @p k hidden cards, as a pointer to
+   * their indices in ascending order, without allocating. Combinations come
+   * in colexicographic order, so their KCardDeals ranks increase.
+   */
+  template <size_t k, class Fn> void forEachDeal(Fn fn) const {
+    size_t hidden[numCards];
+    const size_t numHidden = hiddenCards(hidden);
+    if (k > numHidden) {
+      return;
+    }
+    size_t positions[k + 1];
+    size_t cards[k + 1];
+    for (size_t i = 0; i < k; ++i) {
+      positions[i] = i;
+      cards[i] = hidden[i];
+    }
+    positions[k] = numHidden;
+    while (true) {
+      fn(static_cast<const size_t *>(cards));
+
+      // Advance the leftmost position that has room to move and reset the
+      // ones before it
+      size_t i = 0;
+      while (i < k && positions[i] + 1 == positions[i + 1]) {
         ++i;
       }
+      if (i == k) {
+        return;
+      }
+      ++positions[i];
+      cards[i] = hidden[positions[i]];
+      for (size_t j = 0; j < i; ++j) {
+        positions[j] = j;
+        cards[j] = hidden[j];
+      }
     }
-    return hiddenCards_;
   }
 
 private:
-  std::bitset<numCards> cardsRevealed_;
+  static constexpr size_t NUM_WORDS = (numCards + 63) / 64;
+
+  static constexpr uint64_t wordMask(const size_t word) {
+    return (word + 1) * 64 <= numCards
+               ? ~uint64_t(0)
+               : (uint64_t(1) << (numCards % 64)) - 1;
+  }
+
+  uint64_t cardsRevealed_[NUM_WORDS];
 };
 
 namespace Dealer {
+/**
+ * How the dealer writes a log or transaction file. By default the game loop
+ * writes and flushes the file itself after every hand in the log file, and
+ * every action in the transaction file. A buffered file is instead written
+ * by a background thread as @p flush directs, see openBufferedLog.
+ */
+struct LogPolicy {
+  bool buffered;
+  LogFlushPolicy flush;
+  /// Hands or actions for LOG_FLUSH_EVERY_N_RECORDS, microseconds for
+  /// LOG_FLUSH_EVERY_N_MICROS
+  uint64_t interval;
+  bool syncToDisk;
+  /// Transaction files only. If not 0, the file is binary, with a
+  /// checkpoint every this many hands, so resuming a match only replays
+  /// the actions since the last checkpoint.
+  uint32_t checkpointHands;
+
+  static LogPolicy direct() {
+    return LogPolicy{false, LOG_FLUSH_EVERY_RECORD, 0, false, 0};
+  }
+  static LogPolicy background(LogFlushPolicy flush, uint64_t interval = 0,
+                              bool syncToDisk = false) {
+    return LogPolicy{true, flush, interval, syncToDisk, 0};
+  }
+  LogPolicy checkpointed(uint32_t hands) const {
+    LogPolicy policy(*this);
+    policy.checkpointHands = hands;
+    return policy;
+  }
+};
+
+/**
+ * Opens @p matchName with @p extension in @p workingDirectory for writing,
+ * or for appending if @p append is set, to be written as @p policy directs.
+ * Returns NULL on failure, so that only the match it was for fails.
+ */
+FILE *openMatchFile(const std::string &workingDirectory,
+                    const std::string &matchName,
+                    const std::string &extension, bool append,
+                    const LogPolicy &policy = LogPolicy::direct()) {
+  const std::string name = workingDirectory + "/" + matchName + extension;
+  FILE *file = fopen(name.c_str(), append ? "a+" : "w");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: could not open %s\n", name.c_str());
+    return NULL;
+  }
+  if (policy.buffered) {
+    FILE *buffered = openBufferedLog(file, policy.flush, policy.interval,
+                                     policy.syncToDisk);
+    if (buffered == NULL) {
+      fprintf(stderr, "ERROR: could not start buffered writing of %s\n",
+              name.c_str());
+      fclose(file);
+    }
+    return buffered;
+  }
+  return file;
+}
+
+/**
+ * Opens the log and transaction files a match uses with openMatchFile,
+ * setting each to NULL if it is not used. Returns false, with neither
+ * open, if either could not be opened.
+ */
+bool openMatchFiles(const std::string &workingDirectory,
+                    const std::string &matchName, bool append,
+                    bool useLogFile, bool useTransactionFile,
+                    const LogPolicy &logPolicy,
+                    const LogPolicy &transactionPolicy, FILE **logFile,
+                    FILE **transactionFile) {
+  *logFile = useLogFile ? openMatchFile(workingDirectory, matchName, ".log",
+                                        append, logPolicy)
+                        : NULL;
+  *transactionFile =
+      useTransactionFile ? openMatchFile(workingDirectory, matchName, ".tlog",
+                                         append, transactionPolicy)
+                         : NULL;
+  if ((useLogFile && *logFile == NULL) ||
+      (useTransactionFile && *transactionFile == NULL)) {
+    if (*logFile != NULL) {
+      fclose(*logFile);
+      *logFile = NULL;
+    }
+    if (*transactionFile != NULL) {
+      fclose(*transactionFile);
+      *transactionFile = NULL;
+    }
+    return false;
+  }
+  return true;
+}
+
+/**
+ * The cards of every hand of a match, dealt before it starts so the game
+ * loop only copies each hand's cards instead of shuffling. A match played
+ * with the Deals generated from a seed is identical to one dealt from that
+ * seed. The same Deals can be shared by any number of matches, like the
+ * permutations of a duplicate match, and saved to be replayed later.
+ */
+class Deals {
+public:
+  Deals() : numHands_(0), cardsPerHand_(0), cards_() {}
+
+  /// Deals @p numHands hands of @p gameDef exactly as a match from @p seed
+  static Deals generate(const GameDef &gameDef, uint32_t seed,
+                        uint32_t numHands) {
+    const Game *game = gameDef.game();
+    Deals deals(numHands, dealScheduleCardsPerHand(game));
+    rng_state_t rng;
+    init_genrand(&rng, seed);
+    fillDealSchedule(game, &rng, numHands, deals.cards_.data());
+    return deals;
+  }
+
+  /**
+   * The Deals for each of @p seeds, generated by a worker per hardware
+   * thread that takes the next seed until none are left. Each match's
+   * cards come from one sequential generator, so a set of matches is the
+   * unit of parallelism.
+   */
+  static std::vector<Deals> generate(const GameDef &gameDef,
+                                     const std::vector<uint32_t> &seeds,
+                                     uint32_t numHands) {
+    std::vector<Deals> deals(seeds.size());
+    std::atomic<size_t> nextSeed(0);
+    auto work = [&gameDef, &seeds, &deals, &nextSeed, numHands]() {
+      for (size_t i = nextSeed++; i < seeds.size(); i = nextSeed++) {
+        deals[i] = generate(gameDef, seeds[i], numHands);
+      }
+    };
+    const size_t numWorkers = std::min<size_t>(
+        seeds.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (size_t w = 1; w < numWorkers; ++w) {
+      workers.emplace_back(work);
+    }
+    work();
+    for (auto &t : workers) {
+      t.join();
+    }
+    return deals;
+  }
+
+  /// Reads Deals for @p gameDef written by save. Throws on failure.
+  static Deals load(const std::string &path, const GameDef &gameDef) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+      throw std::runtime_error("Could not open " + path);
+    }
+    char magic[MAGIC_LEN];
+    uint32_t numHands;
+    uint8_t cardsPerHand;
+    if (fread(magic, MAGIC_LEN, 1, file) != 1 ||
+        memcmp(magic, MAGIC, MAGIC_LEN) != 0 ||
+        fread(&numHands, sizeof(numHands), 1, file) != 1 ||
+        fread(&cardsPerHand, sizeof(cardsPerHand), 1, file) != 1) {
+      fclose(file);
+      throw std::runtime_error(path + " is not a deals file");
+    }
+    if (cardsPerHand != dealScheduleCardsPerHand(gameDef.game())) {
+      fclose(file);
+      throw std::runtime_error(path + " was not dealt for this game");
+    }
+    Deals deals(numHands, cardsPerHand);
+    const bool complete = fread(deals.cards_.data(), 1, deals.cards_.size(),
+                                file) == deals.cards_.size();
+    fclose(file);
+    if (!complete) {
+      throw std::runtime_error(path + " is truncated");
+    }
+    return deals;
+  }
+
+  /// Writes these Deals to @p path. Throws on failure.
+  void save(const std::string &path) const {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+      throw std::runtime_error("Could not open " + path);
+    }
+    const bool written =
+        fwrite(MAGIC, MAGIC_LEN, 1, file) == 1 &&
+        fwrite(&numHands_, sizeof(numHands_), 1, file) == 1 &&
+        fwrite(&cardsPerHand_, sizeof(cardsPerHand_), 1, file) == 1 &&
+        fwrite(cards_.data(), 1, cards_.size(), file) == cards_.size();
+    if (fclose(file) != 0 || !written) {
+      throw std::runtime_error("Could not write " + path);
+    }
+  }
+
+  uint32_t numHands() const { return numHands_; }
+  const std::vector<uint8_t> &cards() const { return cards_; }
+
+  /// A view of these Deals for the game loop, valid while they are
+  DealSchedule schedule() const {
+    return DealSchedule{numHands_, cardsPerHand_, cards_.data()};
+  }
+
+protected:
+  static constexpr const char *MAGIC = "ACPCDEAL";
+  static const size_t MAGIC_LEN = 8;
+
+  Deals(uint32_t numHands, uint8_t cardsPerHand)
+      : numHands_(numHands), cardsPerHand_(cardsPerHand),
+        cards_(size_t(numHands) * cardsPerHand) {}
+
+  uint32_t numHands_;
+  uint8_t cardsPerHand_;
+  std::vector<uint8_t> cards_;
+};
+
+/**
+ * Plays a match between @p players over sockets. Each of @p listenSocket
+ * is either listening for its seat's player to connect, over TCP from
+ * getListenSocket or locally from getUnixListenSocket, or is already
+ * connected to the player, like one end of a socketpair. The sockets are
+ * closed when the match ends, whether or not it fails.
+ */
 int startMatch(const std::string &matchName, const GameDef &gameDef,
                const std::vector<std::string> &players,
                const std::vector<int> &listenSocket,
@@ -614,13 +1472,20 @@ int startMatch(const std::string &matchName, const GameDef &gameDef,
                /* by default, overwrite preexisting log/transaction files */
                bool append = 0,
                /* use log file, don't use transaction file */
-               bool useLogFile = 0, bool useTransactionFile = 0) {
+               bool useLogFile = 0, bool useTransactionFile = 0,
+               /* write log files directly, flushing every hand or action */
+               const LogPolicy &logPolicy = LogPolicy::direct(),
+               const LogPolicy &transactionPolicy = LogPolicy::direct(),
+               /* if not NULL, record each seat's response times */
+               LatencyHistogram latency[MAX_PLAYERS] = NULL,
+               /* if not NULL, play these cards instead of dealing from seed */
+               const Deals *deals = nullptr) {
   Game *game = gameDef.game_;
 
-  FILE *logFile, *transactionFile;
+  FILE *logFile = NULL, *transactionFile = NULL;
 
   int i, v;
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
   socklen_t addrLen;
   ReadBuf *readBuf[MAX_PLAYERS];
   int seatFD[MAX_PLAYERS];
@@ -631,70 +1496,71 @@ int startMatch(const std::string &matchName, const GameDef &gameDef,
 
   struct timeval startTime, tv;
 
-  char name[MAX_LINE_LEN];
-
   for (int i = 0; i < game->numPlayers; ++i) {
-    seatName[i] =
-        static_cast<char *>(calloc(players[i].size(), sizeof(*seatName[i])));
+    seatName[i] = static_cast<char *>(
+        calloc(players[i].size() + 1, sizeof(*seatName[i])));
     memcpy(seatName[i], players[i].data(),
            sizeof(*seatName[i]) * players[i].size());
   }
 
   init_genrand(&rng, seed);
-  srandom(seed); /* used for random port selection */
-
-  if (useLogFile) {
-    const auto logFileName = workingDirectory + "/" + matchName + ".log";
-    memcpy(name, logFileName.data(), sizeof(*name) * logFileName.size());
-
-    /* create/open the log */
-    if (append) {
-      logFile = fopen(name, "a+");
-    } else {
-      logFile = fopen(name, "w");
+  const DealSchedule schedule = deals ? deals->schedule() : DealSchedule();
+
+  /* seats before this one have a seat FD and a read buffer, the others
+     still have only their listen socket */
+  int numSeated = 0;
+  // Every way out of the match, once its files are opened or failed to
+  auto endMatch = [&](int status) {
+    // Otherwise the last line or two of the log file
+    // won't be written sometimes when run through a
+    // Ruby interface. The log files are flushed when they are closed.
+    // fflush(NULL) would also wait on streams that other threads are
+    // blocked reading, like those of players in this process.
+    fflush(stderr);
+    fflush(stdout);
+    if (transactionFile != NULL) {
+      fclose(transactionFile);
     }
-    if (logFile == NULL) {
-
-      fprintf(stderr, "ERROR: could not open log file %s\n", name);
-      exit(EXIT_FAILURE);
-    }
-  } else {
-    /* no log file */
-
-    logFile = NULL;
-  }
-
-  if (useTransactionFile) {
-    const auto transactionFileName =
-        workingDirectory + "/" + matchName + ".tlog";
-    memcpy(name, transactionFileName.data(),
-           sizeof(*name) * transactionFileName.size());
-
-    /* create/open the transaction log */
-    if (append) {
-      transactionFile = fopen(name, "a+");
-    } else {
-      transactionFile = fopen(name, "w");
+    if (logFile != NULL) {
+      fclose(logFile);
     }
-    if (transactionFile == NULL) {
 
-      fprintf(stderr, "ERROR: could not open transaction file %s\n", name);
-      exit(EXIT_FAILURE);
+    for (int i = 0; i < game->numPlayers; ++i) {
+      if (i < numSeated) {
+        /* also closes the seat FD */
+        destroyReadBuf(readBuf[i]);
+      } else {
+        close(listenSocket[i]);
+      }
+      FREE_POINTER(seatName[i]);
     }
-  } else {
-    /* no transaction file */
+    return status;
+  };
 
-    transactionFile = NULL;
+  if (!openMatchFiles(workingDirectory, matchName, append, useLogFile,
+                      useTransactionFile, logPolicy, transactionPolicy,
+                      &logFile, &transactionFile)) {
+    return endMatch(EXIT_FAILURE);
   }
 
   /* set up the error info */
   initErrorInfo(maxInvalidActions, maxResponseMicros, maxUsedHandMicros,
                 maxUsedPerHandMicros * numHands, &errorInfo);
+  errorInfo.latency = latency;
 
   /* wait for each player to connect */
   gettimeofday(&startTime, NULL);
   for (i = 0; i < game->numPlayers; ++i) {
 
+    if (!isListenSocket(listenSocket[i])) {
+      /* already connected */
+
+      seatFD[i] = listenSocket[i];
+      readBuf[i] = createReadBuf(seatFD[i]);
+      numSeated = i + 1;
+      continue;
+    }
+
     if (startTimeoutMicros >= 0) {
       int64_t startTimeLeft;
       fd_set fds;
@@ -718,7 +1584,7 @@ int startMatch(const std::string &matchName, const GameDef &gameDef,
 
         fprintf(stderr, "ERROR: timed out waiting for seat %d to connect\n",
                 i + 1);
-        return EXIT_FAILURE;
+        return endMatch(EXIT_FAILURE);
       }
     }
 
@@ -726,47 +1592,186 @@ int startMatch(const std::string &matchName, const GameDef &gameDef,
     seatFD[i] = accept(listenSocket[i], (struct sockaddr *)&addr, &addrLen);
     if (seatFD[i] < 0) {
       fprintf(stderr, "ERROR: seat %d could not connect\n", i + 1);
-      return EXIT_FAILURE;
+      return endMatch(EXIT_FAILURE);
     }
     close(listenSocket[i]);
 
+    /* fails harmlessly on unix domain sockets */
     v = 1;
     setsockopt(seatFD[i], IPPROTO_TCP, TCP_NODELAY, (char *)&v, sizeof(int));
 
     readBuf[i] = createReadBuf(seatFD[i]);
-  }
-
-  for (int i = 0; i < game->numPlayers; ++i) {
-    readBuf[i] = createReadBuf(seatFD[i]);
+    numSeated = i + 1;
   }
 
   /* play the match */
-  if (gameLoop(game, seatName, numHands, quiet, fixedSeats, &rng, &errorInfo,
-               seatFD, readBuf, logFile, transactionFile) < 0) {
+  if (gameLoop(game, seatName, numHands, quiet, fixedSeats, &rng,
+               deals ? &schedule : NULL, &errorInfo, seatFD, readBuf, logFile,
+               transactionFile,
+               transactionPolicy.checkpointHands) < 0) {
     /* should have already printed an error message */
 
+    return endMatch(EXIT_FAILURE);
+  }
+
+  return endMatch(EXIT_SUCCESS);
+}
+
+/// An agent that plays in the dealer's process, see playMatch
+struct Agent {
+  std::string name;
+  std::function<Action(const MatchState &)> generateAction;
+  std::function<void(const MatchState &)> doAtEndOfHand;
+};
+
+/// Passed through inProcessGameLoop to the callbacks for one agent
+struct AgentCall {
+  const Agent *agent;
+  std::exception_ptr *error;
+};
+
+/// Exceptions must not unwind through the C game loop, so they are held
+/// until it returns
+int getAgentAction(const Game *, const MatchState *state, void *data,
+                   Action *action) {
+  const AgentCall &call = *static_cast<const AgentCall *>(data);
+  if (*call.error) {
+    return -1;
+  }
+  try {
+    *action = call.agent->generateAction(*state);
+  } catch (...) {
+    *call.error = std::current_exception();
+    return -1;
+  }
+  return 0;
+}
+
+void agentHandFinished(const Game *, const MatchState *state, void *data) {
+  const AgentCall &call = *static_cast<const AgentCall *>(data);
+  if (*call.error || !call.agent->doAtEndOfHand) {
+    return;
+  }
+  try {
+    call.agent->doAtEndOfHand(*state);
+  } catch (...) {
+    *call.error = std::current_exception();
+  }
+}
+
+/**
+ * Plays a match like startMatch, with the same rules, seat rotation, and
+ * log files, but between @p agents in this process, in seat order, so no
+ * messages are printed, sent, or parsed. Each agent only sees its own view
+ * of the cards. An exception thrown by an agent stops the match and is
+ * rethrown.
+ */
+int playMatch(const std::string &matchName, const GameDef &gameDef,
+              const std::vector<Agent> &agents,
+              const std::string &workingDirectory, uint32_t numHands = 3000,
+              uint32_t seed = 98723209,
+              uint32_t maxInvalidActions = DEFAULT_MAX_INVALID_ACTIONS,
+              uint64_t maxResponseMicros = DEFAULT_MAX_RESPONSE_MICROS,
+              uint64_t maxUsedHandMicros = DEFAULT_MAX_USED_HAND_MICROS,
+              uint64_t maxUsedPerHandMicros = DEFAULT_MAX_USED_PER_HAND_MICROS,
+              /* players rotate around the table */
+              bool fixedSeats = 0,
+              /* print all messages */
+              bool quiet = 1,
+              /* by default, overwrite preexisting log/transaction files */
+              bool append = 0,
+              /* use log file, don't use transaction file */
+              bool useLogFile = 0, bool useTransactionFile = 0,
+              /* write log files directly, flushing every hand or action */
+              const LogPolicy &logPolicy = LogPolicy::direct(),
+              const LogPolicy &transactionPolicy = LogPolicy::direct(),
+              /* if not NULL, record each seat's response times */
+              LatencyHistogram latency[MAX_PLAYERS] = NULL,
+              /* if not NULL, play these cards instead of dealing from seed */
+              const Deals *deals = nullptr) {
+  const Game *game = gameDef.game_;
+  assert(agents.size() == game->numPlayers);
+
+  std::exception_ptr error;
+  AgentCall calls[MAX_PLAYERS];
+  InProcessAgent inProcessAgents[MAX_PLAYERS];
+  char *seatName[MAX_PLAYERS];
+  for (uint8_t s = 0; s < game->numPlayers; ++s) {
+    calls[s] = AgentCall{&agents[s], &error};
+    inProcessAgents[s] =
+        InProcessAgent{getAgentAction, agentHandFinished, &calls[s]};
+    seatName[s] = const_cast<char *>(agents[s].name.c_str());
+  }
+
+  rng_state_t rng;
+  init_genrand(&rng, seed);
+  const DealSchedule schedule = deals ? deals->schedule() : DealSchedule();
+
+  FILE *logFile, *transactionFile;
+  if (!openMatchFiles(workingDirectory, matchName, append, useLogFile,
+                      useTransactionFile, logPolicy, transactionPolicy,
+                      &logFile, &transactionFile)) {
     return EXIT_FAILURE;
   }
 
-  // fflush( stderr );
-  // fflush( stdout );
-  // Otherwise the last line or two of the log file
-  // won't be written sometimes when run through a
-  // Ruby interface.
-  fflush(NULL);
+  ErrorInfo errorInfo;
+  initErrorInfo(maxInvalidActions, maxResponseMicros, maxUsedHandMicros,
+                maxUsedPerHandMicros * numHands, &errorInfo);
+  errorInfo.latency = latency;
+
+  const int result = inProcessGameLoop(game, seatName, numHands, quiet,
+                                       fixedSeats, &rng,
+                                       deals ? &schedule : NULL, &errorInfo,
+                                       inProcessAgents, logFile,
+                                       transactionFile,
+                                       transactionPolicy.checkpointHands);
   if (transactionFile != NULL) {
     fclose(transactionFile);
   }
   if (logFile != NULL) {
     fclose(logFile);
   }
-
-  for (int i = 0; i < game->numPlayers; ++i) {
-    close(seatFD[i]);
-    FREE_POINTER(seatName[i]);
+  if (error) {
+    std::rethrow_exception(error);
   }
+  return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * An agent for playMatch whose decisions are made in another process,
+ * which plays over @p channel with Configuration. States and actions go
+ * through the channel's shared memory rings instead of a socket. Throws
+ * if the other side does not respond within @p timeoutMicros. Once the
+ * match is over, endShmMatch must be called to let the other side finish.
+ */
+Agent shmAgent(const std::string &name, ShmChannel &channel,
+               int64_t timeoutMicros = DEFAULT_MAX_RESPONSE_MICROS) {
+  auto send = [&channel, name, timeoutMicros](const MatchState &view) {
+    ShmStateRecord record;
+    record.matchOver = false;
+    record.state = view;
+    if (!channel.toAgent.push(record, timeoutMicros)) {
+      throw std::runtime_error("Timed out sending a state to " + name);
+    }
+  };
+  return Agent{name,
+               [&channel, name, timeoutMicros, send](const MatchState &view) {
+                 send(view);
+                 Action action;
+                 if (!channel.toDealer.pop(action, timeoutMicros)) {
+                   throw std::runtime_error("Timed out waiting for " + name);
+                 }
+                 return action;
+               },
+               send};
+}
 
-  return EXIT_SUCCESS;
+/// Tells the other side of @p channel that the match is over
+void endShmMatch(ShmChannel &channel,
+                 int64_t timeoutMicros = DEFAULT_MAX_RESPONSE_MICROS) {
+  ShmStateRecord record;
+  record.matchOver = true;
+  channel.toAgent.push(record, timeoutMicros);
 }
 }
 }
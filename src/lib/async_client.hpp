@@ -0,0 +1,513 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lib/acpc.hpp>
+
+extern "C" {
+#include <lib/dealer.h>
+#include <game.h>
+#include <net.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * A client that plays many matches at once, each over its own connection
+ * to a dealer. One thread waits on every connection with epoll, reads and
+ * parses the dealer's states without blocking, and hands each state that
+ * needs an agent callback to a pool of worker threads. Finished workers
+ * wake the epoll thread through an eventfd to send their actions. What a
+ * connection can't take yet is queued and sent once epoll reports it
+ * writable, so a dealer that stops reading doesn't hold up the others.
+ *
+ * Each match's callbacks are called one at a time and in the order of its
+ * states, so an agent only has to be safe to call from several threads if
+ * it plays in several matches.
+ */
+class AsyncClient {
+public:
+  static const int MAX_EVENTS = 256;
+  static const int RUNNING = -1;
+
+  typedef std::function<Action(const MatchState &)> ActionGenerator;
+  typedef std::function<void(const MatchState &)> HandObserver;
+
+  explicit AsyncClient(size_t numWorkers = defaultNumWorkers())
+      : epollFD_(epoll_create1(0)), wakeFD_(eventfd(0, EFD_NONBLOCK)),
+        matches_(), numRunning_(0), tasksMutex_(), tasksReady_(), tasks_(),
+        doneMutex_(), done_(), stopping_(false), workers_() {
+    if (epollFD_ < 0 || wakeFD_ < 0) {
+      throw std::runtime_error(std::string("Could not create epoll: ") +
+                               strerror(errno));
+    }
+    watch(wakeFD_, WAKE_KEY);
+    assert(numWorkers > 0);
+    for (size_t w = 0; w < numWorkers; ++w) {
+      workers_.emplace_back([this]() { work(); });
+    }
+  }
+  virtual ~AsyncClient() {
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex_);
+      stopping_ = true;
+    }
+    tasksReady_.notify_all();
+    for (auto &w : workers_) {
+      w.join();
+    }
+    for (size_t m = 0; m < matches_.size(); ++m) {
+      if (matches_[m]->status == RUNNING) {
+        endMatch(m, EXIT_FAILURE);
+      }
+    }
+    close(wakeFD_);
+    close(epollFD_);
+  }
+
+  /**
+   * Connects to the dealer of a new match at @p host and @p port and sends
+   * the version string. @p generateAction is called whenever the agent
+   * must act, and @p doAtEndOfHand, which may be empty, with every
+   * finished hand. Returns the match's index.
+   */
+  size_t addMatch(const GameDef &gameDef, uint16_t port,
+                  const ActionGenerator &generateAction,
+                  const HandObserver &doAtEndOfHand = HandObserver(),
+                  const std::string &host = "localhost") {
+    std::vector<char> hostName(host.begin(), host.end());
+    hostName.push_back(0);
+    return addConnectedMatch(gameDef, connectTo(hostName.data(), port),
+                             generateAction, doAtEndOfHand);
+  }
+  size_t addMatch(const GameDef &gameDef, const UnixSocketPath &dealer,
+                  const ActionGenerator &generateAction,
+                  const HandObserver &doAtEndOfHand = HandObserver()) {
+    return addConnectedMatch(gameDef,
+                             connectToUnixSocket(dealer.path.c_str()),
+                             generateAction, doAtEndOfHand);
+  }
+  size_t addMatch(const GameDef &gameDef, const ConnectedSocket &dealer,
+                  const ActionGenerator &generateAction,
+                  const HandObserver &doAtEndOfHand = HandObserver()) {
+    return addConnectedMatch(gameDef, dealer.fd, generateAction,
+                             doAtEndOfHand);
+  }
+
+  size_t numMatches() const { return matches_.size(); }
+  size_t numRunningMatches() const { return numRunning_; }
+
+  /// RUNNING until match @p m ends, then EXIT_SUCCESS or EXIT_FAILURE
+  int status(size_t m) const { return matches_[m]->status; }
+
+  /// Empty unless a callback of match @p m threw an exception
+  const std::string &error(size_t m) const { return matches_[m]->error; }
+
+  /// Plays every match until the dealers have closed their connections
+  void run() {
+    epoll_event events[MAX_EVENTS];
+    while (numRunning_ > 0) {
+      const int n = epoll_wait(epollFD_, events, MAX_EVENTS, -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(std::string("epoll_wait failed: ") +
+                                 strerror(errno));
+      }
+      for (int e = 0; e < n; ++e) {
+        const uint64_t k = events[e].data.u64;
+        if (k == WAKE_KEY) {
+          finishTasks();
+          continue;
+        }
+        if ((events[e].events & EPOLLOUT) && matches_[k]->status == RUNNING &&
+            !sendUnsent(k)) {
+          fprintf(stderr, "ERROR: could not send response to the dealer\n");
+          endMatch(k, EXIT_FAILURE);
+        }
+        if ((events[e].events & ~EPOLLOUT) &&
+            matches_[k]->status == RUNNING) {
+          readMatch(k);
+        }
+      }
+    }
+  }
+
+  static size_t defaultNumWorkers() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  static const uint64_t WAKE_KEY = UINT64_MAX;
+
+  struct Match;
+  /// A state that needs a callback, and the line it was read from
+  struct Task {
+    size_t match;
+    /// Only its callbacks, which do not change, are used by the worker
+    const Match *owner;
+    MatchState state;
+    std::string line;
+    bool mustAct;
+    /// Set by the worker
+    std::string response;
+    std::string error;
+  };
+
+  struct Match {
+    Match(const GameDef &gameDef_, int fd_,
+          const ActionGenerator &generateAction_,
+          const HandObserver &doAtEndOfHand_)
+        : gameDef(gameDef_), fd(fd_), generateAction(generateAction_),
+          doAtEndOfHand(doAtEndOfHand_), lineBuffer(), unsent(),
+          waitingToSend(false), pending(), busy(false), closed(false),
+          error(), status(RUNNING) {}
+
+    const GameDef gameDef;
+    int fd;
+    ActionGenerator generateAction;
+    HandObserver doAtEndOfHand;
+    /// Input that does not yet end in a new-line
+    std::string lineBuffer;
+    /// Output the socket could not take yet, and whether epoll is watching
+    /// for it to become writable
+    std::string unsent;
+    bool waitingToSend;
+    /// Tasks waiting for the one a worker has to finish
+    std::deque<std::unique_ptr<Task>> pending;
+    bool busy;
+    /// The dealer closed the connection
+    bool closed;
+    std::string error;
+    int status;
+  };
+
+  size_t addConnectedMatch(const GameDef &gameDef, const int fd,
+                           const ActionGenerator &generateAction,
+                           const HandObserver &doAtEndOfHand) {
+    if (fd < 0) {
+      throw std::runtime_error("Could not connect to the dealer");
+    }
+    const size_t m = matches_.size();
+    matches_.emplace_back(
+        new Match(gameDef, fd, generateAction, doAtEndOfHand));
+    ++numRunning_;
+
+    int v = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&v, sizeof(int));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    try {
+      watch(fd, m);
+    } catch (...) {
+      endMatch(m, EXIT_FAILURE);
+      throw;
+    }
+    char version[MAX_LINE_LEN];
+    const int len = snprintf(version, MAX_LINE_LEN,
+                             "VERSION:%" PRIu32 ".%" PRIu32 ".%" PRIu32 "\n",
+                             VERSION_MAJOR, VERSION_MINOR, VERSION_REVISION);
+    if (!sendToDealer(m, version, len)) {
+      endMatch(m, EXIT_FAILURE);
+      throw std::runtime_error("Could not send the version to the dealer");
+    }
+    return m;
+  }
+
+  void watch(const int fd, const uint64_t k, const uint32_t events = EPOLLIN,
+             const int op = EPOLL_CTL_ADD) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = k;
+    if (epoll_ctl(epollFD_, op, fd, &event) < 0) {
+      throw std::runtime_error(std::string("Could not watch socket: ") +
+                               strerror(errno));
+    }
+  }
+
+  /**
+   * Sends @p len bytes of @p data to the dealer of match @p m after any
+   * output still queued for it. Returns false if the connection failed.
+   */
+  bool sendToDealer(const size_t m, const char *data, size_t len) {
+    Match &match = *matches_[m];
+    const bool queued = !match.unsent.empty();
+    match.unsent.append(data, len);
+    return queued || sendUnsent(m);
+  }
+
+  /**
+   * Writes as much of match @p m's queued output as its socket takes, and
+   * watches for the socket to become writable while any is left. Returns
+   * false if the connection failed.
+   */
+  bool sendUnsent(const size_t m) {
+    Match &match = *matches_[m];
+    size_t sent = 0;
+    while (sent < match.unsent.size()) {
+      const ssize_t n = write(match.fd, match.unsent.data() + sent,
+                              match.unsent.size() - sent);
+      if (n > 0) {
+        sent += n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      return false;
+    }
+    match.unsent.erase(0, sent);
+    if (match.closed) {
+      // The connection is no longer watched, and the dealer has gone
+      match.unsent.clear();
+      return true;
+    }
+    const bool mustWait = !match.unsent.empty();
+    if (mustWait != match.waitingToSend) {
+      try {
+        watch(match.fd, m, mustWait ? EPOLLIN | EPOLLOUT : EPOLLIN,
+              EPOLL_CTL_MOD);
+      } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return false;
+      }
+      match.waitingToSend = mustWait;
+    }
+    return true;
+  }
+
+  void readMatch(const size_t m) {
+    Match &match = *matches_[m];
+    char buffer[READBUF_LEN];
+    while (true) {
+      const ssize_t n = read(match.fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        match.lineBuffer.append(buffer, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      // The dealer closed the connection, so the match is over once the
+      // states it sent have been handled
+      match.closed = true;
+      epoll_ctl(epollFD_, EPOLL_CTL_DEL, match.fd, NULL);
+      break;
+    }
+    if (processLines(m)) {
+      endIfDone(m);
+    }
+  }
+
+  /// Returns false if the match has ended
+  bool processLines(const size_t m) {
+    Match &match = *matches_[m];
+    const Game *game = match.gameDef.game();
+    std::string &lines = match.lineBuffer;
+    size_t start = 0;
+    for (size_t end = lines.find('\n'); end != std::string::npos;
+         end = lines.find('\n', start)) {
+      std::string line = lines.substr(start, end - start);
+      start = end + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      /* ignore comments */
+      if (line.empty() || line[0] == '#' || line[0] == ';') {
+        continue;
+      }
+
+      std::unique_ptr<Task> task(new Task());
+      task->match = m;
+      task->owner = &match;
+      if (readMatchState(line.c_str(), game, &task->state) < 0) {
+        fprintf(stderr, "ERROR: could not read state %s\n", line.c_str());
+        endMatch(m, EXIT_FAILURE);
+        return false;
+      }
+      task->mustAct = !stateFinished(&task->state.state) &&
+                      currentPlayer(game, &task->state.state) ==
+                          task->state.viewingPlayer;
+      if (!task->mustAct &&
+          !(stateFinished(&task->state.state) && match.doAtEndOfHand)) {
+        continue;
+      }
+      task->line = std::move(line);
+      if (match.busy) {
+        match.pending.push_back(std::move(task));
+      } else {
+        match.busy = true;
+        submit(std::move(task));
+      }
+    }
+    lines.erase(0, start);
+    if (lines.size() >= MAX_LINE_LEN) {
+      fprintf(stderr, "ERROR: line from the dealer is too long\n");
+      endMatch(m, EXIT_FAILURE);
+      return false;
+    }
+    return true;
+  }
+
+  void submit(std::unique_ptr<Task> task) {
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex_);
+      tasks_.push_back(std::move(task));
+    }
+    tasksReady_.notify_one();
+  }
+
+  /// Runs on each worker thread until the client is destroyed
+  void work() {
+    while (true) {
+      std::unique_ptr<Task> task;
+      {
+        std::unique_lock<std::mutex> lock(tasksMutex_);
+        tasksReady_.wait(lock,
+                         [this]() { return stopping_ || !tasks_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      runTask(*task);
+      {
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        done_.push_back(std::move(task));
+      }
+      const uint64_t one = 1;
+      if (write(wakeFD_, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, so the epoll thread will wake
+      }
+    }
+  }
+
+  void runTask(Task &task) const {
+    const Match &match = *task.owner;
+    const Game *game = match.gameDef.game();
+    try {
+      if (!task.mustAct) {
+        match.doAtEndOfHand(task.state);
+        return;
+      }
+      Action action = match.generateAction(task.state);
+      if (!isValidAction(game, &task.state.state, 0, &action)) {
+        task.error = "invalid action";
+        return;
+      }
+      char printed[MAX_LINE_LEN];
+      if (printAction(game, &action, MAX_LINE_LEN, printed) < 0) {
+        task.error = "could not print action";
+        return;
+      }
+      task.response = task.line + ":" + printed + "\r\n";
+    } catch (const std::exception &e) {
+      task.error = e.what();
+    } catch (...) {
+      task.error = "unknown exception";
+    }
+  }
+
+  /// Sends the actions of finished tasks, and starts each match's next task
+  void finishTasks() {
+    uint64_t count;
+    if (read(wakeFD_, &count, sizeof(count)) < 0) {
+      // Another wake-up already cleared the counter
+    }
+    std::deque<std::unique_ptr<Task>> done;
+    {
+      std::lock_guard<std::mutex> lock(doneMutex_);
+      done.swap(done_);
+    }
+    for (auto &task : done) {
+      const size_t m = task->match;
+      Match &match = *matches_[m];
+      match.busy = false;
+      if (match.status != RUNNING) {
+        continue;
+      }
+      if (!task->error.empty()) {
+        match.error = task->error;
+        fprintf(stderr, "ERROR: %s\n", task->error.c_str());
+        endMatch(m, EXIT_FAILURE);
+        continue;
+      }
+      if (!task->response.empty() &&
+          !sendToDealer(m, task->response.data(), task->response.size())) {
+        fprintf(stderr, "ERROR: could not send response to the dealer\n");
+        endMatch(m, EXIT_FAILURE);
+        continue;
+      }
+      if (!match.pending.empty()) {
+        match.busy = true;
+        submit(std::move(match.pending.front()));
+        match.pending.pop_front();
+      }
+      endIfDone(m);
+    }
+  }
+
+  void endIfDone(const size_t m) {
+    const Match &match = *matches_[m];
+    if (match.status == RUNNING && match.closed && !match.busy) {
+      endMatch(m, EXIT_SUCCESS);
+    }
+  }
+
+  void endMatch(const size_t m, const int status) {
+    Match &match = *matches_[m];
+    assert(match.status == RUNNING);
+    match.status = status;
+    --numRunning_;
+
+    if (match.fd >= 0) {
+      close(match.fd);
+      match.fd = -1;
+    }
+    match.pending.clear();
+    std::string().swap(match.lineBuffer);
+    std::string().swap(match.unsent);
+  }
+
+  const int epollFD_;
+  const int wakeFD_;
+  std::vector<std::unique_ptr<Match>> matches_;
+  size_t numRunning_;
+
+  std::mutex tasksMutex_;
+  std::condition_variable tasksReady_;
+  std::deque<std::unique_ptr<Task>> tasks_;
+  std::mutex doneMutex_;
+  std::deque<std::unique_ptr<Task>> done_;
+  bool stopping_;
+  std::vector<std::thread> workers_;
+};
+}
+}
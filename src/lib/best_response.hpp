@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/game_tree.hpp>
+#include <lib/info_set_layout.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * Best response values and exploitability of strategy profiles in the flat
+ * format of an InfoSetLayout.
+ *
+ * Each pass walks the public betting tree once, carrying a vector with one
+ * entry for every deal of the cards, so the work at a node covers all
+ * private card combinations at once. Subtrees near the root are split
+ * across threads. The number of deals must fit in memory, which limits this
+ * to small games like Kuhn and Leduc poker.
+ */
+class BestResponse {
+public:
+  static const size_t DEFAULT_MAX_NUM_DEALS = 1 << 20;
+  static const int NO_BEST_RESPONDER = -1;
+
+  explicit BestResponse(const InfoSetLayout &layout,
+                        size_t maxNumDeals = DEFAULT_MAX_NUM_DEALS)
+      : layout_(layout), deals_(), views_() {
+    const Game *game = layout_.gameDef().game_;
+    const size_t numCards = layout_.gameDef().numCards();
+    const size_t numCardsDealt = game->numPlayers * game->numHoleCards +
+                                 sumBoardCards(game, game->numRounds - 1);
+    if (numCardsDealt > numCards) {
+      throw std::runtime_error("The game deals more cards than it has");
+    }
+    size_t numDeals = 1;
+    for (size_t c = 0; c < numCardsDealt; ++c) {
+      numDeals *= numCards - c;
+      if (numDeals > maxNumDeals) {
+        throw std::runtime_error("Game has more than " +
+                                 std::to_string(maxNumDeals) + " deals");
+      }
+    }
+    deals_.reserve(numDeals);
+
+    std::vector<uint8_t> cards(numCardsDealt);
+    std::vector<bool> used(numCards, false);
+    enumerateDeals(cards, used, 0);
+    assert(deals_.size() == numDeals);
+
+    views_.resize(game->numRounds * game->numPlayers);
+    State s;
+    for (uint8_t r = 0; r < game->numRounds; ++r) {
+      for (uint8_t p = 0; p < game->numPlayers; ++p) {
+        std::vector<size_t> &v = views_[r * game->numPlayers + p];
+        v.resize(deals_.size());
+        for (size_t d = 0; d < deals_.size(); ++d) {
+          deals_[d].copyTo(&s);
+          v[d] = layout_.cardView(s, p, r);
+        }
+      }
+    }
+  }
+  virtual ~BestResponse(){};
+
+  size_t numDeals() const { return deals_.size(); }
+
+  /// Expected value in chips per hand of @p player's best response to the
+  /// other players' strategies in @p strategy
+  double bestResponseValue(const std::vector<double> &strategy,
+                           const uint8_t player,
+                           size_t numThreads = defaultNumThreads()) const {
+    return expectedValue(strategy, player, player, numThreads);
+  }
+
+  /// Expected value in chips per hand of @p player when every player
+  /// follows @p strategy
+  double value(const std::vector<double> &strategy, const uint8_t player,
+               size_t numThreads = defaultNumThreads()) const {
+    return expectedValue(strategy, player, NO_BEST_RESPONDER, numThreads);
+  }
+
+  /**
+   * The sum over players of how much they would gain by switching to a best
+   * response, in chips per hand. Zero exactly at a Nash equilibrium.
+   */
+  double nashConv(const std::vector<double> &strategy,
+                  size_t numThreads = defaultNumThreads()) const {
+    double total = 0.0;
+    for (uint8_t p = 0; p < layout_.gameDef().game_->numPlayers; ++p) {
+      total += bestResponseValue(strategy, p, numThreads) -
+               value(strategy, p, numThreads);
+    }
+    return total;
+  }
+
+  /**
+   * nashConv averaged over players, which for two player zero-sum games is
+   * the usual exploitability: the mean of both best response values.
+   */
+  double exploitability(const std::vector<double> &strategy,
+                        size_t numThreads = defaultNumThreads()) const {
+    return nashConv(strategy, numThreads) /
+           layout_.gameDef().game_->numPlayers;
+  }
+
+  static size_t defaultNumThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  struct Deal {
+    uint8_t holeCards[MAX_PLAYERS][MAX_HOLE_CARDS];
+    uint8_t boardCards[MAX_BOARD_CARDS];
+
+    void copyTo(State *state) const {
+      memcpy(state->holeCards, holeCards, sizeof(holeCards));
+      memcpy(state->boardCards, boardCards, sizeof(boardCards));
+    }
+  };
+
+  void enumerateDeals(std::vector<uint8_t> &cards, std::vector<bool> &used,
+                      const size_t position) {
+    if (position == cards.size()) {
+      const Game *game = layout_.gameDef().game_;
+      Deal deal;
+      memset(&deal, 0, sizeof(deal));
+      size_t c = 0;
+      for (uint8_t p = 0; p < game->numPlayers; ++p) {
+        for (uint8_t h = 0; h < game->numHoleCards; ++h) {
+          deal.holeCards[p][h] = cards[c++];
+        }
+      }
+      for (size_t b = 0; c < cards.size(); ++b) {
+        deal.boardCards[b] = cards[c++];
+      }
+      deals_.push_back(deal);
+      return;
+    }
+    for (size_t i = 0; i < used.size(); ++i) {
+      if (used[i]) {
+        continue;
+      }
+      used[i] = true;
+      cards[position] = layout_.gameDef().card(i);
+      enumerateDeals(cards, used, position + 1);
+      used[i] = false;
+    }
+  }
+
+  const std::vector<size_t> &views(const uint8_t round,
+                                   const uint8_t player) const {
+    return views_[round * layout_.gameDef().game_->numPlayers + player];
+  }
+
+  double expectedValue(const std::vector<double> &strategy,
+                       const uint8_t player, const int bestResponder,
+                       size_t numThreads) const {
+    assert(strategy.size() == layout_.size());
+    assert(numThreads > 0);
+
+    const std::vector<double> reach(deals_.size(), 1.0 / deals_.size());
+    std::vector<double> values(deals_.size());
+    walk(GameTree::ROOT, strategy, player, bestResponder, reach, values,
+         numThreads);
+    return reduce(values, [](double s, double v) { return s + v; }, 0.0);
+  }
+
+  /**
+   * Sets @p values to @p player's value in @p nodeIndex's subtree for every
+   * deal, weighted by the chance and strategy reach in @p reach.
+   */
+  void walk(const size_t nodeIndex, const std::vector<double> &strategy,
+            const uint8_t player, const int bestResponder,
+            const std::vector<double> &reach, std::vector<double> &values,
+            const size_t numThreads) const {
+    const GameTree::Node &node = layout_.tree()[nodeIndex];
+    const size_t numDeals = deals_.size();
+
+    if (std::all_of(reach.begin(), reach.end(),
+                    [](double r) { return r <= 0.0; })) {
+      std::fill(values.begin(), values.end(), 0.0);
+      return;
+    }
+    if (node.isTerminal()) {
+      State s;
+      s.round = node.round;
+      s.finished = node.finished;
+      s.maxSpent = node.maxSpent;
+      memcpy(s.spent, node.spent, sizeof(node.spent));
+      memcpy(s.playerFolded, node.playerFolded, sizeof(node.playerFolded));
+      for (size_t d = 0; d < numDeals; ++d) {
+        if (reach[d] > 0.0) {
+          deals_[d].copyTo(&s);
+          values[d] =
+              reach[d] * valueOfState(layout_.gameDef().game_, &s, player);
+        } else {
+          values[d] = 0.0;
+        }
+      }
+      return;
+    }
+
+    const size_t numActions = node.numLegalActions;
+    const bool isBestResponder = node.actor == bestResponder;
+    const std::vector<size_t> &actorViews = views(node.round, node.actor);
+    const size_t offset = layout_.offset(nodeIndex);
+
+    std::vector<std::vector<double>> childReach(
+        isBestResponder ? 0 : numActions, std::vector<double>(numDeals));
+    for (size_t a = 0; a < childReach.size(); ++a) {
+      for (size_t d = 0; d < numDeals; ++d) {
+        childReach[a][d] =
+            reach[d] * strategy[offset + actorViews[d] * numActions + a];
+      }
+    }
+
+    std::vector<std::vector<double>> childValues(
+        numActions, std::vector<double>(numDeals));
+    auto walkChild = [&](const size_t a, const size_t childThreads) {
+      walk(node.children[node.legalActions[a]], strategy, player,
+           bestResponder, isBestResponder ? reach : childReach[a],
+           childValues[a], childThreads);
+    };
+    if (numThreads > 1 && numActions > 1) {
+      std::vector<std::thread> threads;
+      for (size_t a = 0; a < numActions; ++a) {
+        const size_t childThreads =
+            numThreads / numActions + (a < numThreads % numActions);
+        threads.emplace_back(walkChild, a, std::max<size_t>(1, childThreads));
+      }
+      for (auto &t : threads) {
+        t.join();
+      }
+    } else {
+      for (size_t a = 0; a < numActions; ++a) {
+        walkChild(a, 1);
+      }
+    }
+
+    if (!isBestResponder) {
+      std::fill(values.begin(), values.end(), 0.0);
+      for (size_t a = 0; a < numActions; ++a) {
+        for (size_t d = 0; d < numDeals; ++d) {
+          values[d] += childValues[a][d];
+        }
+      }
+      return;
+    }
+
+    // Choose the best action in each information set, where deals that
+    // look the same to the best responder share an information set
+    std::vector<double> actionValues(layout_.numCardViews(nodeIndex) *
+                                     numActions, 0.0);
+    for (size_t a = 0; a < numActions; ++a) {
+      for (size_t d = 0; d < numDeals; ++d) {
+        actionValues[actorViews[d] * numActions + a] += childValues[a][d];
+      }
+    }
+    for (size_t d = 0; d < numDeals; ++d) {
+      const double *v = &actionValues[actorViews[d] * numActions];
+      const size_t best = std::max_element(v, v + numActions) - v;
+      values[d] = childValues[best][d];
+    }
+  }
+
+  const InfoSetLayout &layout_;
+  std::vector<Deal> deals_;
+  /// Card view of every deal, for each round and player
+  std::vector<std::vector<size_t>> views_;
+};
+}
+}
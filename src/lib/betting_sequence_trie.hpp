@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/encapsulated_match_state.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * Caches intermediate betting states in a trie keyed by action prefix so that
+ * replaying many hands that share betting sequences only applies each
+ * distinct action once. The card-dependent parts of a state (hand ID, hole
+ * and board cards) are patched in from the hand being replayed.
+ *
+ * Not thread safe, so use one trie per thread.
+ */
+class BettingSequenceTrie {
+public:
+  static const size_t ROOT = 0;
+
+  explicit BettingSequenceTrie(const GameDef &gameDef)
+      : gameDef_(gameDef), nodes_() {
+    clear();
+  }
+  virtual ~BettingSequenceTrie(){};
+
+  void clear() {
+    nodes_.clear();
+    nodes_.emplace_back();
+    initState(gameDef_.game_, 0, &nodes_[ROOT].state);
+  }
+
+  /// Number of distinct betting sequences seen so far, including the empty one
+  size_t size() const { return nodes_.size(); }
+
+  const State &state(const size_t node) const {
+    assert(node < nodes_.size());
+    return nodes_[node].state;
+  }
+
+  /**
+   * The node reached from @p parent by @p action. @p action is only applied
+   * to a state the first time it is seen after @p parent.
+   */
+  size_t child(const size_t parent, const Action &action) {
+    assert(parent < nodes_.size());
+    for (const auto &edge : nodes_[parent].children) {
+      if (actionsEqual(edge.action, action)) {
+        return edge.child;
+      }
+    }
+    const size_t newNode = nodes_.size();
+    nodes_.emplace_back();
+    nodes_[newNode].state = nodes_[parent].state;
+    doAction(gameDef_.game_, &action, &(nodes_[newNode].state));
+    nodes_[parent].children.push_back(Edge{action, newNode});
+    return newNode;
+  }
+
+  /**
+   * Yields every time a player is about to act, like Acpc::replay.
+   */
+  void replay(const MatchState &view,
+              std::function<bool(const MatchState &, const Action &)>
+                  doOnState) {
+    MatchState ms;
+    ms.viewingPlayer = view.viewingPlayer;
+    initState(gameDef_.game_, view.state.handId, &ms.state);
+    copyCards(view.state, &ms.state);
+
+    size_t node = ROOT;
+    for (uint8_t round = 0; round <= view.state.round; ++round) {
+      for (uint8_t actionIndex = 0; actionIndex < view.state.numActions[round];
+           ++actionIndex) {
+        const Action &action = view.state.action[round][actionIndex];
+        if (doOnState(ms, action)) {
+          return;
+        }
+
+        node = child(node, action);
+        advance(nodes_[node].state, &ms.state);
+      }
+    }
+    return;
+  }
+
+  /**
+   * Yields every time a player is about to act, starting at the
+   * beginning of the hand, like EncapsulatedMatchState::replay. One replay
+   * state is advanced in place from the cached states rather than with
+   * applyAction, so @p AbstractMatchState must not keep anything it derives
+   * from its state.
+   */
+  template <typename AbstractMatchState = EncapsulatedMatchState>
+  void replay(const EncapsulatedMatchState &hand,
+              std::function<bool(const AbstractMatchState &, const Action &)>
+                  doOnState) {
+    State s;
+    initState(gameDef_.game_, hand.state().handId, &s);
+    copyCards(hand.state(), &s);
+    AbstractMatchState replayState(s, gameDef_, hand.viewer());
+    State &replayed =
+        static_cast<EncapsulatedMatchState &>(replayState).state_;
+
+    size_t node = ROOT;
+    for (uint8_t replayRound = 0; replayRound <= hand.roundIndex();
+         ++replayRound) {
+      for (uint8_t actionIndex = 0; actionIndex < hand.numActions(replayRound);
+           ++actionIndex) {
+        const Action &action_ = hand.action(replayRound, actionIndex);
+        if (doOnState(replayState, action_)) {
+          return;
+        }
+
+        node = child(node, action_);
+        advance(nodes_[node].state, &replayed);
+      }
+    }
+    return;
+  }
+
+  /**
+   * Brings @p dest up to date with @p next, which must be the cached state
+   * one action after @p dest, without touching @p dest's cards.
+   */
+  static void advance(const State &next, State *dest) {
+    assert(dest);
+    const uint8_t round = dest->round;
+    const uint8_t actionIndex = dest->numActions[round];
+    dest->action[round][actionIndex] = next.action[round][actionIndex];
+    dest->actingPlayer[round][actionIndex] =
+        next.actingPlayer[round][actionIndex];
+
+    memcpy(dest->numActions, next.numActions, sizeof(next.numActions));
+    dest->round = next.round;
+    dest->finished = next.finished;
+    dest->maxSpent = next.maxSpent;
+    dest->minNoLimitRaiseTo = next.minNoLimitRaiseTo;
+    memcpy(dest->spent, next.spent, sizeof(next.spent));
+    memcpy(dest->playerFolded, next.playerFolded, sizeof(next.playerFolded));
+  }
+
+  static void copyCards(const State &src, State *dest) {
+    assert(dest);
+    memcpy(dest->holeCards, src.holeCards, sizeof(src.holeCards));
+    memcpy(dest->boardCards, src.boardCards, sizeof(src.boardCards));
+  }
+
+protected:
+  struct Edge {
+    Action action;
+    size_t child;
+  };
+  struct Node {
+    State state;
+    std::vector<Edge> children;
+  };
+
+  const GameDef &gameDef_;
+  std::vector<Node> nodes_;
+};
+}
+}
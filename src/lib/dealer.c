@@ -2,13 +2,21 @@
 Copyright (C) 2011 by the Computer Poker Research Group, University of Alberta
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
 #define __STDC_LIMIT_MACROS
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -92,6 +100,114 @@ static int checkErrorTimes( const uint8_t seat,
   return 0;
 }
 
+static int latencyBucket( const uint64_t micros )
+{
+  int magnitude;
+
+  if( micros < LATENCY_SUB_BUCKETS ) {
+    return micros;
+  }
+
+  magnitude = 63 - __builtin_clzll( micros );
+  return ( magnitude - LATENCY_SUB_BUCKET_BITS + 1 ) * LATENCY_SUB_BUCKETS
+    + ( ( micros >> ( magnitude - LATENCY_SUB_BUCKET_BITS ) )
+	& ( LATENCY_SUB_BUCKETS - 1 ) );
+}
+
+/* the largest time counted in bucket */
+static uint64_t latencyBucketMax( const int bucket )
+{
+  int shift;
+
+  if( bucket < LATENCY_SUB_BUCKETS ) {
+    return bucket;
+  }
+
+  shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  return ( ( (uint64_t)LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS )
+	   << shift ) + ( ( (uint64_t)1 << shift ) - 1 );
+}
+
+void recordLatency( const uint64_t micros, LatencyHistogram *histogram )
+{
+  ++histogram->count[ latencyBucket( micros ) ];
+  ++histogram->numResponses;
+  histogram->totalMicros += micros;
+  if( micros > histogram->maxMicros ) {
+    histogram->maxMicros = micros;
+  }
+}
+
+uint64_t latencyPercentile( const LatencyHistogram *histogram,
+			    const double percentile )
+{
+  int b;
+  uint64_t rank, seen, max;
+
+  if( histogram->numResponses == 0 ) {
+    return 0;
+  }
+
+  rank = (uint64_t)( percentile / 100.0 * histogram->numResponses + 0.5 );
+  if( rank < 1 ) {
+    rank = 1;
+  }
+
+  seen = 0;
+  for( b = 0; b < LATENCY_NUM_BUCKETS; ++b ) {
+
+    seen += histogram->count[ b ];
+    if( seen >= rank ) {
+
+      max = latencyBucketMax( b );
+      return max < histogram->maxMicros ? max : histogram->maxMicros;
+    }
+  }
+
+  return histogram->maxMicros;
+}
+
+int printLatencies( const Game *game, char *seatName[ MAX_PLAYERS ],
+		    const LatencyHistogram latency[ MAX_PLAYERS ],
+		    FILE *file )
+{
+  int s;
+  const LatencyHistogram *h;
+
+  for( s = 0; s < game->numPlayers; ++s ) {
+
+    h = &latency[ s ];
+    if( fprintf( file, "LATENCY:%d:%s:%"PRIu64":%"PRIu64":%"PRIu64
+		 ":%"PRIu64":%"PRIu64":%"PRIu64":%"PRIu64"\n",
+		 s + 1, seatName[ s ], h->numResponses,
+		 h->numResponses ? h->totalMicros / h->numResponses : 0,
+		 latencyPercentile( h, 50.0 ), latencyPercentile( h, 90.0 ),
+		 latencyPercentile( h, 99.0 ), latencyPercentile( h, 99.9 ),
+		 h->maxMicros ) < 0 ) {
+
+      fprintf( stderr, "ERROR: could not print latencies\n" );
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* record how long seat took to respond, if the match is recording */
+static void recordResponseTime( const uint8_t seat,
+				const struct timeval *sendTime,
+				const struct timeval *recvTime,
+				ErrorInfo *info )
+{
+  if( info->latency == NULL ) {
+    return;
+  }
+
+  recordLatency( ( recvTime->tv_sec - sendTime->tv_sec ) * 1000000
+		 + recvTime->tv_usec - sendTime->tv_usec,
+		 &info->latency[ seat ] );
+}
+
 /* note that there is a new hand
    returns >= 0 if match should continue, -1 for failure */
 static int checkErrorNewHand( const Game *game, ErrorInfo *info )
@@ -118,62 +234,384 @@ static uint8_t playerToSeat( const Game *game, const uint8_t player0Seat,
   return ( player + player0Seat ) % game->numPlayers;
 }
 
-/* returns >= 0 if match should continue, -1 for failure */
-static int sendPlayerMessage( const Game *game, const MatchState *state,
-			      const int quiet, const uint8_t seat,
-			      const int seatFD, struct timeval *sendTime )
+/* note the time of day, for the logs, and the monotonic time, for
+   measuring how long players take to respond */
+static void getTimeStamp( TimeStamp *t )
 {
-  int c;
-  char line[ MAX_LINE_LEN ];
+  struct timespec ts;
 
-  /* prepare the message */
-  c = printMatchState( game, state, MAX_LINE_LEN, line );
-  if( c < 0 || c > MAX_LINE_LEN - 3 ) {
-    /* message is too long */
+  gettimeofday( &t->wall, NULL );
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  t->monotonic.tv_sec = ts.tv_sec;
+  t->monotonic.tv_usec = ts.tv_nsec / 1000;
+}
+
+/* state messages for every seat, formatted into one arena before any
+   are sent, so that all of a seat's pending messages (like the end of
+   one hand and the start of the next) go out in a single writev */
+#define MAX_QUEUED_MESSAGES 2
+typedef struct {
+  char arena[ MAX_PLAYERS * MAX_QUEUED_MESSAGES * MAX_LINE_LEN ];
+  int arenaUsed;
+  struct iovec message[ MAX_PLAYERS ][ MAX_QUEUED_MESSAGES ];
+  int numQueued[ MAX_PLAYERS ];
+  int numBytesQueued[ MAX_PLAYERS ];
+} SeatMessages;
+
+static void initSeatMessages( SeatMessages *messages )
+{
+  messages->arenaUsed = 0;
+  memset( messages->numQueued, 0, sizeof( messages->numQueued ) );
+  memset( messages->numBytesQueued, 0,
+	  sizeof( messages->numBytesQueued ) );
+}
+
+void initStateMessageFormatter( StateMessageFormatter *formatter )
+{
+  formatter->valid = 0;
+}
+
+/* print the shared parts of the messages for state's hand
+   returns >= 0 on success, -1 on failure */
+static int startStateMessages( StateMessageFormatter *formatter,
+			       const Game *game, const State *state )
+{
+  int r, c;
+  uint8_t p, round;
+
+  formatter->handId = state->handId;
+  formatter->handIdLen = snprintf( formatter->handIdString,
+				   sizeof( formatter->handIdString ),
+				   ":%"PRIu32":", state->handId );
+
+  formatter->bettingRound = 0;
+  formatter->bettingNumActions = 0;
+  formatter->bettingLen = 0;
 
-    fprintf( stderr, "ERROR: state message too long\n" );
+  for( p = 0; p < game->numPlayers; ++p ) {
+
+    r = printCards( game->numHoleCards, state->holeCards[ p ],
+		    sizeof( formatter->holeCards[ p ] ),
+		    formatter->holeCards[ p ] );
+    if( r < 0 ) {
+      return -1;
+    }
+    formatter->holeCardsLen[ p ] = r;
+  }
+
+  c = 0;
+  formatter->boardEnd[ 0 ] = 0;
+  for( round = 1; round < game->numRounds; ++round ) {
+
+    formatter->board[ c ] = '/';
+    ++c;
+    r = printCards( game->numBoardCards[ round ],
+		    &state->boardCards[ sumBoardCards( game, round - 1 ) ],
+		    sizeof( formatter->board ) - c, &formatter->board[ c ] );
+    if( r < 0 ) {
+      return -1;
+    }
+    c += r;
+    formatter->boardEnd[ round ] = c;
+  }
+
+  formatter->valid = 1;
+  return 0;
+}
+
+/* append the actions of state that are not yet in the betting
+   returns >= 0 on success, -1 on failure */
+static int appendStateBetting( StateMessageFormatter *formatter,
+			       const Game *game, const State *state )
+{
+  int r;
+  uint8_t round, a;
+
+  for( round = formatter->bettingRound; round <= state->round; ++round ) {
+
+    if( round > formatter->bettingRound ) {
+
+      if( formatter->bettingLen + 1 >= MAX_LINE_LEN ) {
+	return -1;
+      }
+      formatter->betting[ formatter->bettingLen ] = '/';
+      ++formatter->bettingLen;
+      formatter->bettingNumActions = 0;
+    }
+
+    for( a = formatter->bettingNumActions; a < state->numActions[ round ];
+	 ++a ) {
+
+      r = printAction( game, &state->action[ round ][ a ],
+		       MAX_LINE_LEN - formatter->bettingLen,
+		       &formatter->betting[ formatter->bettingLen ] );
+      if( r < 0 ) {
+	return -1;
+      }
+      formatter->bettingLen += r;
+    }
+    formatter->bettingNumActions = state->numActions[ round ];
+  }
+  formatter->bettingRound = state->round;
+
+  return 0;
+}
+
+/* append len characters of piece to string, which holds c of maxLen
+   returns the new length of string, or -1 if piece does not fit */
+static int appendPiece( const char *piece, const int len, const int c,
+			const int maxLen, char *string )
+{
+  if( c < 0 || c + len >= maxLen ) {
+    return -1;
+  }
+  memcpy( &string[ c ], piece, len );
+  return c + len;
+}
+
+int printStateMessage( StateMessageFormatter *formatter, const Game *game,
+		       const MatchState *state, const int maxLen,
+		       char *string )
+{
+  int c;
+  uint8_t p;
+  char viewer[ 4 ];
+  const State *s = &state->state;
+  const int showdown = s->finished
+    && numFolded( game, s ) + 1 < game->numPlayers;
+
+  /* start over for a new hand, or if state is not an extension of the
+     last one */
+  if( !formatter->valid || formatter->handId != s->handId
+      || formatter->bettingRound > s->round
+      || formatter->bettingNumActions
+      > s->numActions[ formatter->bettingRound ] ) {
+
+    if( startStateMessages( formatter, game, s ) < 0 ) {
+      return -1;
+    }
+  }
+  if( appendStateBetting( formatter, game, s ) < 0 ) {
     return -1;
   }
-  line[ c ] = '\r';
-  line[ c + 1 ] = '\n';
-  line[ c + 2 ] = 0;
-  c += 2;
 
-  /* send it to the player and flush */
-  if( write( seatFD, line, c ) != c ) {
-    /* couldn't send the line */
+  c = appendPiece( "MATCHSTATE:", 11, 0, maxLen, string );
+  viewer[ 0 ] = '0' + state->viewingPlayer;
+  c = appendPiece( viewer, 1, c, maxLen, string );
+  c = appendPiece( formatter->handIdString, formatter->handIdLen, c, maxLen,
+		   string );
+  c = appendPiece( formatter->betting, formatter->bettingLen, c, maxLen,
+		   string );
+  c = appendPiece( ":", 1, c, maxLen, string );
+  for( p = 0; p < game->numPlayers; ++p ) {
 
-    fprintf( stderr, "ERROR: could not send state to seat %"PRIu8"\n",
-	     seat + 1 );
+    if( p > 0 ) {
+      c = appendPiece( "|", 1, c, maxLen, string );
+    }
+    if( p == state->viewingPlayer || ( showdown && !s->playerFolded[ p ] ) ) {
+      c = appendPiece( formatter->holeCards[ p ],
+		       formatter->holeCardsLen[ p ], c, maxLen, string );
+    }
+  }
+  c = appendPiece( formatter->board, formatter->boardEnd[ s->round ], c,
+		   maxLen, string );
+  if( c < 0 ) {
     return -1;
   }
+  string[ c ] = 0;
+
+  return c;
+}
+
+/* queue each seat's view of state
+   returns >= 0 if match should continue, -1 for failure */
+static int queueStateMessages( const Game *game, MatchState *state,
+			       const uint8_t player0Seat,
+			       StateMessageFormatter *formatter,
+			       SeatMessages *messages )
+{
+  int c;
+  uint8_t seat;
+  char *line;
+
+  for( seat = 0; seat < game->numPlayers; ++seat ) {
+
+    assert( messages->numQueued[ seat ] < MAX_QUEUED_MESSAGES );
+    line = &messages->arena[ messages->arenaUsed ];
+
+    /* prepare the message */
+    state->viewingPlayer = seatToPlayer( game, player0Seat, seat );
+    c = printStateMessage( formatter, game, state, MAX_LINE_LEN, line );
+    if( c < 0 || c > MAX_LINE_LEN - 3 ) {
+      /* message is too long */
+
+      fprintf( stderr, "ERROR: state message too long\n" );
+      return -1;
+    }
+    line[ c ] = '\r';
+    line[ c + 1 ] = '\n';
+    line[ c + 2 ] = 0;
+    c += 2;
+
+    messages->message[ seat ][ messages->numQueued[ seat ] ].iov_base = line;
+    messages->message[ seat ][ messages->numQueued[ seat ] ].iov_len = c;
+    ++messages->numQueued[ seat ];
+    messages->numBytesQueued[ seat ] += c;
+    messages->arenaUsed += c + 1;
+  }
+
+  return 0;
+}
+
+/* send every seat its queued messages with one writev each, and note
+   when they were sent
+   returns >= 0 if match should continue, -1 for failure */
+static int sendSeatMessages( const Game *game, const int quiet,
+			     const int seatFD[ MAX_PLAYERS ],
+			     SeatMessages *messages,
+			     TimeStamp *sendTime )
+{
+  int m;
+  uint8_t seat;
+
+  for( seat = 0; seat < game->numPlayers; ++seat ) {
+
+    if( messages->numQueued[ seat ] == 0 ) {
+      continue;
+    }
+
+    /* send it to the player and flush */
+    if( writev( seatFD[ seat ], messages->message[ seat ],
+		messages->numQueued[ seat ] )
+	!= messages->numBytesQueued[ seat ] ) {
+      /* couldn't send the messages */
+
+      fprintf( stderr, "ERROR: could not send state to seat %"PRIu8"\n",
+	       seat + 1 );
+      return -1;
+    }
+  }
 
-  /* note when we sent the message */
-  gettimeofday( sendTime, NULL );
+  /* note when we sent the messages */
+  getTimeStamp( sendTime );
 
-  /* log the message */
+  /* log the messages */
   if( !quiet ) {
-    fprintf( stderr, "TO %d at %zu.%.06zu %s", seat + 1,
-	     sendTime->tv_sec, sendTime->tv_usec, line );
+    for( seat = 0; seat < game->numPlayers; ++seat ) {
+      for( m = 0; m < messages->numQueued[ seat ]; ++m ) {
+	fprintf( stderr, "TO %d at %zu.%.06zu %s", seat + 1,
+		 sendTime->wall.tv_sec, sendTime->wall.tv_usec,
+		 (char *)messages->message[ seat ][ m ].iov_base );
+      }
+    }
   }
 
+  initSeatMessages( messages );
   return 0;
 }
 
+/* handle one line of input from the player in seat, which was asked for
+   an action at sendTime and sent the line at recvTime
+   returns 1 if action/size has been set to a valid action
+   returns 0 if the line should be ignored
+   returns -1 for failure (timeout, too many bad actions, etc) */
+static int parsePlayerResponse( const Game *game,
+				const MatchState *state,
+				const int quiet,
+				const uint8_t seat,
+				const TimeStamp *sendTime,
+				const TimeStamp *recvTime,
+				ErrorInfo *errorInfo,
+				const char *line,
+				Action *action )
+{
+  int c, r;
+  MatchState tempState;
+
+  /* log the response */
+  if( !quiet ) {
+    fprintf( stderr, "FROM %d at %zu.%06zu %s", seat + 1,
+	     recvTime->wall.tv_sec, recvTime->wall.tv_usec, line );
+  }
+
+  /* ignore comments */
+  if( line[ 0 ] == '#' || line[ 0 ] == ';' ) {
+    return 0;
+  }
+
+  /* check for any timeout issues */
+  recordResponseTime( seat, &sendTime->monotonic, &recvTime->monotonic,
+		      errorInfo );
+  if( checkErrorTimes( seat, &sendTime->monotonic, &recvTime->monotonic,
+		       errorInfo ) < 0 ) {
+
+    fprintf( stderr, "ERROR: seat %"PRIu8" ran out of time\n", seat + 1 );
+    return -1;
+  }
+
+  /* parse out the state */
+  c = readMatchState( line, game, &tempState );
+  if( c < 0 ) {
+    /* couldn't get an intelligible state */
+
+    fprintf( stderr, "WARNING: bad state format in response\n" );
+    return 0;
+  }
+
+  /* ignore responses that don't match the current state */
+  if( !matchStatesEqual( game, state, &tempState ) ) {
+
+    fprintf( stderr, "WARNING: ignoring un-requested response\n" );
+    return 0;
+  }
+
+  /* get the action */
+  if( line[ c++ ] != ':'
+      || ( r = readAction( &line[ c ], game, action ) ) < 0 ) {
+
+    if( checkErrorInvalidAction( seat, errorInfo ) < 0 ) {
+
+      fprintf( stderr, "ERROR: bad action format in response\n" );
+    }
+
+    fprintf( stderr,
+	     "WARNING: bad action format in response, changed to call\n" );
+    action->type = a_call;
+    action->size = 0;
+    return 1;
+  }
+  c += r;
+
+  /* make sure the action is valid */
+  if( !isValidAction( game, &state->state, 1, action ) ) {
+
+    if( checkErrorInvalidAction( seat, errorInfo ) < 0 ) {
+
+      fprintf( stderr, "ERROR: invalid action\n" );
+      return -1;
+    }
+
+    fprintf( stderr, "WARNING: invalid action, changed to call\n" );
+    action->type = a_call;
+    action->size = 0;
+  }
+
+  return 1;
+}
+
 /* returns >= 0 if action/size has been set to a valid action
    returns -1 for failure (disconnect, timeout, too many bad actions, etc) */
 static int readPlayerResponse( const Game *game,
 			       const MatchState *state,
 			       const int quiet,
 			       const uint8_t seat,
-			       const struct timeval *sendTime,
+			       const TimeStamp *sendTime,
 			       ErrorInfo *errorInfo,
 			       ReadBuf *readBuf,
 			       Action *action,
-			       struct timeval *recvTime )
+			       TimeStamp *recvTime )
 {
-  int c, r;
-  MatchState tempState;
+  int r;
   char line[ MAX_LINE_LEN ];
 
   while( 1 ) {
@@ -202,84 +640,124 @@ static int readPlayerResponse( const Game *game,
     }
 
     /* note when the message arrived */
-    gettimeofday( recvTime, NULL );
+    getTimeStamp( recvTime );
 
-    /* log the response */
-    if( !quiet ) {
-      fprintf( stderr, "FROM %d at %zu.%06zu %s", seat + 1,
-	       recvTime->tv_sec, recvTime->tv_usec, line );
-    }
-
-    /* ignore comments */
-    if( line[ 0 ] == '#' || line[ 0 ] == ';' ) {
-      continue;
-    }
-
-    /* check for any timeout issues */
-    if( checkErrorTimes( seat, sendTime, recvTime, errorInfo ) < 0 ) {
+    r = parsePlayerResponse( game, state, quiet, seat, sendTime, recvTime,
+			     errorInfo, line, action );
+    if( r < 0 ) {
+      /* error messages already handled in function */
 
-      fprintf( stderr, "ERROR: seat %"PRIu8" ran out of time\n", seat + 1 );
       return -1;
     }
+    if( r > 0 ) {
+      return 0;
+    }
+  }
+}
 
-    /* parse out the state */
-    c = readMatchState( line, game, &tempState );
-    if( c < 0 ) {
-      /* couldn't get an intelligible state */
+uint8_t dealScheduleCardsPerHand( const Game *game )
+{
+  return game->numPlayers * game->numHoleCards
+    + sumBoardCards( game, game->numRounds - 1 );
+}
 
-      fprintf( stderr, "WARNING: bad state format in response\n" );
-      continue;
+/* copy the cards of state into cards, in schedule order, or back */
+static void packHandCards( const Game *game, const State *state,
+			   uint8_t *cards )
+{
+  int p, i, c;
+
+  c = 0;
+  for( p = 0; p < game->numPlayers; ++p ) {
+    for( i = 0; i < game->numHoleCards; ++i ) {
+      cards[ c++ ] = state->holeCards[ p ][ i ];
     }
+  }
+  for( i = 0; i < sumBoardCards( game, game->numRounds - 1 ); ++i ) {
+    cards[ c++ ] = state->boardCards[ i ];
+  }
+}
 
-    /* ignore responses that don't match the current state */
-    if( !matchStatesEqual( game, state, &tempState ) ) {
+static void unpackHandCards( const Game *game, const uint8_t *cards,
+			     State *state )
+{
+  int p, i, c;
 
-      fprintf( stderr, "WARNING: ignoring un-requested response\n" );
-      continue;
+  c = 0;
+  for( p = 0; p < game->numPlayers; ++p ) {
+    for( i = 0; i < game->numHoleCards; ++i ) {
+      state->holeCards[ p ][ i ] = cards[ c++ ];
     }
+  }
+  for( i = 0; i < sumBoardCards( game, game->numRounds - 1 ); ++i ) {
+    state->boardCards[ i ] = cards[ c++ ];
+  }
+}
 
-    /* get the action */
-    if( line[ c++ ] != ':'
-	|| ( r = readAction( &line[ c ], game, action ) ) < 0 ) {
+void fillDealSchedule( const Game *game, rng_state_t *rng,
+		       const uint32_t numHands, uint8_t *cards )
+{
+  uint32_t h;
+  const uint8_t cardsPerHand = dealScheduleCardsPerHand( game );
+  State state;
 
-      if( checkErrorInvalidAction( seat, errorInfo ) < 0 ) {
+  for( h = 0; h < numHands; ++h ) {
 
-	fprintf( stderr, "ERROR: bad action format in response\n" );
-      }
+    dealCards( game, rng, &state );
+    packHandCards( game, &state, &cards[ (size_t)h * cardsPerHand ] );
+  }
+}
 
-      fprintf( stderr,
-	       "WARNING: bad action format in response, changed to call\n" );
-      action->type = a_call;
-      action->size = 0;
-      goto doneRead;
-    }
-    c += r;
+int checkDealSchedule( const Game *game, const uint32_t numHands,
+		       const DealSchedule *schedule )
+{
+  if( schedule == NULL ) {
+    return 0;
+  }
 
-    /* make sure the action is valid */
-    if( !isValidAction( game, &state->state, 1, action ) ) {
+  if( schedule->cardsPerHand != dealScheduleCardsPerHand( game ) ) {
 
-      if( checkErrorInvalidAction( seat, errorInfo ) < 0 ) {
+    fprintf( stderr, "ERROR: deal schedule has %"PRIu8
+	     " cards per hand, game needs %"PRIu8"\n",
+	     schedule->cardsPerHand, dealScheduleCardsPerHand( game ) );
+    return -1;
+  }
+  if( schedule->numHands < numHands ) {
 
-	fprintf( stderr, "ERROR: invalid action\n" );
-	return -1;
-      }
+    fprintf( stderr, "ERROR: deal schedule has %"PRIu32
+	     " hands, match needs %"PRIu32"\n",
+	     schedule->numHands, numHands );
+    return -1;
+  }
 
-      fprintf( stderr, "WARNING: invalid action, changed to call\n" );
-      action->type = a_call;
-      action->size = 0;
-    }
+  return 0;
+}
 
-    goto doneRead;
+/* deal the cards of state->handId from schedule, or from rng if there
+   is no schedule.  Hands past the end of the schedule, like the one set
+   up after the last hand of a match, are left undealt */
+static void dealHand( const Game *game, rng_state_t *rng,
+		      const DealSchedule *schedule, State *state )
+{
+  if( schedule == NULL ) {
+
+    dealCards( game, rng, state );
+    return;
   }
 
- doneRead:
-  return 0;
+  if( state->handId < schedule->numHands ) {
+
+    unpackHandCards( game, &schedule->cards[ (size_t)state->handId
+					     * schedule->cardsPerHand ],
+		     state );
+  }
 }
 
 /* returns >= 0 if match should continue, -1 for failure */
 static int setUpNewHand( const Game *game, const uint8_t fixedSeats,
 			 uint32_t *handId, uint8_t *player0Seat,
-			 rng_state_t *rng, ErrorInfo *errorInfo, State *state )
+			 rng_state_t *rng, const DealSchedule *schedule,
+			 ErrorInfo *errorInfo, State *state )
 {
   ++( *handId );
 
@@ -295,106 +773,476 @@ static int setUpNewHand( const Game *game, const uint8_t fixedSeats,
     return -1;
   }
   initState( game, *handId, state );
-  dealCards( game, rng, state );
+  dealHand( game, rng, schedule, state );
 
   return 0;
 }
 
-/* returns >= 0 if match should continue, -1 for failure */
-static int processTransactionFile( const Game *game, const int fixedSeats,
-				   uint32_t *handId, uint8_t *player0Seat,
-				   rng_state_t *rng, ErrorInfo *errorInfo,
-				   double totalValue[ MAX_PLAYERS ],
-				   MatchState *state, FILE *file )
+/* binary transaction files start with BINARY_TRANSACTION_MAGIC,
+   followed by action and checkpoint records.  Each record is one of the
+   structures below, as laid out by the machine that wrote it, followed
+   by its total size as a uint32_t, which is checked as the file is
+   read.  A record that was cut short when the match was interrupted is
+   dropped when the match resumes */
+#define BINARY_TRANSACTION_MAGIC "ACPCTLG\001"
+#define BINARY_TRANSACTION_MAGIC_LEN 8
+#define TRANSACTION_ACTION_RECORD 1
+#define TRANSACTION_CHECKPOINT_RECORD 2
+
+typedef struct {
+  uint32_t type;
+  uint32_t handId;
+  int32_t actionSize;
+  uint8_t actionType;
+  uint64_t sendMicros;
+  uint64_t recvMicros;
+} TransactionActionRecord;
+
+/* everything needed to carry on from the end of hand handId */
+typedef struct {
+  uint32_t type;
+  uint32_t handId;
+  uint8_t player0Seat;
+  rng_state_t rng;
+  ErrorInfo errorInfo;
+  double totalValue[ MAX_PLAYERS ];
+} TransactionCheckpointRecord;
+
+/* check and apply one action of hand h from a transaction file
+   returns >= 0 if match should continue, -1 for failure */
+static int replayTransaction( const Game *game, const int fixedSeats,
+			      const uint32_t h, Action *action,
+			      const struct timeval *sendTime,
+			      const struct timeval *recvTime,
+			      uint32_t *handId, uint8_t *player0Seat,
+			      rng_state_t *rng, const DealSchedule *schedule,
+			      ErrorInfo *errorInfo,
+			      double totalValue[ MAX_PLAYERS ],
+			      MatchState *state )
 {
-  int c, r;
-  uint32_t h;
   uint8_t s;
+
+  /* check that we're processing the expected handId */
+  if( h != *handId ) {
+
+    fprintf( stderr, "ERROR: handId mismatch in transaction log: "
+	     "expected %"PRIu32", got %"PRIu32"\n", *handId, h );
+    return -1;
+  }
+
+  /* make sure the action is valid */
+  if( !isValidAction( game, &state->state, 0, action ) ) {
+
+    fprintf( stderr, "ERROR: invalid action in transaction log "
+	     "in hand %"PRIu32"\n", h );
+    return -1;
+  }
+
+  /* check for any timeout issues */
+  s = playerToSeat( game, *player0Seat,
+		    currentPlayer( game, &state->state ) );
+  if( checkErrorTimes( s, sendTime, recvTime, errorInfo ) < 0 ) {
+
+    fprintf( stderr,
+	     "ERROR: seat %"PRIu8" ran out of time in transaction file\n",
+	     s + 1 );
+    return -1;
+  }
+
+  doAction( game, action, &state->state );
+
+  if( stateFinished( &state->state ) ) {
+    /* hand is finished */
+
+    /* update the total value for each player */
+    for( s = 0; s < game->numPlayers; ++s ) {
+
+      totalValue[ s ]
+	+= valueOfState( game, &state->state,
+			 seatToPlayer( game, *player0Seat, s ) );
+    }
+
+    /* move on to next hand */
+    if( setUpNewHand( game, fixedSeats, handId, player0Seat,
+		      rng, schedule, errorInfo, &state->state ) < 0 ) {
+
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* read the rest of a record of the given type and size, after its type
+   returns >= 0 on success, -1 for failure */
+static int readTransactionRecord( const uint32_t type, void *record,
+				  const uint32_t size, FILE *file )
+{
+  uint32_t recordSize;
+
+  *(uint32_t *)record = type;
+  if( fread( (char *)record + sizeof( type ), size - sizeof( type ), 1,
+	     file ) != 1
+      || fread( &recordSize, sizeof( recordSize ), 1, file ) != 1
+      || recordSize != size + sizeof( recordSize ) ) {
+
+    fprintf( stderr, "ERROR: truncated or corrupt binary transaction file\n" );
+    return -1;
+  }
+
+  return 0;
+}
+
+/* check for a whole record of a binary transaction file ending at pos,
+   from its size and the type at its start, and get its type and size
+   returns 1 if there is one, 0 if not, -1 for failure */
+static int readRecordBefore( FILE *file, const off_t pos, uint32_t *type,
+			     uint32_t *recordSize )
+{
+  uint32_t expectedType;
+
+  if( pos < BINARY_TRANSACTION_MAGIC_LEN + (off_t)sizeof( *recordSize ) ) {
+    return 0;
+  }
+  if( fseeko( file, pos - sizeof( *recordSize ), SEEK_SET ) < 0
+      || fread( recordSize, sizeof( *recordSize ), 1, file ) != 1 ) {
+
+    fprintf( stderr, "ERROR: could not read binary transaction file\n" );
+    return -1;
+  }
+  if( *recordSize
+      == sizeof( TransactionActionRecord ) + sizeof( *recordSize ) ) {
+    expectedType = TRANSACTION_ACTION_RECORD;
+  } else if( *recordSize
+	     == sizeof( TransactionCheckpointRecord ) + sizeof( *recordSize ) ) {
+    expectedType = TRANSACTION_CHECKPOINT_RECORD;
+  } else {
+    return 0;
+  }
+  if( pos - *recordSize < BINARY_TRANSACTION_MAGIC_LEN ) {
+    return 0;
+  }
+  if( fseeko( file, pos - *recordSize, SEEK_SET ) < 0
+      || fread( type, sizeof( *type ), 1, file ) != 1 ) {
+
+    fprintf( stderr, "ERROR: could not read binary transaction file\n" );
+    return -1;
+  }
+
+  return *type == expectedType;
+}
+
+static int bufferedLogDescriptor( FILE *stream );
+
+/* cut the transaction file, which may be a stream from openBufferedLog,
+   to length bytes, before anything more is written to it
+   returns >= 0 on success, -1 on failure */
+static int truncateTransactionFile( FILE *file, const off_t length )
+{
+  int fd = fileno( file );
+
+  if( fd < 0 ) {
+    fd = bufferedLogDescriptor( file );
+  }
+  if( fd < 0 || ftruncate( fd, length ) < 0 ) {
+
+    fprintf( stderr, "ERROR: could not truncate transaction file\n" );
+    return -1;
+  }
+
+  return 0;
+}
+
+/* resume from the last checkpoint in a binary transaction file, and
+   replay the actions after it.  A new file is given its header, and a
+   partial record at the end of the file is cut off
+   returns >= 0 if match should continue, -1 for failure */
+static int processBinaryTransactionFile( const Game *game,
+					 const int fixedSeats,
+					 uint32_t *handId,
+					 uint8_t *player0Seat,
+					 rng_state_t *rng,
+					 const DealSchedule *schedule,
+					 ErrorInfo *errorInfo,
+					 double totalValue[ MAX_PLAYERS ],
+					 MatchState *state, FILE *file )
+{
+  int r;
+  off_t end, pos, start;
+  uint32_t type, recordSize;
+  size_t maxSize;
+  char magic[ BINARY_TRANSACTION_MAGIC_LEN ];
   Action action;
   struct timeval sendTime, recvTime;
-  char line[ MAX_LINE_LEN ];
+  TransactionActionRecord record;
+  TransactionCheckpointRecord checkpoint;
 
-  while( fgets( line, MAX_LINE_LEN, file ) ) {
+  if( fseeko( file, 0, SEEK_END ) < 0 || ( end = ftello( file ) ) < 0
+      || fseeko( file, 0, SEEK_SET ) < 0 ) {
 
-    /* get the log entry */
+    fprintf( stderr, "ERROR: could not seek in binary transaction file\n" );
+    return -1;
+  }
 
-    /* ACTION */
-    c = readAction( line, game, &action );
-    if( c < 0 ) {
+  if( end < BINARY_TRANSACTION_MAGIC_LEN ) {
+    /* nothing to resume, though the header may have been cut short */
 
-      fprintf( stderr, "ERROR: could not parse transaction action %s", line );
+    if( (off_t)fread( magic, 1, end, file ) != end
+	|| memcmp( magic, BINARY_TRANSACTION_MAGIC, end ) ) {
+
+      fprintf( stderr, "ERROR: not a binary transaction file\n" );
       return -1;
     }
+    if( end > 0 && ( truncateTransactionFile( file, 0 ) < 0
+		     || fseeko( file, 0, SEEK_SET ) < 0 ) ) {
+      /* error messages already handled in function */
 
-    /* ACTION HANDID SEND RECV */
-    if( sscanf( &line[ c ], " %"SCNu32" %zu.%06zu %zu.%06zu%n", &h,
-		&sendTime.tv_sec, &sendTime.tv_usec,
-		&recvTime.tv_sec, &recvTime.tv_usec, &r ) < 4 ) {
+      return -1;
+    }
+    if( fwrite( BINARY_TRANSACTION_MAGIC, 1, BINARY_TRANSACTION_MAGIC_LEN,
+		file ) != BINARY_TRANSACTION_MAGIC_LEN ) {
 
-      fprintf( stderr, "ERROR: could not parse transaction stamp %s", line );
+      fprintf( stderr, "ERROR: could not write to transaction file\n" );
       return -1;
     }
-    c += r;
+    fflush( file );
+    return 0;
+  }
+
+  if( fread( magic, 1, BINARY_TRANSACTION_MAGIC_LEN, file )
+      != BINARY_TRANSACTION_MAGIC_LEN
+      || memcmp( magic, BINARY_TRANSACTION_MAGIC,
+		 BINARY_TRANSACTION_MAGIC_LEN ) ) {
 
-    /* check that we're processing the expected handId */
-    if( h != *handId ) {
+    fprintf( stderr, "ERROR: not a binary transaction file\n" );
+    return -1;
+  }
+
+  /* a record that was being written when the match was interrupted is
+     shorter than the largest record, so the last whole record ends
+     within that many bytes of the end of the file */
+  maxSize = sizeof( checkpoint ) > sizeof( record )
+    ? sizeof( checkpoint ) : sizeof( record );
+  pos = end;
+  while( pos > BINARY_TRANSACTION_MAGIC_LEN ) {
+
+    r = readRecordBefore( file, pos, &type, &recordSize );
+    if( r < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+    if( r > 0 ) {
+      break;
+    }
+    if( end - pos + 1 >= (off_t)( maxSize + sizeof( recordSize ) ) ) {
 
-      fprintf( stderr, "ERROR: handId mismatch in transaction log: %s", line );
+      fprintf( stderr, "ERROR: corrupt binary transaction file\n" );
       return -1;
     }
+    --pos;
+  }
 
-    /* make sure the action is valid */
-    if( !isValidAction( game, &state->state, 0, &action ) ) {
+  if( pos < end ) {
+
+    fprintf( stderr, "WARNING: dropping %"PRId64" bytes of a partial record "
+	     "at the end of the binary transaction file\n",
+	     (int64_t)( end - pos ) );
+    if( truncateTransactionFile( file, pos ) < 0 ) {
+      /* error messages already handled in function */
 
-      fprintf( stderr, "ERROR: invalid action in transaction log: %s", line );
       return -1;
     }
+  }
 
-    /* check for any timeout issues */
-    s = playerToSeat( game, *player0Seat,
-		      currentPlayer( game, &state->state ) );
-    if( checkErrorTimes( s, &sendTime, &recvTime, errorInfo ) < 0 ) {
+  /* walk back from the last record to the last checkpoint, so the
+     records before it are never read */
+  start = pos;
+  while( start > BINARY_TRANSACTION_MAGIC_LEN ) {
 
-      fprintf( stderr,
-	       "ERROR: seat %"PRIu8" ran out of time in transaction file\n",
-	       s + 1 );
+    r = readRecordBefore( file, start, &type, &recordSize );
+    if( r <= 0 ) {
+
+      if( r == 0 ) {
+	fprintf( stderr, "ERROR: corrupt binary transaction file\n" );
+      }
       return -1;
     }
+    start -= recordSize;
+    if( type == TRANSACTION_CHECKPOINT_RECORD ) {
+      break;
+    }
+  }
+
+  /* replay everything from there */
+  if( fseeko( file, start, SEEK_SET ) < 0 ) {
+
+    fprintf( stderr, "ERROR: could not seek in binary transaction file\n" );
+    return -1;
+  }
+  while( fread( &type, sizeof( type ), 1, file ) == 1 ) {
+
+    if( type == TRANSACTION_ACTION_RECORD ) {
+
+      if( readTransactionRecord( type, &record, sizeof( record ), file ) < 0 ) {
+	/* error messages already handled in function */
 
-    doAction( game, &action, &state->state );
+	return -1;
+      }
+      action.type = (enum ActionType)record.actionType;
+      action.size = record.actionSize;
+      sendTime.tv_sec = record.sendMicros / 1000000;
+      sendTime.tv_usec = record.sendMicros % 1000000;
+      recvTime.tv_sec = record.recvMicros / 1000000;
+      recvTime.tv_usec = record.recvMicros % 1000000;
+      if( replayTransaction( game, fixedSeats, record.handId, &action,
+			     &sendTime, &recvTime, handId, player0Seat, rng,
+			     schedule, errorInfo, totalValue, state ) < 0 ) {
+	/* error messages already handled in function */
 
-    if( stateFinished( &state->state ) ) {
-      /* hand is finished */
+	return -1;
+      }
+    } else if( type == TRANSACTION_CHECKPOINT_RECORD ) {
 
-      /* update the total value for each player */
-      for( s = 0; s < game->numPlayers; ++s ) {
+      if( readTransactionRecord( type, &checkpoint, sizeof( checkpoint ),
+				 file ) < 0 ) {
+	/* error messages already handled in function */
 
-	totalValue[ s ]
-	  += valueOfState( game, &state->state,
-			   seatToPlayer( game, *player0Seat, s ) );
+	return -1;
       }
 
-      /* move on to next hand */
+      /* restore the match as it was at the end of the hand, keeping the
+	 current limits, then deal the next hand */
+      *handId = checkpoint.handId;
+      *player0Seat = checkpoint.player0Seat;
+      *rng = checkpoint.rng;
+      memcpy( errorInfo->numInvalidActions,
+	      checkpoint.errorInfo.numInvalidActions,
+	      sizeof( errorInfo->numInvalidActions ) );
+      memcpy( errorInfo->usedHandMicros, checkpoint.errorInfo.usedHandMicros,
+	      sizeof( errorInfo->usedHandMicros ) );
+      memcpy( errorInfo->usedMatchMicros,
+	      checkpoint.errorInfo.usedMatchMicros,
+	      sizeof( errorInfo->usedMatchMicros ) );
+      memcpy( totalValue, checkpoint.totalValue,
+	      sizeof( checkpoint.totalValue ) );
       if( setUpNewHand( game, fixedSeats, handId, player0Seat,
-			rng, errorInfo, &state->state ) < 0 ) {
+			rng, schedule, errorInfo, &state->state ) < 0 ) {
 
 	return -1;
       }
+    } else {
+
+      fprintf( stderr,
+	       "ERROR: truncated or corrupt binary transaction file\n" );
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* replay the transaction file, which is binary if checkpointHands is
+   not 0, bringing the match up to the point where it was interrupted
+   returns >= 0 if match should continue, -1 for failure */
+static int processTransactionFile( const Game *game, const int fixedSeats,
+				   const uint32_t checkpointHands,
+				   uint32_t *handId, uint8_t *player0Seat,
+				   rng_state_t *rng,
+				   const DealSchedule *schedule,
+				   ErrorInfo *errorInfo,
+				   double totalValue[ MAX_PLAYERS ],
+				   MatchState *state, FILE *file )
+{
+  int c, r;
+  uint32_t h;
+  Action action;
+  struct timeval sendTime, recvTime;
+  char line[ MAX_LINE_LEN ];
+
+  if( checkpointHands ) {
+
+    return processBinaryTransactionFile( game, fixedSeats, handId,
+					 player0Seat, rng, schedule,
+					 errorInfo, totalValue, state, file );
+  }
+
+  while( fgets( line, MAX_LINE_LEN, file ) ) {
+
+    /* get the log entry */
+
+    /* ACTION */
+    c = readAction( line, game, &action );
+    if( c < 0 ) {
+
+      fprintf( stderr, "ERROR: could not parse transaction action %s", line );
+      return -1;
+    }
+
+    /* ACTION HANDID SEND RECV */
+    if( sscanf( &line[ c ], " %"SCNu32" %zu.%06zu %zu.%06zu%n", &h,
+		&sendTime.tv_sec, &sendTime.tv_usec,
+		&recvTime.tv_sec, &recvTime.tv_usec, &r ) < 4 ) {
+
+      fprintf( stderr, "ERROR: could not parse transaction stamp %s", line );
+      return -1;
+    }
+    c += r;
+
+    if( replayTransaction( game, fixedSeats, h, &action, &sendTime,
+			   &recvTime, handId, player0Seat, rng, schedule,
+			   errorInfo, totalValue, state ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
     }
   }
 
   return 0;
 }
 
+/* write a binary transaction record followed by its size
+   returns >= 0 if match should continue, -1 on failure */
+static int writeTransactionRecord( const void *record, const uint32_t size,
+				   FILE *file )
+{
+  const uint32_t recordSize = size + sizeof( recordSize );
+
+  if( fwrite( record, size, 1, file ) != 1
+      || fwrite( &recordSize, sizeof( recordSize ), 1, file ) != 1 ) {
+
+    fprintf( stderr, "ERROR: could not write to transaction file\n" );
+    return -1;
+  }
+  fflush( file );
+
+  return recordSize;
+}
+
 /* returns >= 0 if match should continue, -1 on failure */
 static int logTransaction( const Game *game, const State *state,
 			   const Action *action,
-			   const struct timeval *sendTime,
-			   const struct timeval *recvTime,
-			   FILE *file )
+			   const TimeStamp *sendTime,
+			   const TimeStamp *recvTime,
+			   const uint32_t checkpointHands, FILE *file )
 {
   int c, r;
   char line[ MAX_LINE_LEN ];
+  TransactionActionRecord record;
+
+  if( checkpointHands ) {
+
+    memset( &record, 0, sizeof( record ) );
+    record.type = TRANSACTION_ACTION_RECORD;
+    record.handId = state->handId;
+    record.actionSize = action->size;
+    record.actionType = action->type;
+    record.sendMicros = (uint64_t)sendTime->wall.tv_sec * 1000000
+      + sendTime->wall.tv_usec;
+    record.recvMicros = (uint64_t)recvTime->wall.tv_sec * 1000000
+      + recvTime->wall.tv_usec;
+    return writeTransactionRecord( &record, sizeof( record ), file );
+  }
 
   c = printAction( game, action, MAX_LINE_LEN, line );
   if( c < 0 ) {
@@ -405,8 +1253,8 @@ static int logTransaction( const Game *game, const State *state,
 
   r = snprintf( &line[ c ], MAX_LINE_LEN - c,
 		" %"PRIu32" %zu.%06zu %zu.%06zu\n",
-		state->handId, sendTime->tv_sec, sendTime->tv_usec,
-		recvTime->tv_sec, recvTime->tv_usec );
+		state->handId, sendTime->wall.tv_sec, sendTime->wall.tv_usec,
+		recvTime->wall.tv_sec, recvTime->wall.tv_usec );
   if( r < 0 ) {
 
     fprintf( stderr, "ERROR: transaction message too long\n" );
@@ -424,21 +1272,36 @@ static int logTransaction( const Game *game, const State *state,
   return c;
 }
 
-/* returns >= 0 if match should continue, -1 on failure */
-static int checkVersion( const uint8_t seat,
-			 ReadBuf *readBuf )
+/* checkpoint a binary transaction file at the end of hand handId, every
+   checkpointHands hands, before the next hand is set up
+   returns >= 0 if match should continue, -1 on failure */
+static int logCheckpoint( const uint32_t checkpointHands,
+			  const uint32_t handId, const uint8_t player0Seat,
+			  const rng_state_t *rng, const ErrorInfo *errorInfo,
+			  const double totalValue[ MAX_PLAYERS ], FILE *file )
 {
-  uint32_t major, minor, rev;
-  char line[ MAX_LINE_LEN ];
+  TransactionCheckpointRecord record;
 
+  if( file == NULL || checkpointHands == 0
+      || ( handId + 1 ) % checkpointHands ) {
+    return 0;
+  }
 
-  if( getLine( readBuf, MAX_LINE_LEN, line, -1 ) <= 0 ) {
+  memset( &record, 0, sizeof( record ) );
+  record.type = TRANSACTION_CHECKPOINT_RECORD;
+  record.handId = handId;
+  record.player0Seat = player0Seat;
+  record.rng = *rng;
+  record.errorInfo = *errorInfo;
+  record.errorInfo.latency = NULL;
+  memcpy( record.totalValue, totalValue, sizeof( record.totalValue ) );
+  return writeTransactionRecord( &record, sizeof( record ), file );
+}
 
-    fprintf( stderr,
-	     "ERROR: could not read version string from seat %"PRIu8"\n",
-	     seat + 1 );
-    return -1;
-  }
+/* returns >= 0 if match should continue, -1 on failure */
+static int checkVersionLine( const char *line )
+{
+  uint32_t major, minor, rev;
 
   if( sscanf( line, "VERSION:%"SCNu32".%"SCNu32".%"SCNu32,
 	      &major, &minor, &rev ) < 3 ) {
@@ -456,6 +1319,24 @@ static int checkVersion( const uint8_t seat,
   return 0;
 }
 
+/* returns >= 0 if match should continue, -1 on failure */
+static int checkVersion( const uint8_t seat,
+			 ReadBuf *readBuf )
+{
+  char line[ MAX_LINE_LEN ];
+
+
+  if( getLine( readBuf, MAX_LINE_LEN, line, -1 ) <= 0 ) {
+
+    fprintf( stderr,
+	     "ERROR: could not read version string from seat %"PRIu8"\n",
+	     seat + 1 );
+    return -1;
+  }
+
+  return checkVersionLine( line );
+}
+
 /* returns >= 0 if match should continue, -1 on failure */
 static int addToLogFile( const Game *game, const State *state,
 			 const double value[ MAX_PLAYERS ],
@@ -518,49 +1399,145 @@ static int addToLogFile( const Game *game, const State *state,
   return 0;
 }
 
-/* returns >= 0 if match should continue, -1 on failure */
-static int printFinalMessage( const Game *game, char *seatName[ MAX_PLAYERS ],
-			      const double totalValue[ MAX_PLAYERS ],
-			      FILE *logFile )
+/* add the values of a finished hand to the seat totals and the log
+   returns >= 0 if match should continue, -1 on failure */
+static int finishHand( const Game *game, const State *state,
+		       const uint8_t player0Seat,
+		       char *seatName[ MAX_PLAYERS ],
+		       double totalValue[ MAX_PLAYERS ], FILE *logFile )
 {
-  int c, r;
-  uint8_t s;
-  char line[ MAX_LINE_LEN ];
+  uint8_t p;
+  double value[ MAX_PLAYERS ];
 
-  c = snprintf( line, MAX_LINE_LEN, "SCORE" );
-  if( c < 0 ) {
-    /* message is too long */
+  for( p = 0; p < game->numPlayers; ++p ) {
 
-    fprintf( stderr, "ERROR: value state message too long\n" );
-    return -1;
+    value[ p ] = valueOfState( game, state, p );
+    totalValue[ playerToSeat( game, player0Seat, p ) ] += value[ p ];
   }
 
-  for( s = 0; s < game->numPlayers; ++s ) {
+  if( logFile != NULL ) {
 
-    r = snprintf( &line[ c ], MAX_LINE_LEN - c,
-		  s ? "|%.6f" : ":%.6f", totalValue[ s ] );
-    if( r < 0 ) {
+    return addToLogFile( game, state, value, player0Seat, seatName, logFile );
+  }
 
-      fprintf( stderr, "ERROR: value message too long\n" );
-      return -1;
-    }
-    c += r;
+  return 0;
+}
 
-    /* remove trailing zeros after decimal-point */
-    while( line[ c - 1 ] == '0' ) { --c; }
-    if( line[ c - 1 ] == '.' ) { --c; }
-    line[ c ] = 0;
-  }
+/* set view to what viewingPlayer would receive from printMatchState:
+   the hole cards of other players are only visible at a showdown, and
+   board cards only once their round is reached.  Hidden cards are 0 */
+static void viewState( const Game *game, const State *state,
+		       const uint8_t viewingPlayer, MatchState *view )
+{
+  uint8_t p, numVisibleBoardCards;
+  const int showdown = state->finished
+    && numFolded( game, state ) + 1 < game->numPlayers;
 
-  /* add the player names */
-  for( s = 0; s < game->numPlayers; ++s ) {
+  view->state = *state;
+  view->viewingPlayer = viewingPlayer;
 
-    r = snprintf( &line[ c ], MAX_LINE_LEN - c,
-		  s ? "|%s" : ":%s", seatName[ s ] );
-    if( r < 0 ) {
+  for( p = 0; p < game->numPlayers; ++p ) {
 
-      fprintf( stderr, "ERROR: log message too long\n" );
-      return -1;
+    if( p != viewingPlayer
+	&& !( showdown && !state->playerFolded[ p ] ) ) {
+      memset( view->state.holeCards[ p ], 0,
+	      sizeof( view->state.holeCards[ p ] ) );
+    }
+  }
+
+  numVisibleBoardCards = sumBoardCards( game, state->round );
+  memset( &view->state.boardCards[ numVisibleBoardCards ], 0,
+	  sizeof( view->state.boardCards )
+	  - numVisibleBoardCards * sizeof( view->state.boardCards[ 0 ] ) );
+}
+
+/* get an action from an in-process agent, applying the same checks as
+   readPlayerResponse
+   returns >= 0 if action/size has been set to a valid action
+   returns -1 for failure (agent error, timeout, too many bad actions) */
+static int getAgentAction( const Game *game, const MatchState *view,
+			   const uint8_t seat, const InProcessAgent *agent,
+			   ErrorInfo *errorInfo, Action *action,
+			   TimeStamp *sendTime,
+			   TimeStamp *recvTime )
+{
+  getTimeStamp( sendTime );
+  if( agent->getAction( game, view, agent->data, action ) < 0 ) {
+
+    fprintf( stderr, "ERROR: could not get action from seat %"PRIu8"\n",
+	     seat + 1 );
+    return -1;
+  }
+  getTimeStamp( recvTime );
+
+  recordResponseTime( seat, &sendTime->monotonic, &recvTime->monotonic,
+		      errorInfo );
+  if( checkErrorTimes( seat, &sendTime->monotonic, &recvTime->monotonic,
+		       errorInfo ) < 0 ) {
+
+    fprintf( stderr, "ERROR: seat %"PRIu8" ran out of time\n", seat + 1 );
+    return -1;
+  }
+
+  if( !isValidAction( game, &view->state, 1, action ) ) {
+
+    if( checkErrorInvalidAction( seat, errorInfo ) < 0 ) {
+
+      fprintf( stderr, "ERROR: invalid action\n" );
+      return -1;
+    }
+
+    fprintf( stderr, "WARNING: invalid action, changed to call\n" );
+    action->type = a_call;
+    action->size = 0;
+  }
+
+  return 0;
+}
+
+/* returns >= 0 if match should continue, -1 on failure */
+static int printFinalMessage( const Game *game, char *seatName[ MAX_PLAYERS ],
+			      const double totalValue[ MAX_PLAYERS ],
+			      FILE *logFile )
+{
+  int c, r;
+  uint8_t s;
+  char line[ MAX_LINE_LEN ];
+
+  c = snprintf( line, MAX_LINE_LEN, "SCORE" );
+  if( c < 0 ) {
+    /* message is too long */
+
+    fprintf( stderr, "ERROR: value state message too long\n" );
+    return -1;
+  }
+
+  for( s = 0; s < game->numPlayers; ++s ) {
+
+    r = snprintf( &line[ c ], MAX_LINE_LEN - c,
+		  s ? "|%.6f" : ":%.6f", totalValue[ s ] );
+    if( r < 0 ) {
+
+      fprintf( stderr, "ERROR: value message too long\n" );
+      return -1;
+    }
+    c += r;
+
+    /* remove trailing zeros after decimal-point */
+    while( line[ c - 1 ] == '0' ) { --c; }
+    if( line[ c - 1 ] == '.' ) { --c; }
+    line[ c ] = 0;
+  }
+
+  /* add the player names */
+  for( s = 0; s < game->numPlayers; ++s ) {
+
+    r = snprintf( &line[ c ], MAX_LINE_LEN - c,
+		  s ? "|%s" : ":%s", seatName[ s ] );
+    if( r < 0 ) {
+
+      fprintf( stderr, "ERROR: log message too long\n" );
+      return -1;
     }
     c += r;
   }
@@ -594,11 +1571,13 @@ void initErrorInfo( const uint32_t maxInvalidActions,
     info->usedHandMicros[ s ] = 0;
     info->usedMatchMicros[ s ] = 0;
   }
+  info->latency = NULL;
 }
 
 /* run a match of numHands hands of the supplied game
 
-   cards are dealt using rng, error conditions like timeouts
+   cards are dealt using rng, or copied from schedule if it is not
+   NULL, in which case rng is not used.  Error conditions like timeouts
    are controlled and stored in errorInfo
 
    actions are read/sent to seat p on seatFD[ p ]
@@ -612,22 +1591,36 @@ void initErrorInfo( const uint32_t maxInvalidActions,
    if transactionFile is not NULL, a transaction log of actions made
    is written to the file, and if there is any input left to read on
    the stream when gameLoop is called, it will be processed to
-   initialise the state
+   initialise the state.  If checkpointHands is not 0, the transaction
+   file is binary instead of text, with a checkpoint of the whole match
+   every checkpointHands hands, so only the actions since the last
+   checkpoint are processed
 
    returns >=0 if the match finished correctly, -1 on error */
 int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
 		     const uint32_t numHands, const int quiet,
 		     const int fixedSeats, rng_state_t *rng,
+		     const DealSchedule *schedule,
 		     ErrorInfo *errorInfo, const int seatFD[ MAX_PLAYERS ],
 		     ReadBuf *readBuf[ MAX_PLAYERS ],
-		     FILE *logFile, FILE *transactionFile )
+		     FILE *logFile, FILE *transactionFile,
+		     const uint32_t checkpointHands )
 {
   uint32_t handId;
-  uint8_t seat, p, player0Seat, currentP, currentSeat;
-  struct timeval t, sendTime, recvTime;
+  uint8_t seat, player0Seat, currentP, currentSeat;
+  struct timeval t;
+  TimeStamp sendTime, recvTime;
   Action action;
   MatchState state;
-  double value[ MAX_PLAYERS ], totalValue[ MAX_PLAYERS ];
+  double totalValue[ MAX_PLAYERS ];
+  SeatMessages messages;
+  StateMessageFormatter formatter;
+
+  if( checkDealSchedule( game, numHands, schedule ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
 
   /* check version string for each player */
   for( seat = 0; seat < game->numPlayers; ++seat ) {
@@ -639,10 +1632,10 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
     }
   }
 
-  gettimeofday( &sendTime, NULL );
+  gettimeofday( &t, NULL );
   if( !quiet ) {
     fprintf( stderr, "STARTED at %zu.%06zu\n",
-	     sendTime.tv_sec, sendTime.tv_usec );
+	     t.tv_sec, t.tv_usec );
   }
 
   /* start at the first hand */
@@ -653,7 +1646,7 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
     return -1;
   }
   initState( game, handId, &state.state );
-  dealCards( game, rng, &state.state );
+  dealHand( game, rng, schedule, &state.state );
   for( seat = 0; seat < game->numPlayers; ++seat ) {
     totalValue[ seat ] = 0.0;
   }
@@ -664,9 +1657,9 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
   /* process the transaction file */
   if( transactionFile != NULL ) {
 
-    if( processTransactionFile( game, fixedSeats, &handId, &player0Seat,
-				rng, errorInfo, totalValue,
-				&state, transactionFile ) < 0 ) {
+    if( processTransactionFile( game, fixedSeats, checkpointHands,
+				&handId, &player0Seat, rng, schedule, errorInfo,
+				totalValue, &state, transactionFile ) < 0 ) {
       /* error messages already handled in function */
 
       return -1;
@@ -678,6 +1671,8 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
   }
 
   /* play all the (remaining) hands */
+  initSeatMessages( &messages );
+  initStateMessageFormatter( &formatter );
   while( 1 ) {
 
     /* play the hand */
@@ -686,22 +1681,15 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
       /* find the current player */
       currentP = currentPlayer( game, &state.state );
 
-      /* send state to each player */
-      for( seat = 0; seat < game->numPlayers; ++seat ) {
-
-	state.viewingPlayer = seatToPlayer( game, player0Seat, seat );
-	if( sendPlayerMessage( game, &state, quiet, seat,
-			       seatFD[ seat ], &t ) < 0 ) {
-	  /* error messages already handled in function */
-
-	  return -1;
-	}
-
-	/* remember the seat and send time if player is acting */
-	if( state.viewingPlayer == currentP ) {
+      /* send state to each player, after anything left from the
+	 previous hand */
+      if( queueStateMessages( game, &state, player0Seat, &formatter,
+				&messages ) < 0
+	  || sendSeatMessages( game, quiet, seatFD, &messages,
+			       &sendTime ) < 0 ) {
+	/* error messages already handled in function */
 
-	  sendTime = t;
-	}
+	return -1;
       }
 
       /* get action from current player */
@@ -719,7 +1707,8 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
       if( transactionFile != NULL ) {
 
 	if( logTransaction( game, &state.state, &action,
-			    &sendTime, &recvTime, transactionFile ) < 0 ) {
+			    &sendTime, &recvTime, checkpointHands,
+			    transactionFile ) < 0 ) {
 	  /* error messages already handled in function */
 
 	  return -1;
@@ -730,34 +1719,190 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
       doAction( game, &action, &state.state );
     }
 
-    /* get values */
-    for( p = 0; p < game->numPlayers; ++p ) {
+    /* get values and add the game to the log */
+    if( finishHand( game, &state.state, player0Seat, seatName,
+		    totalValue, logFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+
+    /* queue final state for each player, to be sent with the start of
+       the next hand */
+    if( queueStateMessages( game, &state, player0Seat, &formatter,
+				&messages ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
 
-      value[ p ] = valueOfState( game, &state.state, p );
-      totalValue[ playerToSeat( game, player0Seat, p ) ] += value[ p ];
+    if ( !quiet ) {
+      if ( handId % 100 == 0) {
+	for( seat = 0; seat < game->numPlayers; ++seat ) {
+	  fprintf(stderr, "Seconds cumulatively spent in match for seat %i: "
+		  "%i\n", seat,
+		  (int)(errorInfo->usedMatchMicros[ seat ] / 1000000));
+	}
+      }
     }
 
-    /* add the game to the log */
-    if( logFile != NULL ) {
+    /* start a new hand */
+    if( logCheckpoint( checkpointHands, handId, player0Seat, rng,
+		       errorInfo, totalValue, transactionFile ) < 0
+	|| setUpNewHand( game, fixedSeats, &handId, &player0Seat,
+			 rng, schedule, errorInfo, &state.state ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+    if( handId >= numHands ) {
 
-      if( addToLogFile( game, &state.state, value, player0Seat,
-			seatName, logFile ) < 0 ) {
+      /* send the final state of the last hand */
+      if( sendSeatMessages( game, quiet, seatFD, &messages,
+			    &sendTime ) < 0 ) {
 	/* error messages already handled in function */
 
 	return -1;
       }
+      break;
     }
+  }
 
-    /* send final state to each player */
-    for( seat = 0; seat < game->numPlayers; ++seat ) {
+ finishedGameLoop:
+  /* print out the final values */
+  if( !quiet ) {
+    gettimeofday( &t, NULL );
+    fprintf( stderr, "FINISHED at %zu.%06zu\n", t.tv_sec, t.tv_usec );
+    if( errorInfo->latency != NULL ) {
+      printLatencies( game, seatName, errorInfo->latency, stderr );
+    }
+  }
+  if( printFinalMessage( game, seatName, totalValue, logFile ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* run a match of numHands hands of the supplied game between agents
+   that are called directly instead of over sockets
+
+   agent[ s ] plays in seat s.  Each agent only sees its own player's
+   view of the cards, as if the state had been sent with
+   printMatchState, and is only called when it must act or a hand
+   has finished.  All other arguments, the log file, and the
+   transaction file behave as they do for gameLoop
+
+   returns >=0 if the match finished correctly, -1 on error */
+int inProcessGameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
+		       const uint32_t numHands, const int quiet,
+		       const int fixedSeats, rng_state_t *rng,
+		       const DealSchedule *schedule,
+		       ErrorInfo *errorInfo,
+		       const InProcessAgent agent[ MAX_PLAYERS ],
+		       FILE *logFile, FILE *transactionFile,
+		     const uint32_t checkpointHands )
+{
+  uint32_t handId;
+  uint8_t seat, player0Seat, currentP, currentSeat;
+  struct timeval t;
+  TimeStamp sendTime, recvTime;
+  Action action;
+  MatchState state, view;
+  double totalValue[ MAX_PLAYERS ];
+
+  if( checkDealSchedule( game, numHands, schedule ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  gettimeofday( &t, NULL );
+  if( !quiet ) {
+    fprintf( stderr, "STARTED at %zu.%06zu\n",
+	     t.tv_sec, t.tv_usec );
+  }
+
+  /* start at the first hand */
+  handId = 0;
+  if( checkErrorNewHand( game, errorInfo ) < 0 ) {
+
+    fprintf( stderr, "ERROR: unexpected game\n" );
+    return -1;
+  }
+  initState( game, handId, &state.state );
+  dealHand( game, rng, schedule, &state.state );
+  for( seat = 0; seat < game->numPlayers; ++seat ) {
+    totalValue[ seat ] = 0.0;
+  }
 
-      state.viewingPlayer = seatToPlayer( game, player0Seat, seat );
-      if( sendPlayerMessage( game, &state, quiet, seat,
-			     seatFD[ seat ], &t ) < 0 ) {
+  /* seat 0 is player 0 in first game */
+  player0Seat = 0;
+
+  /* process the transaction file */
+  if( transactionFile != NULL ) {
+
+    if( processTransactionFile( game, fixedSeats, checkpointHands,
+				&handId, &player0Seat, rng, schedule, errorInfo,
+				totalValue, &state, transactionFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+  }
+
+  /* play all the (remaining) hands */
+  while( handId < numHands ) {
+
+    /* play the hand */
+    while( !stateFinished( &state.state ) ) {
+
+      /* get action from current player */
+      currentP = currentPlayer( game, &state.state );
+      currentSeat = playerToSeat( game, player0Seat, currentP );
+      viewState( game, &state.state, currentP, &view );
+      if( getAgentAction( game, &view, currentSeat, &agent[ currentSeat ],
+			  errorInfo, &action, &sendTime, &recvTime ) < 0 ) {
 	/* error messages already handled in function */
 
 	return -1;
       }
+
+      /* log the transaction */
+      if( transactionFile != NULL ) {
+
+	if( logTransaction( game, &state.state, &action,
+			    &sendTime, &recvTime, checkpointHands,
+			    transactionFile ) < 0 ) {
+	  /* error messages already handled in function */
+
+	  return -1;
+	}
+      }
+
+      /* do the action */
+      doAction( game, &action, &state.state );
+    }
+
+    /* get values and add the game to the log */
+    if( finishHand( game, &state.state, player0Seat, seatName,
+		    totalValue, logFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+
+    /* show the final state to each player */
+    for( seat = 0; seat < game->numPlayers; ++seat ) {
+
+      if( agent[ seat ].handFinished != NULL ) {
+
+	viewState( game, &state.state,
+		   seatToPlayer( game, player0Seat, seat ), &view );
+	agent[ seat ].handFinished( game, &view, agent[ seat ].data );
+      }
     }
 
     if ( !quiet ) {
@@ -771,23 +1916,24 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
     }
 
     /* start a new hand */
-    if( setUpNewHand( game, fixedSeats, &handId, &player0Seat,
-		      rng, errorInfo, &state.state ) < 0 ) {
+    if( logCheckpoint( checkpointHands, handId, player0Seat, rng,
+		       errorInfo, totalValue, transactionFile ) < 0
+	|| setUpNewHand( game, fixedSeats, &handId, &player0Seat,
+			 rng, schedule, errorInfo, &state.state ) < 0 ) {
       /* error messages already handled in function */
 
       return -1;
     }
-    if( handId >= numHands ) {
-      break;
-    }
   }
 
- finishedGameLoop:
   /* print out the final values */
   if( !quiet ) {
     gettimeofday( &t, NULL );
     fprintf( stderr, "FINISHED at %zu.%06zu\n",
-	     sendTime.tv_sec, sendTime.tv_usec );
+	     t.tv_sec, t.tv_usec );
+    if( errorInfo->latency != NULL ) {
+      printLatencies( game, seatName, errorInfo->latency, stderr );
+    }
   }
   if( printFinalMessage( game, seatName, totalValue, logFile ) < 0 ) {
     /* error messages already handled in function */
@@ -797,3 +1943,718 @@ int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
 
   return 0;
 }
+
+/* returns 1 once the final values have been printed, -1 on failure */
+static int finishSteppedMatch( SteppedMatch *match )
+{
+  struct timeval t;
+
+  match->finished = 1;
+  if( !match->quiet ) {
+    gettimeofday( &t, NULL );
+    fprintf( stderr, "FINISHED at %zu.%06zu\n", t.tv_sec, t.tv_usec );
+    if( match->errorInfo.latency != NULL ) {
+      printLatencies( match->game, match->seatName,
+		      match->errorInfo.latency, stderr );
+    }
+  }
+  if( printFinalMessage( match->game, match->seatName, match->totalValue,
+			 match->logFile ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  return 1;
+}
+
+/* deal the first hand once every seat has checked in
+   returns 1 if the match is already over, 0 if it should continue,
+   -1 for failure */
+static int startSteppedMatch( SteppedMatch *match )
+{
+  uint8_t seat;
+  struct timeval t;
+  SeatMessages messages;
+
+  if( checkDealSchedule( match->game, match->numHands,
+			 match->schedule ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  gettimeofday( &t, NULL );
+  if( !match->quiet ) {
+    fprintf( stderr, "STARTED at %zu.%06zu\n", t.tv_sec, t.tv_usec );
+  }
+
+  /* start at the first hand */
+  match->handId = 0;
+  if( checkErrorNewHand( match->game, &match->errorInfo ) < 0 ) {
+
+    fprintf( stderr, "ERROR: unexpected game\n" );
+    return -1;
+  }
+  initState( match->game, match->handId, &match->state.state );
+  dealHand( match->game, &match->rng, match->schedule,
+	    &match->state.state );
+  for( seat = 0; seat < match->game->numPlayers; ++seat ) {
+    match->totalValue[ seat ] = 0.0;
+  }
+
+  /* seat 0 is player 0 in first game */
+  match->player0Seat = 0;
+
+  /* process the transaction file */
+  if( match->transactionFile != NULL ) {
+
+    if( processTransactionFile( match->game, match->fixedSeats,
+				match->checkpointHands,
+				&match->handId, &match->player0Seat,
+				&match->rng, match->schedule, &match->errorInfo,
+				match->totalValue, &match->state,
+				match->transactionFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+  }
+
+  if( match->handId >= match->numHands ) {
+    return finishSteppedMatch( match );
+  }
+
+  initSeatMessages( &messages );
+  if( queueStateMessages( match->game, &match->state, match->player0Seat,
+			  &match->formatter, &messages ) < 0
+      || sendSeatMessages( match->game, match->quiet, match->seatFD,
+			   &messages, &match->sendTime ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* set up match to be played by the players connected on seatFD.  The
+   arguments are the same as gameLoop's, except that rng and errorInfo
+   are copied into the match, schedule must outlive it, and the players
+   are read from by the caller */
+void initSteppedMatch( const Game *game, char *seatName[ MAX_PLAYERS ],
+		       const uint32_t numHands, const int quiet,
+		       const int fixedSeats, const rng_state_t *rng,
+		       const DealSchedule *schedule,
+		       const ErrorInfo *errorInfo,
+		       const int seatFD[ MAX_PLAYERS ],
+		       FILE *logFile, FILE *transactionFile,
+		       const uint32_t checkpointHands, SteppedMatch *match )
+{
+  uint8_t seat;
+
+  memset( match, 0, sizeof( *match ) );
+  match->game = game;
+  match->numHands = numHands;
+  match->quiet = quiet;
+  match->fixedSeats = fixedSeats;
+  match->rng = *rng;
+  match->schedule = schedule;
+  match->errorInfo = *errorInfo;
+  match->logFile = logFile;
+  match->transactionFile = transactionFile;
+  match->checkpointHands = checkpointHands;
+  initStateMessageFormatter( &match->formatter );
+  for( seat = 0; seat < game->numPlayers; ++seat ) {
+
+    match->seatName[ seat ] = seatName[ seat ];
+    match->seatFD[ seat ] = seatFD[ seat ];
+  }
+
+  /* every seat has until maxResponseMicros from now to send its version */
+  getTimeStamp( &match->sendTime );
+}
+
+/* advance match with one line of input from seat, including its
+   new-line.  The first line from each seat must be its version string,
+   and the first hand is dealt once every seat has sent one
+   returns 1 if the match has finished, 0 if it needs more input,
+   -1 for failure */
+int steppedMatchLine( SteppedMatch *match, const uint8_t seat,
+		      const char *line )
+{
+  int r;
+  uint8_t s, currentP, currentSeat;
+  TimeStamp recvTime;
+  Action action;
+  SeatMessages messages;
+
+  if( match->finished ) {
+    return 1;
+  }
+
+  if( !match->versionChecked[ seat ] ) {
+
+    if( checkVersionLine( line ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+    match->versionChecked[ seat ] = 1;
+    ++match->numVersionsChecked;
+
+    if( match->numVersionsChecked < match->game->numPlayers ) {
+      return 0;
+    }
+    return startSteppedMatch( match );
+  }
+
+  getTimeStamp( &recvTime );
+  if( match->numVersionsChecked < match->game->numPlayers ) {
+    /* the match has not started, so nothing could have been requested */
+
+    if( !match->quiet ) {
+      fprintf( stderr, "FROM %d at %zu.%06zu %s", seat + 1,
+	       recvTime.wall.tv_sec, recvTime.wall.tv_usec, line );
+    }
+    return 0;
+  }
+
+  currentP = currentPlayer( match->game, &match->state.state );
+  currentSeat = playerToSeat( match->game, match->player0Seat, currentP );
+  if( seat != currentSeat ) {
+    /* gameLoop would leave the line unread until it was this seat's
+       turn, and then ignore it, since it can't match a later state */
+
+    if( !match->quiet ) {
+      fprintf( stderr, "FROM %d at %zu.%06zu %s", seat + 1,
+	       recvTime.wall.tv_sec, recvTime.wall.tv_usec, line );
+    }
+    if( line[ 0 ] != '#' && line[ 0 ] != ';' ) {
+      fprintf( stderr, "WARNING: ignoring un-requested response\n" );
+    }
+    return 0;
+  }
+
+  match->state.viewingPlayer = currentP;
+  r = parsePlayerResponse( match->game, &match->state, match->quiet, seat,
+			   &match->sendTime, &recvTime, &match->errorInfo,
+			   line, &action );
+  if( r <= 0 ) {
+    /* error messages already handled in function */
+
+    return r;
+  }
+
+  /* log the transaction */
+  if( match->transactionFile != NULL ) {
+
+    if( logTransaction( match->game, &match->state.state, &action,
+			&match->sendTime, &recvTime, match->checkpointHands,
+			match->transactionFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+  }
+
+  /* do the action */
+  doAction( match->game, &action, &match->state.state );
+
+  initSeatMessages( &messages );
+  if( stateFinished( &match->state.state ) ) {
+
+    /* get values and add the game to the log */
+    if( finishHand( match->game, &match->state.state, match->player0Seat,
+		    match->seatName, match->totalValue,
+		    match->logFile ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+
+    /* queue final state for each player, to be sent with the start of
+       the next hand */
+    if( queueStateMessages( match->game, &match->state, match->player0Seat,
+			    &match->formatter, &messages ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+
+    if ( !match->quiet ) {
+      if ( match->handId % 100 == 0) {
+	for( s = 0; s < match->game->numPlayers; ++s ) {
+	  fprintf(stderr, "Seconds cumulatively spent in match for seat %i: "
+		  "%i\n", s,
+		  (int)(match->errorInfo.usedMatchMicros[ s ] / 1000000));
+	}
+      }
+    }
+
+    /* start a new hand */
+    if( logCheckpoint( match->checkpointHands, match->handId,
+		       match->player0Seat, &match->rng, &match->errorInfo,
+		       match->totalValue, match->transactionFile ) < 0
+	|| setUpNewHand( match->game, match->fixedSeats, &match->handId,
+			 &match->player0Seat, &match->rng, match->schedule,
+			 &match->errorInfo, &match->state.state ) < 0 ) {
+      /* error messages already handled in function */
+
+      return -1;
+    }
+    if( match->handId >= match->numHands ) {
+
+      /* send the final state of the last hand */
+      if( sendSeatMessages( match->game, match->quiet, match->seatFD,
+			    &messages, &match->sendTime ) < 0 ) {
+	/* error messages already handled in function */
+
+	return -1;
+      }
+      return finishSteppedMatch( match );
+    }
+  }
+
+  if( queueStateMessages( match->game, &match->state, match->player0Seat,
+			  &match->formatter, &messages ) < 0
+      || sendSeatMessages( match->game, match->quiet, match->seatFD,
+			   &messages, &match->sendTime ) < 0 ) {
+    /* error messages already handled in function */
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* returns the microseconds the acting seat has left to respond, 0 if it
+   has run out of time, or -1 if the match has finished.  Until every
+   seat has sent its version, it is the time they have left to send it */
+int64_t steppedMatchMicrosLeft( const SteppedMatch *match )
+{
+  int64_t waited;
+  TimeStamp now;
+
+  if( match->finished ) {
+    return -1;
+  }
+
+  getTimeStamp( &now );
+  waited = (int64_t)( now.monotonic.tv_sec
+		     - match->sendTime.monotonic.tv_sec ) * 1000000
+    + ( now.monotonic.tv_usec - match->sendTime.monotonic.tv_usec );
+  if( waited >= (int64_t)match->errorInfo.maxResponseMicros ) {
+    return 0;
+  }
+  return match->errorInfo.maxResponseMicros - waited;
+}
+
+/* a stream whose records are copied into a buffer and written to a file
+   by a background thread.  Each fflush of the stream, which the dealer
+   does after every hand in the log file and every action in the
+   transaction file, ends a record.  While the thread writes one buffer
+   the game loop fills the other, and only waits for the thread when
+   the stream is closed, or when it has filled MAX_LOG_BUFFER_BYTES
+   before the thread has written the other buffer */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} LogBuffer;
+
+typedef struct LogWriter {
+  FILE *file;
+  FILE *stream;
+  struct LogWriter *next;
+  LogFlushPolicy policy;
+  uint64_t interval;
+  int syncToDisk;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_cond_t swapped;
+  /* the buffer being filled, and the one being written */
+  LogBuffer buffers[ 2 ];
+  LogBuffer *front;
+  LogBuffer *back;
+  uint64_t numRecordsBuffered;
+  int handOff;
+  int closing;
+  int error;
+} LogWriter;
+
+/* every open LogWriter, so a stream can be traced back to its file */
+static pthread_mutex_t logWritersMutex = PTHREAD_MUTEX_INITIALIZER;
+static LogWriter *logWriters = NULL;
+
+/* returns the descriptor of the file a stream from openBufferedLog
+   writes to, or -1 if it isn't one */
+static int bufferedLogDescriptor( FILE *stream )
+{
+  int fd = -1;
+  LogWriter *writer;
+
+  pthread_mutex_lock( &logWritersMutex );
+  for( writer = logWriters; writer != NULL; writer = writer->next ) {
+
+    if( writer->stream == stream ) {
+
+      fd = fileno( writer->file );
+      break;
+    }
+  }
+  pthread_mutex_unlock( &logWritersMutex );
+
+  return fd;
+}
+
+static int appendToLogBuffer( LogBuffer *buffer, const char *data,
+			      const size_t len )
+{
+  size_t capacity;
+  char *grown;
+
+  if( buffer->len + len > buffer->capacity ) {
+
+    capacity = buffer->capacity ? buffer->capacity : MAX_LINE_LEN;
+    while( capacity < buffer->len + len ) {
+      capacity *= 2;
+    }
+    grown = realloc( buffer->data, capacity );
+    if( grown == NULL ) {
+      return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy( &buffer->data[ buffer->len ], data, len );
+  buffer->len += len;
+
+  return 0;
+}
+
+/* write the back buffer to the file without holding the lock
+   returns >= 0 on success, -1 on failure */
+static int writeLogBuffer( LogWriter *writer, LogBuffer *buffer )
+{
+  int r = 0;
+
+  pthread_mutex_unlock( &writer->mutex );
+  if( fwrite( buffer->data, 1, buffer->len, writer->file ) != buffer->len
+      || fflush( writer->file ) != 0
+      || ( writer->syncToDisk && fdatasync( fileno( writer->file ) ) < 0 ) ) {
+
+    fprintf( stderr, "ERROR: could not write buffered log\n" );
+    r = -1;
+  }
+  pthread_mutex_lock( &writer->mutex );
+  buffer->len = 0;
+
+  return r;
+}
+
+static void *runLogWriter( void *arg )
+{
+  int r;
+  LogBuffer *buffer;
+  struct timespec deadline;
+  LogWriter *writer = (LogWriter *)arg;
+
+  pthread_mutex_lock( &writer->mutex );
+  while( 1 ) {
+
+    while( !writer->handOff && !writer->closing ) {
+
+      if( writer->policy == LOG_FLUSH_EVERY_N_MICROS ) {
+
+	clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec += writer->interval / 1000000;
+	deadline.tv_nsec += ( writer->interval % 1000000 ) * 1000;
+	if( deadline.tv_nsec >= 1000000000 ) {
+	  ++deadline.tv_sec;
+	  deadline.tv_nsec -= 1000000000;
+	}
+	r = pthread_cond_timedwait( &writer->wake, &writer->mutex,
+				    &deadline );
+	if( r != 0 && writer->front->len > 0 ) {
+	  /* the interval passed */
+
+	  writer->handOff = 1;
+	}
+      } else {
+
+	pthread_cond_wait( &writer->wake, &writer->mutex );
+      }
+    }
+
+    if( writer->front->len == 0 ) {
+
+      writer->handOff = 0;
+      if( writer->closing ) {
+	break;
+      }
+      continue;
+    }
+
+    /* swap the buffers, so the game loop keeps filling the other */
+    buffer = writer->front;
+    writer->front = writer->back;
+    writer->back = buffer;
+    writer->numRecordsBuffered = 0;
+    writer->handOff = 0;
+    pthread_cond_signal( &writer->swapped );
+
+    if( writeLogBuffer( writer, writer->back ) < 0 ) {
+      writer->error = 1;
+    }
+  }
+  pthread_mutex_unlock( &writer->mutex );
+
+  return NULL;
+}
+
+static ssize_t readLogWriter( void *cookie, char *buf, size_t size )
+{
+  /* only used to resume from a transaction file, before any writes */
+  return fread( buf, 1, size, ( (LogWriter *)cookie )->file );
+}
+
+static int seekLogWriter( void *cookie, off64_t *offset, int whence )
+{
+  /* also only used to resume from a transaction file.  Buffered records
+     are still written at the end, as the file is opened for appending */
+  FILE *file = ( (LogWriter *)cookie )->file;
+  off_t pos;
+
+  if( fseeko( file, *offset, whence ) < 0 || ( pos = ftello( file ) ) < 0 ) {
+    return -1;
+  }
+  *offset = pos;
+
+  return 0;
+}
+
+static ssize_t writeLogWriter( void *cookie, const char *buf, size_t size )
+{
+  int r;
+  LogWriter *writer = (LogWriter *)cookie;
+
+  pthread_mutex_lock( &writer->mutex );
+
+  /* a full buffer is handed off whatever the policy, waiting for the
+     thread to take it if it is still writing the other one */
+  while( writer->front->len > 0
+	 && writer->front->len + size > MAX_LOG_BUFFER_BYTES
+	 && !writer->error ) {
+
+    writer->handOff = 1;
+    pthread_cond_signal( &writer->wake );
+    pthread_cond_wait( &writer->swapped, &writer->mutex );
+  }
+
+  r = writer->error ? -1 : appendToLogBuffer( writer->front, buf, size );
+  ++writer->numRecordsBuffered;
+  if( writer->policy == LOG_FLUSH_EVERY_RECORD
+      || ( writer->policy == LOG_FLUSH_EVERY_N_RECORDS
+	   && writer->numRecordsBuffered >= writer->interval )
+      || writer->front->len >= MAX_LOG_BUFFER_BYTES ) {
+
+    writer->handOff = 1;
+    pthread_cond_signal( &writer->wake );
+  }
+  pthread_mutex_unlock( &writer->mutex );
+
+  return r < 0 ? 0 : (ssize_t)size;
+}
+
+/* write anything left, then stop the thread and free writer
+   returns >= 0 on success, -1 if any write failed */
+static int stopLogWriter( LogWriter *writer )
+{
+  int error;
+  LogWriter **link;
+
+  pthread_mutex_lock( &logWritersMutex );
+  for( link = &logWriters; *link != NULL; link = &( *link )->next ) {
+
+    if( *link == writer ) {
+
+      *link = writer->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &logWritersMutex );
+
+  pthread_mutex_lock( &writer->mutex );
+  writer->closing = 1;
+  pthread_cond_signal( &writer->wake );
+  pthread_mutex_unlock( &writer->mutex );
+  pthread_join( writer->thread, NULL );
+
+  error = writer->error;
+  pthread_cond_destroy( &writer->swapped );
+  pthread_cond_destroy( &writer->wake );
+  pthread_mutex_destroy( &writer->mutex );
+  free( writer->buffers[ 0 ].data );
+  free( writer->buffers[ 1 ].data );
+  free( writer );
+
+  return error ? -1 : 0;
+}
+
+static int closeLogWriter( void *cookie )
+{
+  FILE *file = ( (LogWriter *)cookie )->file;
+  int r = stopLogWriter( (LogWriter *)cookie );
+
+  if( fclose( file ) != 0 ) {
+    r = -1;
+  }
+
+  return r < 0 ? EOF : 0;
+}
+
+/* returns a stream that buffers what is written to it and writes it to
+   file from a background thread, at times set by policy.  interval is
+   the number of records for LOG_FLUSH_EVERY_N_RECORDS, and microseconds
+   for LOG_FLUSH_EVERY_N_MICROS.  If syncToDisk is not zero, each write
+   is also synced to disk.  Closing the stream writes anything left,
+   and closes file
+   returns NULL on failure, in which case file is left open */
+FILE *openBufferedLog( FILE *file, const LogFlushPolicy policy,
+		       const uint64_t interval, const int syncToDisk )
+{
+  FILE *stream;
+  LogWriter *writer;
+  cookie_io_functions_t functions = {
+    readLogWriter, writeLogWriter, seekLogWriter, closeLogWriter
+  };
+
+  writer = calloc( 1, sizeof( *writer ) );
+  if( writer == NULL ) {
+    return NULL;
+  }
+  writer->file = file;
+  writer->policy = policy;
+  writer->interval = interval;
+  writer->syncToDisk = syncToDisk;
+  writer->front = &writer->buffers[ 0 ];
+  writer->back = &writer->buffers[ 1 ];
+  pthread_mutex_init( &writer->mutex, NULL );
+  pthread_cond_init( &writer->wake, NULL );
+  pthread_cond_init( &writer->swapped, NULL );
+
+  if( pthread_create( &writer->thread, NULL, runLogWriter, writer ) != 0 ) {
+
+    pthread_cond_destroy( &writer->swapped );
+    pthread_cond_destroy( &writer->wake );
+    pthread_mutex_destroy( &writer->mutex );
+    free( writer );
+    return NULL;
+  }
+
+  stream = fopencookie( writer, "a+", functions );
+  if( stream == NULL ) {
+
+    stopLogWriter( writer );
+    return NULL;
+  }
+
+  writer->stream = stream;
+  pthread_mutex_lock( &logWritersMutex );
+  writer->next = logWriters;
+  logWriters = writer;
+  pthread_mutex_unlock( &logWritersMutex );
+
+  return stream;
+}
+
+/* a socket listening at path, for players on the same host to connect
+   to with connectToUnixSocket instead of over TCP.  A socket left at
+   path by an earlier match is replaced
+   returns the socket, or -1 on failure */
+int getUnixListenSocket( const char *path )
+{
+  int sock;
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if( strlen( path ) >= sizeof( addr.sun_path ) ) {
+
+    fprintf( stderr, "ERROR: socket path is too long: %s\n", path );
+    return -1;
+  }
+
+  sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( sock < 0 ) {
+
+    fprintf( stderr, "ERROR: could not open socket\n" );
+    return -1;
+  }
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+  if( stat( path, &st ) == 0 && S_ISSOCK( st.st_mode ) ) {
+    unlink( path );
+  }
+
+  if( bind( sock, (struct sockaddr *)&addr, sizeof( addr ) ) < 0
+      || listen( sock, 1 ) < 0 ) {
+
+    fprintf( stderr, "ERROR: could not listen on %s\n", path );
+    close( sock );
+    return -1;
+  }
+
+  return sock;
+}
+
+/* connect to a dealer listening at path
+   returns the socket, or -1 on failure */
+int connectToUnixSocket( const char *path )
+{
+  int sock;
+  struct sockaddr_un addr;
+
+  if( strlen( path ) >= sizeof( addr.sun_path ) ) {
+
+    fprintf( stderr, "ERROR: socket path is too long: %s\n", path );
+    return -1;
+  }
+
+  sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( sock < 0 ) {
+
+    fprintf( stderr, "ERROR: could not open socket\n" );
+    return -1;
+  }
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+  if( connect( sock, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+
+    fprintf( stderr, "ERROR: could not connect to %s\n", path );
+    close( sock );
+    return -1;
+  }
+
+  return sock;
+}
+
+/* returns 1 if sock is listening for connections, 0 if it is not, like
+   one that is already connected to a player */
+int isListenSocket( const int sock )
+{
+  int listening;
+  socklen_t len = sizeof( listening );
+
+  if( getsockopt( sock, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len ) < 0 ) {
+    return 0;
+  }
+
+  return listening != 0;
+}
@@ -2,11 +2,15 @@
 Copyright (C) 2011 by the Computer Poker Research Group, University of Alberta
 */
 
+#ifndef _DEALER_H
+#define _DEALER_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #define __STDC_LIMIT_MACROS
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <game.h>
 
 
@@ -36,6 +40,55 @@ Copyright (C) 2011 by the Computer Poker Research Group, University of Alberta
 #define DEFAULT_MAX_USED_PER_HAND_MICROS 7000000
 
 
+/* response times of one seat in microseconds.  Like an HDR histogram,
+   times below 2 * LATENCY_SUB_BUCKETS are counted exactly, and each
+   power of two above that is split into LATENCY_SUB_BUCKETS buckets, so
+   every time is known to within 1 / LATENCY_SUB_BUCKETS */
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS ( 1 << LATENCY_SUB_BUCKET_BITS )
+#define LATENCY_NUM_BUCKETS \
+  ( ( 64 - LATENCY_SUB_BUCKET_BITS + 1 ) * LATENCY_SUB_BUCKETS )
+typedef struct {
+  uint64_t count[ LATENCY_NUM_BUCKETS ];
+  uint64_t numResponses;
+  uint64_t totalMicros;
+  uint64_t maxMicros;
+} LatencyHistogram;
+
+void recordLatency( const uint64_t micros, LatencyHistogram *histogram );
+/* the smallest time that percentile percent of the responses took no
+   longer than, to within the bucket size */
+uint64_t latencyPercentile( const LatencyHistogram *histogram,
+			    const double percentile );
+/* print a line for each seat with its number of responses and their
+   mean, median, 90th, 99th and 99.9th percentile, and maximum times
+   returns >= 0 on success, -1 on failure */
+int printLatencies( const Game *game, char *seatName[ MAX_PLAYERS ],
+		    const LatencyHistogram latency[ MAX_PLAYERS ],
+		    FILE *file );
+
+/* the cards of every hand of a match, dealt ahead of time so the dealer
+   only copies them at the start of each hand.  cards holds cardsPerHand
+   cards for each of numHands hands: the hole cards of player 0, then
+   player 1, and so on, then the board cards of every round.  The
+   schedule does not own cards.  Hands past numHands are not dealt */
+typedef struct {
+  uint32_t numHands;
+  uint8_t cardsPerHand;
+  const uint8_t *cards;
+} DealSchedule;
+
+/* the number of cards dealt in each hand of game */
+uint8_t dealScheduleCardsPerHand( const Game *game );
+/* deal numHands hands with rng, exactly as a match would, into cards,
+   which must hold numHands * dealScheduleCardsPerHand( game ) cards */
+void fillDealSchedule( const Game *game, rng_state_t *rng,
+		       const uint32_t numHands, uint8_t *cards );
+/* returns >= 0 if schedule can deal numHands hands of game,
+   -1 otherwise.  A NULL schedule is always usable */
+int checkDealSchedule( const Game *game, const uint32_t numHands,
+		       const DealSchedule *schedule );
+
 typedef struct {
   uint32_t maxInvalidActions;
   uint64_t maxResponseMicros;
@@ -45,6 +98,11 @@ typedef struct {
   uint32_t numInvalidActions[ MAX_PLAYERS ];
   uint64_t usedHandMicros[ MAX_PLAYERS ];
   uint64_t usedMatchMicros[ MAX_PLAYERS ];
+
+  /* if not NULL, the time of every response from seat s while the match
+     is played, but not while it is resumed from a transaction file, is
+     recorded in latency[ s ].  initErrorInfo sets it to NULL */
+  LatencyHistogram *latency;
 } ErrorInfo;
 
 void initErrorInfo( const uint32_t maxInvalidActions,
@@ -55,6 +113,134 @@ void initErrorInfo( const uint32_t maxInvalidActions,
 int gameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
 		     const uint32_t numHands, const int quiet,
 		     const int fixedSeats, rng_state_t *rng,
+		     const DealSchedule *schedule,
 		     ErrorInfo *errorInfo, const int seatFD[ MAX_PLAYERS ],
 		     ReadBuf *readBuf[ MAX_PLAYERS ],
-		     FILE *logFile, FILE *transactionFile );
+		     FILE *logFile, FILE *transactionFile,
+		     const uint32_t checkpointHands );
+
+/* an agent that plays in the same process as the dealer
+
+   getAction is called with the agent's view of the state whenever it
+   must act.  It must set action and return >= 0, or return -1 to stop
+   the match.  handFinished is called with the agent's view of every
+   finished hand, and may be NULL.  data is passed to both */
+typedef struct {
+  int ( *getAction )( const Game *game, const MatchState *state,
+		      void *data, Action *action );
+  void ( *handFinished )( const Game *game, const MatchState *state,
+			  void *data );
+  void *data;
+} InProcessAgent;
+
+int inProcessGameLoop( const Game *game, char *seatName[ MAX_PLAYERS ],
+		       const uint32_t numHands, const int quiet,
+		       const int fixedSeats, rng_state_t *rng,
+		       const DealSchedule *schedule,
+		       ErrorInfo *errorInfo,
+		       const InProcessAgent agent[ MAX_PLAYERS ],
+		       FILE *logFile, FILE *transactionFile,
+		       const uint32_t checkpointHands );
+
+/* the parts of the current hand's state messages that every seat shares,
+   so each message is put together from them instead of being printed
+   from scratch.  The betting is appended to as actions are taken, and
+   the cards are printed once per hand */
+typedef struct {
+  int valid;
+  uint32_t handId;
+  char handIdString[ 16 ];
+  int handIdLen;
+
+  uint8_t bettingRound;
+  uint8_t bettingNumActions;
+  char betting[ MAX_LINE_LEN ];
+  int bettingLen;
+
+  char holeCards[ MAX_PLAYERS ][ MAX_HOLE_CARDS * 2 + 1 ];
+  int holeCardsLen[ MAX_PLAYERS ];
+  /* every board card, with the cards of round r ending at boardEnd[ r ] */
+  char board[ MAX_BOARD_CARDS * 2 + MAX_ROUNDS + 1 ];
+  int boardEnd[ MAX_ROUNDS ];
+} StateMessageFormatter;
+
+void initStateMessageFormatter( StateMessageFormatter *formatter );
+/* print the same message as printMatchState, using and updating the
+   parts formatter holds for state's hand.  Within a hand, state may only
+   gain actions between calls
+   returns the number of characters printed, or -1 on failure */
+int printStateMessage( StateMessageFormatter *formatter, const Game *game,
+		       const MatchState *state, const int maxLen,
+		       char *string );
+
+/* when a message was sent or arrived: the time of day, which is printed
+   and logged, and the monotonic clock, which response times are measured
+   with since the time of day can jump */
+typedef struct {
+  struct timeval wall;
+  struct timeval monotonic;
+} TimeStamp;
+
+/* a match that advances one line of player input at a time, for dealers
+   that wait on many matches at once instead of blocking in gameLoop.
+   The rules, messages, and log files are the same as gameLoop's */
+typedef struct {
+  const Game *game;
+  char *seatName[ MAX_PLAYERS ];
+  uint32_t numHands;
+  int quiet;
+  int fixedSeats;
+  rng_state_t rng;
+  const DealSchedule *schedule;
+  ErrorInfo errorInfo;
+  int seatFD[ MAX_PLAYERS ];
+  FILE *logFile;
+  FILE *transactionFile;
+  uint32_t checkpointHands;
+
+  uint8_t versionChecked[ MAX_PLAYERS ];
+  uint8_t numVersionsChecked;
+  uint8_t player0Seat;
+  uint32_t handId;
+  MatchState state;
+  TimeStamp sendTime;
+  double totalValue[ MAX_PLAYERS ];
+  StateMessageFormatter formatter;
+  int finished;
+} SteppedMatch;
+
+void initSteppedMatch( const Game *game, char *seatName[ MAX_PLAYERS ],
+		       const uint32_t numHands, const int quiet,
+		       const int fixedSeats, const rng_state_t *rng,
+		       const DealSchedule *schedule,
+		       const ErrorInfo *errorInfo,
+		       const int seatFD[ MAX_PLAYERS ],
+		       FILE *logFile, FILE *transactionFile,
+		       const uint32_t checkpointHands, SteppedMatch *match );
+int steppedMatchLine( SteppedMatch *match, const uint8_t seat,
+		      const char *line );
+int64_t steppedMatchMicrosLeft( const SteppedMatch *match );
+
+/* when openBufferedLog hands buffered records to its writer thread */
+typedef enum {
+  LOG_FLUSH_EVERY_RECORD,
+  LOG_FLUSH_EVERY_N_RECORDS,
+  LOG_FLUSH_EVERY_N_MICROS,
+  LOG_FLUSH_AT_CLOSE
+} LogFlushPolicy;
+
+/* whatever the policy, records are handed to the writer thread once this
+   many bytes are buffered, and writes wait while the thread is still
+   writing the last buffer handed to it */
+#define MAX_LOG_BUFFER_BYTES ( 1 << 20 )
+
+FILE *openBufferedLog( FILE *file, const LogFlushPolicy policy,
+		       const uint64_t interval, const int syncToDisk );
+
+/* unix domain sockets, for matches where every player is on the
+   dealer's host */
+int getUnixListenSocket( const char *path );
+int connectToUnixSocket( const char *path );
+int isListenSocket( const int sock );
+
+#endif
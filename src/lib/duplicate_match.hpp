@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/acpc_match_log.hpp>
+
+extern "C" {
+#include <game.h>
+#include <net.h>
+#include <unistd.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+namespace Dealer {
+/// Every ordering of @p numPlayers players, in lexicographic order
+std::vector<std::vector<size_t>> seatPermutations(const size_t numPlayers) {
+  std::vector<size_t> permutation(numPlayers);
+  std::iota(permutation.begin(), permutation.end(), 0);
+  std::vector<std::vector<size_t>> permutations;
+  do {
+    permutations.push_back(permutation);
+  } while (std::next_permutation(permutation.begin(), permutation.end()));
+  return permutations;
+}
+
+/**
+ * Name of one permutation of a duplicate match, like
+ * "3pk.HITSZ_CS.hyperborean3pk.RMPUE.Bluffer.5.0" for the first permutation
+ * of match 5 between those players, who are listed in their original order.
+ */
+std::string duplicateMatchName(const std::string &prefix,
+                               const std::vector<std::string> &players,
+                               const uint32_t matchIndex,
+                               const size_t permutationIndex) {
+  std::string name = prefix;
+  for (const auto &player : players) {
+    name += "." + player;
+  }
+  return name + "." + std::to_string(matchIndex) + "." +
+         std::to_string(permutationIndex);
+}
+
+/**
+ * A duplicate match: one match of the same cards for every seat permutation
+ * of the players. The cards are dealt once, when it is constructed. All the
+ * permutations are played concurrently with startMatch, so the whole set
+ * takes about as long as one permutation, and their logs can then be
+ * analyzed together.
+ */
+class DuplicateMatch {
+public:
+  /**
+   * Starts the players of one permutation. Called with the permutation's
+   * match name, the player in each seat, and the port each seat must
+   * connect to, once the ports are ready to accept connections.
+   */
+  typedef std::function<void(const std::string &matchName,
+                             const std::vector<std::string> &seatPlayers,
+                             const std::vector<uint16_t> &ports)>
+      PlayerLauncher;
+
+  DuplicateMatch(const std::string &prefix, const GameDef &gameDef,
+                 const std::vector<std::string> &players,
+                 const std::string &workingDirectory, uint32_t matchIndex,
+                 uint32_t seed, uint32_t numHands = 3000)
+      : gameDef_(gameDef), players_(players),
+        workingDirectory_(workingDirectory), seed_(seed), numHands_(numHands),
+        deals_(Deals::generate(gameDef, seed, numHands)),
+        permutations_(seatPermutations(players.size())), matchNames_(),
+        logFilePaths_() {
+    assert(players_.size() == gameDef_.game_->numPlayers);
+    for (size_t i = 0; i < permutations_.size(); ++i) {
+      matchNames_.push_back(
+          duplicateMatchName(prefix, players_, matchIndex, i));
+      logFilePaths_.push_back(workingDirectory_ + "/" + matchNames_.back() +
+                              ".log");
+    }
+  }
+  virtual ~DuplicateMatch(){};
+
+  size_t numPermutations() const { return permutations_.size(); }
+  const std::vector<size_t> &permutation(size_t i) const {
+    return permutations_[i];
+  }
+  const std::vector<std::string> &matchNames() const { return matchNames_; }
+  const std::vector<std::string> &logFilePaths() const {
+    return logFilePaths_;
+  }
+
+  /// The players in seat order for permutation @p i
+  std::vector<std::string> seatPlayers(size_t i) const {
+    std::vector<std::string> seats;
+    for (const auto p : permutations_[i]) {
+      seats.push_back(players_[p]);
+    }
+    return seats;
+  }
+
+  /**
+   * Plays every permutation at once, each with startMatch on its own thread
+   * and ports. Returns EXIT_SUCCESS if every permutation succeeded.
+   */
+  int run(const PlayerLauncher &launchPlayers) const {
+    std::vector<int> status(numPermutations(), EXIT_FAILURE);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numPermutations(); ++i) {
+      threads.emplace_back([this, i, &status, &launchPlayers]() {
+        status[i] = runPermutation(i, launchPlayers);
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    return std::all_of(status.begin(), status.end(),
+                       [](int s) { return s == EXIT_SUCCESS; })
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  /// Processes the logs of every permutation in parallel
+  void analyze(const std::function<
+               bool(const EncapsulatedMatchState &ms,
+                    const std::vector<std::string> playerNames)> &doFn) const {
+    LogFileSet(logFilePaths_, gameDef_).processFilesInParallel(doFn);
+  }
+
+  /// Each player's total value over every permutation, from the logs
+  std::map<std::string, double> totalValues() const {
+    std::map<std::string, double> totals;
+    for (const auto &player : players_) {
+      totals[player] = 0.0;
+    }
+    std::mutex totalsMutex;
+    analyze([this, &totals, &totalsMutex](
+        const EncapsulatedMatchState &ms,
+        const std::vector<std::string> playerNames) {
+      std::lock_guard<std::mutex> lock(totalsMutex);
+      for (uint8_t p = 0; p < playerNames.size(); ++p) {
+        totals[playerNames[p]] +=
+            valueOfState(gameDef_.game_, &ms.state(), p);
+      }
+      return false;
+    });
+    return totals;
+  }
+
+protected:
+  int runPermutation(const size_t i,
+                     const PlayerLauncher &launchPlayers) const {
+    const uint8_t numPlayers = gameDef_.game_->numPlayers;
+    std::vector<int> listenSockets(numPlayers);
+    std::vector<uint16_t> ports(numPlayers);
+    for (uint8_t s = 0; s < numPlayers; ++s) {
+      ports[s] = 0;
+      listenSockets[s] = getListenSocket(&ports[s]);
+      if (listenSockets[s] < 0) {
+        fprintf(stderr, "ERROR: could not create listen socket for %s\n",
+                matchNames_[i].c_str());
+        for (uint8_t o = 0; o < s; ++o) {
+          close(listenSockets[o]);
+        }
+        return EXIT_FAILURE;
+      }
+    }
+    launchPlayers(matchNames_[i], seatPlayers(i), ports);
+    return startMatch(matchNames_[i], gameDef_, seatPlayers(i), listenSockets,
+                      workingDirectory_, numHands_, seed_,
+                      DEFAULT_MAX_INVALID_ACTIONS, DEFAULT_MAX_RESPONSE_MICROS,
+                      DEFAULT_MAX_USED_HAND_MICROS,
+                      DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000, false, true,
+                      false, true, false, LogPolicy::direct(),
+                      LogPolicy::direct(), NULL, &deals_);
+  }
+
+  const GameDef gameDef_;
+  const std::vector<std::string> players_;
+  const std::string workingDirectory_;
+  const uint32_t seed_;
+  const uint32_t numHands_;
+  /// Dealt once and shared by every permutation
+  const Deals deals_;
+  const std::vector<std::vector<size_t>> permutations_;
+  std::vector<std::string> matchNames_;
+  std::vector<std::string> logFilePaths_;
+};
+}
+}
+}
@@ -23,6 +23,8 @@ extern "C" {
 }
 namespace AcpcMatchLog {
 namespace Acpc {
+class BettingSequenceTrie;
+
 class EncapsulatedMatchState {
 public:
   static const int OMNISCIENT_VIEWER = -2;
@@ -48,7 +50,7 @@ public:
     return handNum() % gameDef().game_->numPlayers;
   }
 
-  int32_t potSize() const {
+  virtual int32_t potSize() const {
     return Acpc::potSize(state_, gameDef_.game_->numPlayers);
   }
   std::string toString() const {
@@ -134,7 +136,9 @@ public:
                         action_);
   }
 
-  uint8_t actor() const { return currentPlayer(gameDef_.game_, &state_); }
+  virtual uint8_t actor() const {
+    return currentPlayer(gameDef_.game_, &state_);
+  }
 
   bool isBeginningOfHand() const { return Acpc::isBeginningOfHand(state_); }
 
@@ -153,6 +157,9 @@ public:
   int viewer(const int newViewer) { return (viewer_ = newViewer); }
 
 protected:
+  /// Advances replay states in place from its cached states
+  friend class BettingSequenceTrie;
+
   int viewer_;
   State state_;
   const GameDef &gameDef_;
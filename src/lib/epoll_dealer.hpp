@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <lib/acpc.hpp>
+
+extern "C" {
+#include <lib/dealer.h>
+#include <game.h>
+#include <net.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+namespace Dealer {
+/**
+ * A dealer that hosts many matches in one thread. It waits on every listen
+ * socket and seat of every match with epoll, reads from seats without
+ * blocking, and advances each match's SteppedMatch one line at a time, so
+ * idle matches cost nothing but their sockets.
+ *
+ * Response and start timeouts are checked every TIMEOUT_CHECK_MILLIS, or
+ * sooner if one was due sooner when they were last checked, so they are
+ * enforced to within that interval. Only running matches are checked.
+ * Seats have the response timeout to send their versions, counted from
+ * when the last of them connected. Messages to players are
+ * written without blocking, and a player whose socket buffer is full
+ * fails its match.
+ */
+class EpollDealer {
+public:
+  static const int MAX_EVENTS = 256;
+  static const int TIMEOUT_CHECK_MILLIS = 100;
+  static const int RUNNING = -1;
+
+  EpollDealer()
+      : epollFD_(epoll_create1(0)), matches_(), running_(),
+        nextCheck_(Clock::now()) {
+    if (epollFD_ < 0) {
+      throw std::runtime_error(std::string("Could not create epoll: ") +
+                               strerror(errno));
+    }
+  }
+  virtual ~EpollDealer() {
+    for (size_t m = 0; m < matches_.size(); ++m) {
+      if (matches_[m]->status == RUNNING) {
+        endMatch(m, EXIT_FAILURE);
+      }
+    }
+    close(epollFD_);
+  }
+
+  /**
+   * Opens a listen socket for each seat of a new match and returns their
+   * ports. The arguments are those of startMatch. The match starts once
+   * every seat has connected and sent its version string.
+   */
+  std::vector<uint16_t>
+  addMatch(const std::string &matchName, const GameDef &gameDef,
+           const std::vector<std::string> &players,
+           const std::string &workingDirectory, uint32_t numHands = 3000,
+           uint32_t seed = 98723209,
+           uint32_t maxInvalidActions = DEFAULT_MAX_INVALID_ACTIONS,
+           uint64_t maxResponseMicros = DEFAULT_MAX_RESPONSE_MICROS,
+           uint64_t maxUsedHandMicros = DEFAULT_MAX_USED_HAND_MICROS,
+           uint64_t maxUsedPerHandMicros = DEFAULT_MAX_USED_PER_HAND_MICROS,
+           // 10 seconds. Set to negative for no timeout
+           int64_t startTimeoutMicros = 10000000,
+           /* players rotate around the table */
+           bool fixedSeats = 0,
+           /* print all messages */
+           bool quiet = 1,
+           /* by default, overwrite preexisting log/transaction files */
+           bool append = 0,
+           /* use log file, don't use transaction file */
+           bool useLogFile = 0, bool useTransactionFile = 0,
+           /* write log files directly, flushing every hand or action */
+           const LogPolicy &logPolicy = LogPolicy::direct(),
+           const LogPolicy &transactionPolicy = LogPolicy::direct(),
+           /* if not NULL, play these cards instead of dealing from seed */
+           const Deals *deals = nullptr) {
+    const Game *game = gameDef.game_;
+    assert(players.size() == game->numPlayers);
+
+    const size_t m = matches_.size();
+    matches_.emplace_back(new Match(matchName, gameDef, players));
+    Match &match = *matches_.back();
+    match.runningIndex = running_.size();
+    running_.push_back(m);
+
+    std::vector<uint16_t> ports(game->numPlayers, 0);
+    for (uint8_t s = 0; s < game->numPlayers; ++s) {
+      match.listenFD[s] = getListenSocket(&ports[s]);
+      if (match.listenFD[s] < 0) {
+        endMatch(m, EXIT_FAILURE);
+        throw std::runtime_error("Could not open a port for seat " +
+                                 std::to_string(s + 1) + " of " + matchName);
+      }
+      watch(match.listenFD[s], key(m, s, true));
+    }
+
+    init_genrand(&match.rng, seed);
+    if (deals) {
+      match.schedule = deals->schedule();
+      match.hasSchedule = true;
+    }
+    initErrorInfo(maxInvalidActions, maxResponseMicros, maxUsedHandMicros,
+                  maxUsedPerHandMicros * numHands, &match.errorInfo);
+    match.errorInfo.latency = match.latency;
+    match.numHands = numHands;
+    match.quiet = quiet;
+    match.fixedSeats = fixedSeats;
+    if (!openMatchFiles(workingDirectory, matchName, append, useLogFile,
+                        useTransactionFile, logPolicy, transactionPolicy,
+                        &match.logFile, &match.transactionFile)) {
+      endMatch(m, EXIT_FAILURE);
+      throw std::runtime_error("Could not open the log files of " +
+                               matchName);
+    }
+    match.checkpointHands = transactionPolicy.checkpointHands;
+    match.startTime = Clock::now();
+    match.startTimeoutMicros = startTimeoutMicros;
+    return ports;
+  }
+
+  size_t numMatches() const { return matches_.size(); }
+  size_t numRunningMatches() const { return running_.size(); }
+  const std::string &matchName(size_t m) const { return matches_[m]->name; }
+
+  /// RUNNING until match @p m ends, then EXIT_SUCCESS or EXIT_FAILURE
+  int status(size_t m) const { return matches_[m]->status; }
+
+  /// Each seat's response times in match @p m so far
+  const LatencyHistogram *latency(size_t m) const {
+    return matches_[m]->latency;
+  }
+
+  /// Serves every match until they have all finished or failed
+  void run() {
+    epoll_event events[MAX_EVENTS];
+    while (!running_.empty()) {
+      const int n =
+          epoll_wait(epollFD_, events, MAX_EVENTS, millisUntilCheck());
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(std::string("epoll_wait failed: ") +
+                                 strerror(errno));
+      }
+      for (int e = 0; e < n; ++e) {
+        const uint64_t k = events[e].data.u64;
+        const size_t m = k >> 16;
+        const uint8_t seat = k & 0xff;
+        if (matches_[m]->status != RUNNING) {
+          continue;
+        }
+        if (k & LISTEN_BIT) {
+          acceptSeat(m, seat);
+        } else {
+          readSeat(m, seat);
+        }
+      }
+      if (Clock::now() >= nextCheck_) {
+        checkTimeouts();
+      }
+    }
+  }
+
+protected:
+  typedef std::chrono::steady_clock Clock;
+
+  static const uint64_t LISTEN_BIT = 1 << 8;
+
+  struct Match {
+    Match(const std::string &name_, const GameDef &gameDef_,
+          const std::vector<std::string> &players)
+        : name(name_), gameDef(gameDef_), seatNames(players), stepped(),
+          rng(), schedule(), hasSchedule(false), errorInfo(), numHands(0),
+          quiet(true), fixedSeats(false), logFile(NULL),
+          transactionFile(NULL), checkpointHands(0), startTime(),
+          startTimeoutMicros(0), numConnected(0), latency(),
+          lineBuffers(players.size()), status(RUNNING), runningIndex(0) {
+      for (size_t s = 0; s < MAX_PLAYERS; ++s) {
+        listenFD[s] = -1;
+        seatFD[s] = -1;
+      }
+    }
+
+    const std::string name;
+    const GameDef gameDef;
+    std::vector<std::string> seatNames;
+    SteppedMatch stepped;
+    rng_state_t rng;
+    /// Points into the Deals passed to addMatch, which must outlive it
+    DealSchedule schedule;
+    bool hasSchedule;
+    ErrorInfo errorInfo;
+    uint32_t numHands;
+    bool quiet;
+    bool fixedSeats;
+    FILE *logFile;
+    FILE *transactionFile;
+    uint32_t checkpointHands;
+    Clock::time_point startTime;
+    int64_t startTimeoutMicros;
+    uint8_t numConnected;
+    int listenFD[MAX_PLAYERS];
+    int seatFD[MAX_PLAYERS];
+    LatencyHistogram latency[MAX_PLAYERS];
+    /// Input from each seat that does not yet end in a new-line
+    std::vector<std::string> lineBuffers;
+    int status;
+    /// Where this is in running_ while it runs
+    size_t runningIndex;
+  };
+
+  static uint64_t key(const size_t m, const uint8_t seat, const bool listen) {
+    return (uint64_t(m) << 16) | (uint64_t(listen) << 8) | seat;
+  }
+
+  void watch(const int fd, const uint64_t k) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = k;
+    if (epoll_ctl(epollFD_, EPOLL_CTL_ADD, fd, &event) < 0) {
+      throw std::runtime_error(std::string("Could not watch socket: ") +
+                               strerror(errno));
+    }
+  }
+
+  void acceptSeat(const size_t m, const uint8_t seat) {
+    Match &match = *matches_[m];
+    const int fd = accept(match.listenFD[seat], NULL, NULL);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      fprintf(stderr, "ERROR: seat %d could not connect\n", seat + 1);
+      endMatch(m, EXIT_FAILURE);
+      return;
+    }
+    close(match.listenFD[seat]);
+    match.listenFD[seat] = -1;
+
+    int v = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&v, sizeof(int));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    match.seatFD[seat] = fd;
+    watch(fd, key(m, seat, false));
+
+    if (++match.numConnected == match.gameDef.game_->numPlayers) {
+      char *seatName[MAX_PLAYERS];
+      for (uint8_t s = 0; s < match.numConnected; ++s) {
+        seatName[s] = const_cast<char *>(match.seatNames[s].c_str());
+      }
+      initSteppedMatch(match.gameDef.game_, seatName, match.numHands,
+                       match.quiet, match.fixedSeats, &match.rng,
+                       match.hasSchedule ? &match.schedule : NULL,
+                       &match.errorInfo, match.seatFD, match.logFile,
+                       match.transactionFile, match.checkpointHands,
+                       &match.stepped);
+      // Lines that arrived before the last seat connected
+      for (uint8_t s = 0; s < match.numConnected; ++s) {
+        if (!processLines(m, s)) {
+          return;
+        }
+      }
+    }
+  }
+
+  void readSeat(const size_t m, const uint8_t seat) {
+    Match &match = *matches_[m];
+    char buffer[READBUF_LEN];
+    while (true) {
+      const ssize_t n = read(match.seatFD[seat], buffer, sizeof(buffer));
+      if (n > 0) {
+        match.lineBuffers[seat].append(buffer, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      // The seat disconnected
+      processLines(m, seat);
+      if (match.status == RUNNING) {
+        fprintf(stderr, "ERROR: could not get action from seat %d\n",
+                seat + 1);
+        endMatch(m, EXIT_FAILURE);
+      }
+      return;
+    }
+    processLines(m, seat);
+  }
+
+  /// Returns false if the match has ended
+  bool processLines(const size_t m, const uint8_t seat) {
+    Match &match = *matches_[m];
+    if (match.numConnected < match.gameDef.game_->numPlayers) {
+      return true;
+    }
+    std::string &lines = match.lineBuffers[seat];
+    size_t start = 0;
+    for (size_t end = lines.find('\n'); end != std::string::npos;
+         end = lines.find('\n', start)) {
+      const std::string line = lines.substr(start, end + 1 - start);
+      start = end + 1;
+      const int r = steppedMatchLine(&match.stepped, seat, line.c_str());
+      if (r != 0) {
+        endMatch(m, r > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        return false;
+      }
+    }
+    lines.erase(0, start);
+    if (lines.size() >= MAX_LINE_LEN) {
+      fprintf(stderr, "ERROR: line from seat %d is too long\n", seat + 1);
+      endMatch(m, EXIT_FAILURE);
+      return false;
+    }
+    return true;
+  }
+
+  int millisUntilCheck() const {
+    const int64_t millis =
+        std::chrono::duration_cast<std::chrono::milliseconds>(nextCheck_ -
+                                                              Clock::now())
+            .count();
+    return int(std::max<int64_t>(
+        0, std::min<int64_t>(millis + 1, TIMEOUT_CHECK_MILLIS)));
+  }
+
+  /// Ends the running matches that have timed out, and schedules the next
+  /// check for when the nearest of the others' deadlines is due
+  void checkTimeouts() {
+    const Clock::time_point now = Clock::now();
+    int64_t nearestMicros = int64_t(TIMEOUT_CHECK_MILLIS) * 1000;
+    // Backwards, since endMatch moves the last running match into the
+    // place of the one that ended
+    for (size_t i = running_.size(); i-- > 0;) {
+      const size_t m = running_[i];
+      Match &match = *matches_[m];
+      if (match.numConnected < match.gameDef.game_->numPlayers) {
+        if (match.startTimeoutMicros < 0) {
+          continue;
+        }
+        const int64_t waited =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                now - match.startTime)
+                .count();
+        if (waited > match.startTimeoutMicros) {
+          fprintf(stderr, "ERROR: timed out waiting for seats of %s to "
+                          "connect\n",
+                  match.name.c_str());
+          endMatch(m, EXIT_FAILURE);
+        } else {
+          nearestMicros =
+              std::min(nearestMicros, match.startTimeoutMicros - waited + 1);
+        }
+        continue;
+      }
+      const int64_t left = steppedMatchMicrosLeft(&match.stepped);
+      if (left == 0) {
+        fprintf(stderr, "ERROR: a seat of %s ran out of time\n",
+                match.name.c_str());
+        endMatch(m, EXIT_FAILURE);
+      } else if (left > 0) {
+        nearestMicros = std::min(nearestMicros, left);
+      }
+    }
+    nextCheck_ = Clock::now() + std::chrono::microseconds(nearestMicros);
+  }
+
+  void endMatch(const size_t m, const int status) {
+    Match &match = *matches_[m];
+    assert(match.status == RUNNING);
+    match.status = status;
+    running_[match.runningIndex] = running_.back();
+    matches_[running_.back()]->runningIndex = match.runningIndex;
+    running_.pop_back();
+
+    for (size_t s = 0; s < MAX_PLAYERS; ++s) {
+      if (match.listenFD[s] >= 0) {
+        close(match.listenFD[s]);
+        match.listenFD[s] = -1;
+      }
+      if (match.seatFD[s] >= 0) {
+        close(match.seatFD[s]);
+        match.seatFD[s] = -1;
+      }
+    }
+    if (match.transactionFile != NULL) {
+      fclose(match.transactionFile);
+      match.transactionFile = NULL;
+    }
+    if (match.logFile != NULL) {
+      fclose(match.logFile);
+      match.logFile = NULL;
+    }
+    std::vector<std::string>().swap(match.lineBuffers);
+  }
+
+  const int epollFD_;
+  std::vector<std::unique_ptr<Match>> matches_;
+  /// Indices of the matches still running, in no particular order
+  std::vector<size_t> running_;
+  /// When timeouts are next checked
+  Clock::time_point nextCheck_;
+};
+}
+}
+}
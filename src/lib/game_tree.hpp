@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/encapsulated_match_state.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * The full betting tree of a limit game, enumerated once into a flat array
+ * of nodes in depth-first order, so every subtree is a contiguous range
+ * starting at its root.
+ */
+class GameTree {
+public:
+  static const size_t ROOT = 0;
+  static const int32_t NO_CHILD = -1;
+  static const size_t DEFAULT_MAX_NUM_NODES = 1 << 24;
+
+  struct Node {
+    int32_t spent[MAX_PLAYERS];
+    int32_t maxSpent;
+    int32_t pot;
+    /// Indexed by ActionType, NO_CHILD if the action is not legal
+    int32_t children[NUM_ACTION_TYPES];
+    /// One past the index of the last node in this node's subtree
+    uint32_t subtreeEnd;
+    uint8_t playerFolded[MAX_PLAYERS];
+    uint8_t round;
+    uint8_t actor;
+    uint8_t finished;
+    uint8_t numLegalActions;
+    /// Legal ActionTypes in ascending order
+    uint8_t legalActions[NUM_ACTION_TYPES];
+
+    bool isTerminal() const { return finished; }
+    int32_t child(const ActionType type) const { return children[type]; }
+  };
+
+  explicit GameTree(const GameDef &gameDef,
+                    size_t maxNumNodes = DEFAULT_MAX_NUM_NODES)
+      : gameDef_(gameDef), nodes_(), numDecisionNodes_(0) {
+    if (gameDef_.game_->bettingType != limitBetting) {
+      throw std::runtime_error(
+          "Only limit game trees can be enumerated, the game is no-limit");
+    }
+    State root;
+    initState(gameDef_.game_, 0, &root);
+    build(root, maxNumNodes);
+    nodes_.shrink_to_fit();
+  }
+  virtual ~GameTree(){};
+
+  const GameDef &gameDef() const { return gameDef_; }
+  size_t size() const { return nodes_.size(); }
+  size_t numDecisionNodes() const { return numDecisionNodes_; }
+  size_t numTerminalNodes() const { return size() - numDecisionNodes(); }
+
+  const Node &node(const size_t nodeIndex) const {
+    assert(nodeIndex < nodes_.size());
+    return nodes_[nodeIndex];
+  }
+  const Node &operator[](const size_t nodeIndex) const {
+    return node(nodeIndex);
+  }
+
+  int32_t child(const size_t nodeIndex, const Action &action) const {
+    return node(nodeIndex).child(action.type);
+  }
+
+  /// The node reached by the betting in @p state
+  size_t find(const State &state) const {
+    size_t nodeIndex = ROOT;
+    for (uint8_t round = 0; round <= state.round; ++round) {
+      for (uint8_t actionIndex = 0; actionIndex < state.numActions[round];
+           ++actionIndex) {
+        const int32_t next =
+            child(nodeIndex, state.action[round][actionIndex]);
+        if (next == NO_CHILD) {
+          throw std::runtime_error(
+              "State \"" + stateToString(state, gameDef_.game_) +
+              "\" is not in the game tree");
+        }
+        nodeIndex = next;
+      }
+    }
+    return nodeIndex;
+  }
+
+protected:
+  size_t build(const State &state, const size_t maxNumNodes) {
+    if (nodes_.size() >= maxNumNodes) {
+      throw std::runtime_error("Game tree has more than " +
+                               std::to_string(maxNumNodes) + " nodes");
+    }
+    const size_t nodeIndex = nodes_.size();
+    nodes_.emplace_back();
+    {
+      Node &n = nodes_.back();
+      memcpy(n.spent, state.spent, sizeof(state.spent));
+      memcpy(n.playerFolded, state.playerFolded, sizeof(state.playerFolded));
+      n.maxSpent = state.maxSpent;
+      n.pot = Acpc::potSize(state, gameDef_.game_->numPlayers);
+      n.round = state.round;
+      n.finished = stateFinished(&state);
+      n.actor = n.finished ? 0 : currentPlayer(gameDef_.game_, &state);
+      n.numLegalActions = 0;
+      for (int a = 0; a < NUM_ACTION_TYPES; ++a) {
+        n.children[a] = NO_CHILD;
+      }
+    }
+    if (stateFinished(&state)) {
+      nodes_[nodeIndex].subtreeEnd = nodes_.size();
+      return nodeIndex;
+    }
+    ++numDecisionNodes_;
+
+    for (int a = 0; a < NUM_ACTION_TYPES; ++a) {
+      Action action{static_cast<ActionType>(a), 0};
+      if (!isValidAction(gameDef_.game_, &state, 0, &action)) {
+        continue;
+      }
+      State next(state);
+      doAction(gameDef_.game_, &action, &next);
+      const size_t childIndex = build(next, maxNumNodes);
+
+      // The recursive call may have moved the nodes
+      Node &n = nodes_[nodeIndex];
+      n.children[a] = childIndex;
+      n.legalActions[n.numLegalActions] = a;
+      ++n.numLegalActions;
+    }
+    nodes_[nodeIndex].subtreeEnd = nodes_.size();
+    return nodeIndex;
+  }
+
+  const GameDef &gameDef_;
+  std::vector<Node> nodes_;
+  size_t numDecisionNodes_;
+};
+
+/**
+ * A match state that follows its position in a GameTree, so that the actor,
+ * pot size, and the effect of actions are table lookups rather than
+ * calls into the game rules.
+ */
+class GameTreeMatchState : public EncapsulatedMatchState {
+public:
+  explicit GameTreeMatchState(const State &state, const GameTree &tree,
+                              int viewer = OUTSIDE_OBSERVER_VIEWER)
+      : EncapsulatedMatchState(state, tree.gameDef(), viewer), tree_(tree),
+        nodeIndex_(tree.find(state)){};
+  explicit GameTreeMatchState(const EncapsulatedMatchState &ms,
+                              const GameTree &tree)
+      : GameTreeMatchState(ms.state(), tree, ms.viewer()){};
+  virtual ~GameTreeMatchState(){};
+
+  size_t nodeIndex() const { return nodeIndex_; }
+  const GameTree::Node &node() const { return tree_.node(nodeIndex_); }
+  const GameTree &tree() const { return tree_; }
+
+  virtual uint8_t actor() const { return node().actor; }
+
+  virtual int32_t potSize() const { return node().pot; }
+
+  virtual GameTreeMatchState &applyAction(const Action &action) {
+    const int32_t next = tree_.child(nodeIndex_, action);
+    assert(next != GameTree::NO_CHILD);
+
+    const uint8_t round = state_.round;
+    const uint8_t actionIndex = state_.numActions[round];
+    state_.action[round][actionIndex] = action;
+    state_.actingPlayer[round][actionIndex] = node().actor;
+    ++state_.numActions[round];
+
+    nodeIndex_ = next;
+    const GameTree::Node &n = node();
+    state_.round = n.round;
+    state_.finished = n.finished;
+    state_.maxSpent = n.maxSpent;
+    memcpy(state_.spent, n.spent, sizeof(n.spent));
+    memcpy(state_.playerFolded, n.playerFolded, sizeof(n.playerFolded));
+    return (*this);
+  }
+
+  /**
+   * Yields every time a player is about to act, starting at the
+   * beginning of the hand.
+   */
+  void replay(std::function<bool(const GameTreeMatchState &, const Action &)>
+                  doOnState) const {
+    State s;
+    initState(gameDef_.game_, state_.handId, &s);
+    memcpy(s.holeCards, state_.holeCards, sizeof(state_.holeCards));
+    memcpy(s.boardCards, state_.boardCards, sizeof(state_.boardCards));
+    GameTreeMatchState replayState(s, tree_, viewer_);
+
+    for (uint8_t replayRound = 0; replayRound <= roundIndex(); ++replayRound) {
+      for (uint8_t actionIndex = 0; actionIndex < numActions(replayRound);
+           ++actionIndex) {
+        const Action &action_ = action(replayRound, actionIndex);
+        if (doOnState(replayState, action_)) {
+          return;
+        }
+
+        replayState.applyAction(action_);
+      }
+    }
+    return;
+  }
+
+protected:
+  const GameTree &tree_;
+  size_t nodeIndex_;
+};
+}
+}
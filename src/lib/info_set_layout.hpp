@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/game_tree.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * Flat layout of per-action values, like regrets or strategies, for every
+ * information set of a GameTree.
+ *
+ * An information set is a decision node together with the acting player's
+ * view of the cards: their hole cards and the board cards dealt so far.
+ * Each decision node owns a contiguous block holding one row per card view,
+ * and each row holds one value per legal action of the node, in the order of
+ * GameTree::Node::legalActions. A strategy is a std::vector<double> of size()
+ * values in this layout, where each row sums to one.
+ */
+class InfoSetLayout {
+public:
+  static const size_t NO_OFFSET = SIZE_MAX;
+  static const size_t DEFAULT_MAX_SIZE = size_t(1) << 28;
+
+  explicit InfoSetLayout(const GameTree &tree,
+                         size_t maxSize = DEFAULT_MAX_SIZE)
+      : tree_(tree), offsets_(tree.size(), size_t(NO_OFFSET)),
+        firstInfoSets_(tree.size(), size_t(NO_OFFSET)),
+        numCardViews_(tree.size(), 0), size_(0), numInfoSets_(0) {
+    const Game *game = tree_.gameDef().game_;
+    const size_t numCards = tree_.gameDef().numCards();
+    for (size_t n = 0; n < tree_.size(); ++n) {
+      const GameTree::Node &node = tree_[n];
+      if (node.isTerminal()) {
+        continue;
+      }
+      size_t numViews = 1;
+      const size_t numVisibleCards =
+          game->numHoleCards + sumBoardCards(game, node.round);
+      for (size_t c = 0; c < numVisibleCards; ++c) {
+        numViews *= numCards;
+        if (numViews * node.numLegalActions + size_ > maxSize) {
+          throw std::runtime_error("Information set layout has more than " +
+                                   std::to_string(maxSize) + " values");
+        }
+      }
+      offsets_[n] = size_;
+      firstInfoSets_[n] = numInfoSets_;
+      numCardViews_[n] = numViews;
+      size_ += numViews * node.numLegalActions;
+      numInfoSets_ += numViews;
+    }
+  }
+  virtual ~InfoSetLayout(){};
+
+  const GameTree &tree() const { return tree_; }
+  const GameDef &gameDef() const { return tree_.gameDef(); }
+
+  /// Number of values in the layout
+  size_t size() const { return size_; }
+  size_t numInfoSets() const { return numInfoSets_; }
+
+  size_t numCardViews(const size_t nodeIndex) const {
+    return numCardViews_[nodeIndex];
+  }
+  size_t numActions(const size_t nodeIndex) const {
+    return tree_[nodeIndex].numLegalActions;
+  }
+
+  /// Offset of the first value of @p nodeIndex's block
+  size_t offset(const size_t nodeIndex) const { return offsets_[nodeIndex]; }
+
+  /// Offset of the first value of an information set's row
+  size_t offset(const size_t nodeIndex, const size_t cardView) const {
+    assert(offsets_[nodeIndex] != NO_OFFSET);
+    assert(cardView < numCardViews_[nodeIndex]);
+    return offsets_[nodeIndex] + cardView * numActions(nodeIndex);
+  }
+
+  /// Index of an information set counting from 0, in layout order
+  size_t infoSetIndex(const size_t nodeIndex, const size_t cardView) const {
+    assert(firstInfoSets_[nodeIndex] != NO_OFFSET);
+    assert(cardView < numCardViews_[nodeIndex]);
+    return firstInfoSets_[nodeIndex] + cardView;
+  }
+
+  /**
+   * The acting player's view of the cards in @p cards at @p nodeIndex, as
+   * a mixed radix number of card indices.
+   */
+  size_t cardView(const size_t nodeIndex, const State &cards) const {
+    const GameTree::Node &node = tree_[nodeIndex];
+    return cardView(cards, node.actor, node.round);
+  }
+
+  /// @p player's view of the cards in @p cards during @p round
+  size_t cardView(const State &cards, const uint8_t player,
+                  const uint8_t round) const {
+    const Game *game = gameDef().game_;
+    const size_t numCards = gameDef().numCards();
+
+    size_t view = 0;
+    for (uint8_t c = 0; c < game->numHoleCards; ++c) {
+      view = view * numCards + gameDef().cardIndex(cards.holeCards[player][c]);
+    }
+    for (uint8_t c = 0; c < sumBoardCards(game, round); ++c) {
+      view = view * numCards + gameDef().cardIndex(cards.boardCards[c]);
+    }
+    return view;
+  }
+
+  /// Index of the legal action slot of @p type at @p nodeIndex
+  size_t actionSlot(const size_t nodeIndex, const ActionType type) const {
+    const GameTree::Node &node = tree_[nodeIndex];
+    for (uint8_t a = 0; a < node.numLegalActions; ++a) {
+      if (node.legalActions[a] == type) {
+        return a;
+      }
+    }
+    assert(false);
+    return 0;
+  }
+
+  std::vector<double> uniformStrategy() const {
+    std::vector<double> strategy(size_, 0.0);
+    normalize(strategy);
+    return strategy;
+  }
+
+  /**
+   * Scales every information set's row of @p values in place to sum to one.
+   * Rows that do not sum to a positive value become uniform.
+   */
+  void normalize(std::vector<double> &values) const {
+    assert(values.size() == size_);
+    for (size_t n = 0; n < tree_.size(); ++n) {
+      if (offsets_[n] != NO_OFFSET) {
+        Acpc::normalize(&values[offsets_[n]], numCardViews_[n],
+                        numActions(n));
+      }
+    }
+  }
+
+protected:
+  const GameTree &tree_;
+  std::vector<size_t> offsets_;
+  std::vector<size_t> firstInfoSets_;
+  std::vector<size_t> numCardViews_;
+  size_t size_;
+  size_t numInfoSets_;
+};
+}
+}
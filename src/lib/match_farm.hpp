@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lib/acpc.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+namespace Dealer {
+/// Everything needed to run one match with playMatch
+struct MatchSpec {
+  std::string matchName;
+  const GameDef *gameDef;
+  /// In seat order. Each match should have its own agents unless they are
+  /// safe to call from several threads.
+  std::vector<Agent> agents;
+  uint32_t numHands;
+  uint32_t seed;
+  std::string workingDirectory;
+  bool fixedSeats;
+  bool useLogFile;
+  bool useTransactionFile;
+  LogPolicy logPolicy = LogPolicy::direct();
+  LogPolicy transactionPolicy = LogPolicy::direct();
+  /// If set, the cards to play instead of dealing from seed. Specs may
+  /// share Deals, which must outlive the farm's run.
+  const Deals *deals = nullptr;
+};
+
+struct MatchResult {
+  std::string matchName;
+  /// EXIT_SUCCESS or EXIT_FAILURE, as returned by playMatch
+  int status;
+  /// Empty unless an agent threw an exception
+  std::string error;
+  double seconds;
+  /// Each seat's response times
+  std::vector<LatencyHistogram> latency;
+
+  bool succeeded() const { return status == EXIT_SUCCESS && error.empty(); }
+};
+
+struct FarmReport {
+  /// In the same order as the specs
+  std::vector<MatchResult> results;
+  uint64_t numHands;
+  double seconds;
+
+  double handsPerSecond() const { return seconds > 0 ? numHands / seconds : 0; }
+  size_t numFailures() const {
+    return std::count_if(results.begin(), results.end(),
+                         [](const MatchResult &r) { return !r.succeeded(); });
+  }
+};
+
+/**
+ * Runs many matches concurrently in this process. Threads take the next
+ * unstarted spec from a shared counter, so long and short matches balance
+ * out across threads. Every match deals from its own generator seeded with
+ * its spec's seed and writes its own log files, so the results do not
+ * depend on the number of threads.
+ */
+class MatchFarm {
+public:
+  explicit MatchFarm(size_t numThreads = defaultNumThreads())
+      : numThreads_(numThreads) {
+    assert(numThreads_ > 0);
+  }
+  virtual ~MatchFarm(){};
+
+  FarmReport run(const std::vector<MatchSpec> &specs) const {
+    FarmReport report{std::vector<MatchResult>(specs.size()), 0, 0.0};
+    std::atomic<size_t> nextSpec(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < std::min(numThreads_, specs.size()); ++t) {
+      threads.emplace_back([&specs, &report, &nextSpec]() {
+        for (size_t i = nextSpec++; i < specs.size(); i = nextSpec++) {
+          report.results[i] = runMatch(specs[i]);
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    report.seconds = secondsSince(start);
+
+    for (size_t i = 0; i < specs.size(); ++i) {
+      if (report.results[i].succeeded()) {
+        report.numHands += specs[i].numHands;
+      }
+    }
+    return report;
+  }
+
+  static MatchResult runMatch(const MatchSpec &spec) {
+    assert(spec.gameDef);
+    MatchResult result{spec.matchName, EXIT_FAILURE, "", 0.0,
+                       std::vector<LatencyHistogram>(MAX_PLAYERS)};
+    const auto start = std::chrono::steady_clock::now();
+    try {
+      result.status =
+          playMatch(spec.matchName, *spec.gameDef, spec.agents,
+                    spec.workingDirectory, spec.numHands, spec.seed,
+                    DEFAULT_MAX_INVALID_ACTIONS, DEFAULT_MAX_RESPONSE_MICROS,
+                    DEFAULT_MAX_USED_HAND_MICROS,
+                    DEFAULT_MAX_USED_PER_HAND_MICROS, spec.fixedSeats, true,
+                    false, spec.useLogFile, spec.useTransactionFile,
+                    spec.logPolicy, spec.transactionPolicy,
+                    result.latency.data(), spec.deals);
+    } catch (const std::exception &e) {
+      result.error = e.what();
+    } catch (...) {
+      result.error = "unknown exception";
+    }
+    result.seconds = secondsSince(start);
+    return result;
+  }
+
+  static size_t defaultNumThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  static double
+  secondsSince(const std::chrono::steady_clock::time_point &start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  }
+
+  const size_t numThreads_;
+};
+}
+}
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <game.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * Reads the dealer's state messages straight from a socket into one
+ * buffer, and frames each line where it was read instead of copying it out.
+ *
+ * Each line is parsed lazily. The hand id and viewing player are decoded
+ * first, and only the actions that are new since the last line of the same
+ * hand are applied to the state, which is enough to tell whether the hand
+ * is over and whose turn it is. The whole line, cards included, is only
+ * parsed by parse, which an agent only needs when it acts or a hand ends.
+ */
+class MatchStateReader {
+public:
+  /// Reads states of @p game into @p state, which must outlive the reader
+  MatchStateReader(const Game *game, MatchState *state)
+      : game_(game), state_(state), begin_(0), lineEnd_(0), next_(0), end_(0),
+        handStarted_(false), parsedBettingLen_(0),
+        fullyParsed_(false) {}
+
+  /**
+   * Frames the next state from @p fd, reading more if the buffer does not
+   * hold a whole line, and brings the betting of the state up to date.
+   * Comments are skipped. Returns the length of the line, 0 once @p fd has
+   * no more input, or -1 if the line is too long, is not a state, or has
+   * betting the game does not allow.
+   */
+  int next(int fd) {
+    while (true) {
+      const int len = frameLine(fd);
+      if (len <= 0) {
+        return len;
+      }
+      if (line()[0] == '#' || line()[0] == ';') {
+        continue;
+      }
+      return decode() ? len : -1;
+    }
+  }
+
+  /// The current line, without its new-line, terminated where it was read
+  const char *line() const { return &buffer_[begin_]; }
+
+  uint32_t handId() const { return state_->state.handId; }
+  uint8_t viewingPlayer() const { return state_->viewingPlayer; }
+  bool handFinished() const { return stateFinished(&state_->state); }
+  bool mustAct() const {
+    return !handFinished() &&
+           currentPlayer(game_, &state_->state) == state_->viewingPlayer;
+  }
+
+  /**
+   * Parses the whole current line into the state, cards included, unless
+   * it already has been. Returns false if it can't be parsed.
+   */
+  bool parse() {
+    if (!fullyParsed_) {
+      if (readMatchState(line(), game_, state_) < 0) {
+        return false;
+      }
+      fullyParsed_ = true;
+    }
+    return true;
+  }
+
+  /**
+   * Sends @p action in response to the current line, which is written from
+   * where it was read along with the action. Returns false on failure.
+   */
+  bool respond(int fd, const Action &action) const {
+    char printed[MAX_LINE_LEN];
+    printed[0] = ':';
+    const int r = printAction(game_, &action, MAX_LINE_LEN - 3, &printed[1]);
+    if (r < 0) {
+      return false;
+    }
+    printed[r + 1] = '\r';
+    printed[r + 2] = '\n';
+    struct iovec message[2];
+    message[0].iov_base = const_cast<char *>(line());
+    message[0].iov_len = lineEnd_ - begin_;
+    message[1].iov_base = printed;
+    message[1].iov_len = r + 3;
+    const ssize_t total = message[0].iov_len + message[1].iov_len;
+    ssize_t n;
+    do {
+      n = writev(fd, message, 2);
+    } while (n < 0 && errno == EINTR);
+    return n == total;
+  }
+
+protected:
+  static const size_t BUFFER_LEN = 4 * MAX_LINE_LEN;
+
+  /// Returns the length of the next line, 0 at the end of input, -1 if it
+  /// is too long
+  int frameLine(int fd) {
+    size_t scanned = next_;
+    while (true) {
+      char *newLine = static_cast<char *>(
+          memchr(&buffer_[scanned], '\n', end_ - scanned));
+      if (newLine) {
+        begin_ = next_;
+        lineEnd_ = newLine - buffer_;
+        next_ = lineEnd_ + 1;
+        if (lineEnd_ > begin_ && buffer_[lineEnd_ - 1] == '\r') {
+          --lineEnd_;
+        }
+        buffer_[lineEnd_] = '\0';
+        if (lineEnd_ == begin_) {
+          scanned = next_;
+          continue;
+        }
+        return lineEnd_ - begin_;
+      }
+      scanned = end_;
+      if (end_ - next_ >= MAX_LINE_LEN) {
+        clear();
+        return -1;
+      }
+
+      // Only part of a line is left, so it is moved to the front once the
+      // buffer runs out
+      if (end_ == BUFFER_LEN) {
+        memmove(buffer_, &buffer_[next_], end_ - next_);
+        end_ -= next_;
+        scanned -= next_;
+        next_ = 0;
+      }
+      ssize_t n;
+      do {
+        n = read(fd, &buffer_[end_], BUFFER_LEN - end_);
+      } while (n < 0 && errno == EINTR);
+      if (n <= 0) {
+        clear();
+        return 0;
+      }
+      end_ += n;
+    }
+  }
+
+  /// Drops all input, leaving an empty line
+  void clear() {
+    begin_ = lineEnd_ = next_ = end_ = 0;
+    buffer_[0] = '\0';
+  }
+
+  /// Decodes the hand id and viewing player, and applies the new actions
+  /// if each is valid
+  bool decode() {
+    static const char PREFIX[] = "MATCHSTATE:";
+    const char *string = line();
+    if (strncmp(string, PREFIX, sizeof(PREFIX) - 1) != 0) {
+      return false;
+    }
+    char *end;
+    const unsigned long viewingPlayer =
+        strtoul(&string[sizeof(PREFIX) - 1], &end, 10);
+    if (*end != ':' || viewingPlayer >= game_->numPlayers) {
+      return false;
+    }
+    const unsigned long handId = strtoul(end + 1, &end, 10);
+    if (*end != ':') {
+      return false;
+    }
+    const char *betting = end + 1;
+    const char *bettingEnd = strchr(betting, ':');
+    if (!bettingEnd) {
+      return false;
+    }
+    const size_t bettingLen = bettingEnd - betting;
+
+    // Each state of a hand extends the betting of the one before it
+    if (!handStarted_ || handId != state_->state.handId ||
+        bettingLen < parsedBettingLen_) {
+      initState(game_, handId, &state_->state);
+      parsedBettingLen_ = 0;
+      handStarted_ = true;
+    }
+    state_->viewingPlayer = viewingPlayer;
+    size_t c = parsedBettingLen_;
+    while (c < bettingLen) {
+      if (betting[c] == '/') {
+        ++c;
+        continue;
+      }
+      Action action;
+      const int r = readAction(&betting[c], game_, &action);
+      if (r <= 0 || !isValidAction(game_, &state_->state, 0, &action)) {
+        handStarted_ = false;
+        return false;
+      }
+      doAction(game_, &action, &state_->state);
+      c += r;
+    }
+    parsedBettingLen_ = bettingLen;
+    fullyParsed_ = false;
+    return true;
+  }
+
+  const Game *game_;
+  MatchState *state_;
+  char buffer_[BUFFER_LEN];
+  /// The current line is [begin_, lineEnd_). Input from next_ to end_ has
+  /// not been framed yet
+  size_t begin_;
+  size_t lineEnd_;
+  size_t next_;
+  size_t end_;
+  bool handStarted_;
+  size_t parsedBettingLen_;
+  bool fullyParsed_;
+};
+}
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <lib/acpc.hpp>
+#include <lib/game_tree.hpp>
+#include <lib/info_set_layout.hpp>
+#include <lib/random.hpp>
+
+extern "C" {
+#include <game.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * Multi-threaded outcome sampling Monte Carlo counterfactual regret
+ * minimization (MCCFR) over the game tree of any limit GameDef.
+ *
+ * Regrets and average strategy sums live in flat tables laid out by an
+ * InfoSetLayout. Threads update them hogwild style: with relaxed atomic
+ * loads and stores but no locks, so concurrent updates to the same value
+ * are occasionally lost. Each thread samples from its own random number
+ * stream of one Xoshiro256StarStar generator, so the samples each thread
+ * draws are reproducible from the seed, and a single threaded run is
+ * reproducible exactly.
+ */
+class OutcomeSamplingMccfr {
+public:
+  explicit OutcomeSamplingMccfr(const InfoSetLayout &layout,
+                                uint32_t seed = randomRandomSeed(),
+                                double exploration = 0.6)
+      : layout_(layout), seed_(seed), exploration_(exploration),
+        regrets_(new std::atomic<double>[layout.size()]()),
+        averageStrategySums_(new std::atomic<double>[layout.size()]()),
+        lastVisits_(new std::atomic<uint64_t>[layout.numInfoSets()]()),
+        numIterations_(0), numRuns_(0) {}
+  virtual ~OutcomeSamplingMccfr(){};
+
+  const InfoSetLayout &layout() const { return layout_; }
+  uint64_t numIterations() const { return numIterations_.load(); }
+
+  /**
+   * Runs @p numIterations more iterations, split across @p numThreads
+   * threads. Each iteration samples one deal and one trajectory per player.
+   */
+  void run(uint64_t numIterations, size_t numThreads = defaultNumThreads()) {
+    assert(numThreads > 0);
+    const uint32_t runIndex = numRuns_++;
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+      const uint64_t threadIterations =
+          numIterations / numThreads + (t < numIterations % numThreads);
+      threads.emplace_back([this, t, runIndex, threadIterations]() {
+        Worker worker(layout_.gameDef(), seed_, runIndex, t);
+        for (uint64_t i = 0; i < threadIterations; ++i) {
+          iterate(worker);
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+  /// The average strategy, which converges to an equilibrium in two player
+  /// zero-sum games
+  std::vector<double> averageStrategy() const {
+    std::vector<double> strategy(load(averageStrategySums_.get()));
+    layout_.normalize(strategy);
+    return strategy;
+  }
+
+  /// The regret matching strategy of the current regrets
+  std::vector<double> currentStrategy() const {
+    const std::vector<double> regrets(load(regrets_.get()));
+    std::vector<double> strategy(layout_.size());
+    const GameTree &tree = layout_.tree();
+    for (size_t n = 0; n < tree.size(); ++n) {
+      if (!tree[n].isTerminal()) {
+        regretMatching(&regrets[layout_.offset(n)], layout_.numCardViews(n),
+                       layout_.numActions(n), &strategy[layout_.offset(n)]);
+      }
+    }
+    return strategy;
+  }
+
+  std::vector<double> regrets() const { return load(regrets_.get()); }
+
+  static size_t defaultNumThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  struct Worker {
+    Worker(const GameDef &gameDef, uint32_t seed, uint32_t runIndex,
+           size_t threadIndex)
+        : rng(Xoshiro256StarStar((uint64_t(runIndex) << 32) | seed)
+                  .stream(threadIndex)),
+          deck(gameDef.numCards()), state() {
+      for (size_t c = 0; c < deck.size(); ++c) {
+        deck[c] = gameDef.card(c);
+      }
+      initState(gameDef.game_, 0, &state);
+    }
+
+    Xoshiro256StarStar rng;
+    std::vector<uint8_t> deck;
+    /// Holds the sampled cards, and the betting of the current terminal
+    State state;
+  };
+
+  /// Sampled utility divided by the sampling probability, and the
+  /// probability of reaching the terminal from the current node
+  typedef std::pair<double, double> SampledValue;
+
+  void iterate(Worker &worker) {
+    const uint64_t t = ++numIterations_;
+    deal(worker);
+    for (uint8_t p = 0; p < layout_.gameDef().game_->numPlayers; ++p) {
+      sample(GameTree::ROOT, p, 1.0, 1.0, 1.0, t, worker);
+    }
+  }
+
+  void deal(Worker &worker) const {
+    const Game *game = layout_.gameDef().game_;
+    size_t c = 0;
+    auto nextCard = [&worker, &c]() {
+      const size_t pick = c + worker.rng.uniformInt(worker.deck.size() - c);
+      std::swap(worker.deck[c], worker.deck[pick]);
+      return worker.deck[c++];
+    };
+    for (uint8_t p = 0; p < game->numPlayers; ++p) {
+      for (uint8_t h = 0; h < game->numHoleCards; ++h) {
+        worker.state.holeCards[p][h] = nextCard();
+      }
+    }
+    for (uint8_t b = 0; b < sumBoardCards(game, game->numRounds - 1); ++b) {
+      worker.state.boardCards[b] = nextCard();
+    }
+  }
+
+  SampledValue sample(const size_t nodeIndex, const uint8_t traverser,
+                      const double myReach, const double othersReach,
+                      const double sampleProb, const uint64_t t,
+                      Worker &worker) {
+    const GameTree::Node &node = layout_.tree()[nodeIndex];
+    if (node.isTerminal()) {
+      return SampledValue(utility(node, traverser, worker) / sampleProb, 1.0);
+    }
+
+    const size_t numActions = node.numLegalActions;
+    const size_t cardView = layout_.cardView(nodeIndex, worker.state);
+    const size_t row = layout_.offset(nodeIndex, cardView);
+
+    double strategy[NUM_ACTION_TYPES];
+    {
+      double regrets[NUM_ACTION_TYPES];
+      for (size_t a = 0; a < numActions; ++a) {
+        regrets[a] = regrets_[row + a].load(std::memory_order_relaxed);
+      }
+      regretMatching(regrets, numActions, strategy);
+    }
+
+    const bool traversersTurn = node.actor == traverser;
+    double samplingProbs[NUM_ACTION_TYPES];
+    for (size_t a = 0; a < numActions; ++a) {
+      samplingProbs[a] = traversersTurn
+                             ? exploration_ / numActions +
+                                   (1.0 - exploration_) * strategy[a]
+                             : strategy[a];
+    }
+    const size_t sampledA = sampleAction(samplingProbs, numActions, worker);
+    const size_t child = node.children[node.legalActions[sampledA]];
+
+    if (!traversersTurn) {
+      const SampledValue v =
+          sample(child, traverser, myReach, othersReach * strategy[sampledA],
+                 sampleProb * samplingProbs[sampledA], t, worker);
+      return SampledValue(v.first, v.second * strategy[sampledA]);
+    }
+
+    const SampledValue v =
+        sample(child, traverser, myReach * strategy[sampledA], othersReach,
+               sampleProb * samplingProbs[sampledA], t, worker);
+
+    const double infoSetW = v.first * othersReach * v.second;
+    for (size_t a = 0; a < numActions; ++a) {
+      add(regrets_[row + a],
+          sampledImmediateCfr(infoSetW, strategy[sampledA], a == sampledA));
+    }
+
+    // Optimistic averaging: credit the iterations since the last visit.
+    // Only the thread that moves the last visit forward is credited, so a
+    // thread whose iteration is older than the last visit adds nothing
+    // and the credits never add up to more than the iterations run
+    std::atomic<uint64_t> &lastVisit =
+        lastVisits_[layout_.infoSetIndex(nodeIndex, cardView)];
+    uint64_t last = lastVisit.load(std::memory_order_relaxed);
+    while (last < t && !lastVisit.compare_exchange_weak(
+                           last, t, std::memory_order_relaxed)) {
+    }
+    const double weight = last < t ? double(t - last) * myReach : 0.0;
+    for (size_t a = 0; a < numActions; ++a) {
+      add(averageStrategySums_[row + a], weight * strategy[a]);
+    }
+
+    return SampledValue(v.first, v.second * strategy[sampledA]);
+  }
+
+  double utility(const GameTree::Node &terminal, const uint8_t player,
+                 Worker &worker) const {
+    State &s = worker.state;
+    s.round = terminal.round;
+    s.finished = terminal.finished;
+    s.maxSpent = terminal.maxSpent;
+    memcpy(s.spent, terminal.spent, sizeof(terminal.spent));
+    memcpy(s.playerFolded, terminal.playerFolded,
+           sizeof(terminal.playerFolded));
+    return valueOfState(layout_.gameDef().game_, &s, player);
+  }
+
+  static size_t sampleAction(const double *probs, const size_t numActions,
+                             Worker &worker) {
+    double r = worker.rng.uniform();
+    for (size_t a = 0; a + 1 < numActions; ++a) {
+      r -= probs[a];
+      if (r < 0.0) {
+        return a;
+      }
+    }
+    return numActions - 1;
+  }
+
+  static void add(std::atomic<double> &value, const double increment) {
+    value.store(value.load(std::memory_order_relaxed) + increment,
+                std::memory_order_relaxed);
+  }
+
+  std::vector<double> load(const std::atomic<double> *values) const {
+    std::vector<double> loaded(layout_.size());
+    for (size_t i = 0; i < loaded.size(); ++i) {
+      loaded[i] = values[i].load(std::memory_order_relaxed);
+    }
+    return loaded;
+  }
+
+  const InfoSetLayout &layout_;
+  const uint32_t seed_;
+  const double exploration_;
+  std::unique_ptr<std::atomic<double>[]> regrets_;
+  std::unique_ptr<std::atomic<double>[]> averageStrategySums_;
+  std::unique_ptr<std::atomic<uint64_t>[]> lastVisits_;
+  std::atomic<uint64_t> numIterations_;
+  std::atomic<uint32_t> numRuns_;
+};
+}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * The xoshiro256** generator by Blackman and Vigna
+ * (http://prng.di.unimi.it/). Much faster than std::mt19937 with a 256 bit
+ * state, and jump() skips ahead 2^128 draws, so stream(i) gives each thread
+ * its own non-overlapping sequence from one seed.
+ *
+ * Satisfies UniformRandomBitGenerator, so it also works with the standard
+ * distributions.
+ */
+class Xoshiro256StarStar {
+public:
+  typedef uint64_t result_type;
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  /// Fills the state from @p seed with splitmix64, as the authors recommend
+  explicit Xoshiro256StarStar(uint64_t seed = 0) : s_() {
+    for (size_t i = 0; i < 4; ++i) {
+      seed += 0x9e3779b97f4a7c15;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      s_[i] = z ^ (z >> 31);
+    }
+  }
+  Xoshiro256StarStar(uint64_t s0, uint64_t s1, uint64_t s2, uint64_t s3)
+      : s_{s0, s1, s2, s3} {
+    assert(s0 || s1 || s2 || s3);
+  }
+
+  result_type operator()() {
+    const uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    const uint64_t t = s_[1] << 17;
+
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+
+    return result;
+  }
+
+  /// Equivalent to 2^128 calls to operator()
+  void jump() {
+    static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                    0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < 4; ++i) {
+      for (size_t b = 0; b < 64; ++b) {
+        if (JUMP[i] & (uint64_t(1) << b)) {
+          for (size_t j = 0; j < 4; ++j) {
+            s[j] ^= s_[j];
+          }
+        }
+        (*this)();
+      }
+    }
+    for (size_t j = 0; j < 4; ++j) {
+      s_[j] = s[j];
+    }
+  }
+
+  /// A copy of this generator @p streamIndex jumps ahead
+  Xoshiro256StarStar stream(const size_t streamIndex) const {
+    Xoshiro256StarStar copy(*this);
+    for (size_t i = 0; i < streamIndex; ++i) {
+      copy.jump();
+    }
+    return copy;
+  }
+
+  /// Uniform on [0, 1) with 53 random bits
+  double uniform() {
+    return ((*this)() >> 11) * (1.0 / 9007199254740992.0); // 2^-53
+  }
+
+  /// Uniform integer on [0, @p bound), by Lemire's multiply and shift
+  /// method, without modulo bias
+  uint64_t uniformInt(const uint64_t bound) {
+    assert(bound > 0);
+    unsigned __int128 m = static_cast<unsigned __int128>((*this)()) * bound;
+    uint64_t low = static_cast<uint64_t>(m);
+    if (low < bound) {
+      const uint64_t threshold = -bound % bound;
+      while (low < threshold) {
+        m = static_cast<unsigned __int128>((*this)()) * bound;
+        low = static_cast<uint64_t>(m);
+      }
+    }
+    return static_cast<uint64_t>(m >> 64);
+  }
+
+  bool flipCoin(const double probTrue) { return uniform() < probTrue; }
+
+  void fillUniform(double *dest, const size_t n) {
+    assert(dest);
+    for (size_t i = 0; i < n; ++i) {
+      dest[i] = uniform();
+    }
+  }
+
+  template <class Bool>
+  void fillBernoulli(const double probTrue, Bool *dest, const size_t n) {
+    assert(dest);
+    for (size_t i = 0; i < n; ++i) {
+      dest[i] = uniform() < probTrue;
+    }
+  }
+
+private:
+  static constexpr uint64_t rotl(const uint64_t x, const int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t s_[4];
+};
+}
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <game.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/**
+ * A lock-free ring of @p NUM_SLOTS records from one producer to one
+ * consumer, which may be in different processes if the ring is in shared
+ * memory. A side that has to wait spins briefly, then sleeps on a futex
+ * until the other side wakes it.
+ */
+template <typename T, uint32_t NUM_SLOTS> class SpscRing {
+public:
+  static_assert((NUM_SLOTS & (NUM_SLOTS - 1)) == 0,
+                "NUM_SLOTS must be a power of two");
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int) &&
+                    ATOMIC_INT_LOCK_FREE == 2,
+                "futexes need plain 32 bit atomics");
+
+  SpscRing() : head_(0), headWaiters_(0), tail_(0), tailWaiters_(0) {}
+
+  /**
+   * Adds @p record, waiting up to @p timeoutMicros for a free slot if the
+   * ring is full, or forever if it is negative. Returns false on timeout.
+   */
+  bool push(const T &record, int64_t timeoutMicros = -1) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (!waitUntil(tail_, tailWaiters_,
+                   [head](uint32_t tail) { return head - tail < NUM_SLOTS; },
+                   timeoutMicros)) {
+      return false;
+    }
+    slots_[head & (NUM_SLOTS - 1)] = record;
+    head_.store(head + 1, std::memory_order_seq_cst);
+    wake(head_, headWaiters_);
+    return true;
+  }
+
+  /**
+   * Takes the oldest record into @p record, waiting up to @p timeoutMicros
+   * for one if the ring is empty, or forever if it is negative. Returns
+   * false on timeout.
+   */
+  bool pop(T &record, int64_t timeoutMicros = -1) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (!waitUntil(head_, headWaiters_,
+                   [tail](uint32_t head) { return head != tail; },
+                   timeoutMicros)) {
+      return false;
+    }
+    record = slots_[tail & (NUM_SLOTS - 1)];
+    tail_.store(tail + 1, std::memory_order_seq_cst);
+    wake(tail_, tailWaiters_);
+    return true;
+  }
+
+protected:
+  static const int NUM_SPINS = 4096;
+
+  /// Waits until @p ready is true of the other side's counter @p word
+  template <typename Ready>
+  static bool waitUntil(std::atomic<uint32_t> &word,
+                        std::atomic<uint32_t> &waiters, const Ready &ready,
+                        int64_t timeoutMicros) {
+    for (int i = 0; i < NUM_SPINS; ++i) {
+      if (ready(word.load(std::memory_order_acquire))) {
+        return true;
+      }
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::microseconds(timeoutMicros);
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    bool isReady;
+    uint32_t observed;
+    while (!(isReady = ready(observed =
+                                 word.load(std::memory_order_seq_cst)))) {
+      struct timespec timeout;
+      struct timespec *timeoutPtr = NULL;
+      if (timeoutMicros >= 0) {
+        const int64_t micros =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                deadline - std::chrono::steady_clock::now())
+                .count();
+        if (micros <= 0) {
+          break;
+        }
+        timeout.tv_sec = micros / 1000000;
+        timeout.tv_nsec = (micros % 1000000) * 1000;
+        timeoutPtr = &timeout;
+      }
+      // Sleeps only if the word has not changed since it was checked
+      syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAIT,
+              observed, timeoutPtr, NULL, 0);
+    }
+    waiters.fetch_sub(1, std::memory_order_seq_cst);
+    return isReady;
+  }
+
+  static void wake(std::atomic<uint32_t> &word,
+                   std::atomic<uint32_t> &waiters) {
+    if (waiters.load(std::memory_order_seq_cst) > 0) {
+      syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAKE, INT_MAX,
+              NULL, NULL, 0);
+    }
+  }
+
+  // The producer's and consumer's counters are on separate cache lines
+  alignas(64) std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> headWaiters_;
+  alignas(64) std::atomic<uint32_t> tail_;
+  std::atomic<uint32_t> tailWaiters_;
+  alignas(64) T slots_[NUM_SLOTS];
+};
+
+/// A state from the dealer, as the receiving agent may see it
+struct ShmStateRecord {
+  /// Set instead of a state once the match is over
+  bool matchOver;
+  MatchState state;
+};
+
+/**
+ * The two rings between the dealer and one agent. They carry the same
+ * states and actions as the text protocol, but as the dealer's own
+ * structures, so neither side prints or parses them.
+ */
+struct ShmChannel {
+  SpscRing<ShmStateRecord, 4> toAgent;
+  SpscRing<Action, 4> toDealer;
+};
+
+/**
+ * A @p T constructed in memory that can be shared between processes.
+ * Non-copyable; the memory is unmapped when this is destroyed.
+ */
+template <typename T> class SharedMemory {
+public:
+  static const int64_t DEFAULT_OPEN_TIMEOUT_MICROS = 10000000;
+
+  /// Anonymous memory, shared between threads and with child processes
+  /// forked after it is created
+  SharedMemory() : segment_(NULL), name_(), owner_(true) {
+    void *memory = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Could not map shared memory");
+    }
+    construct(memory);
+  }
+  /**
+   * Memory named @p name with shm_open, like "/3pk.seat1", for unrelated
+   * processes. The side that @p creates it constructs the object, and
+   * unlinks the name when it is destroyed. The other side waits up to
+   * @p timeoutMicros for the memory to be created, sized and constructed,
+   * so the two may be started in either order.
+   */
+  SharedMemory(const std::string &name, bool create,
+               int64_t timeoutMicros = DEFAULT_OPEN_TIMEOUT_MICROS)
+      : segment_(NULL), name_(name), owner_(create) {
+    if (create) {
+      const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0) {
+        throw std::runtime_error("Could not open shared memory " + name);
+      }
+      if (ftruncate(fd, sizeof(Segment)) < 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Could not size shared memory " + name);
+      }
+      void *memory = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+      close(fd);
+      if (memory == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Could not map shared memory " + name);
+      }
+      construct(memory);
+      return;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::microseconds(timeoutMicros);
+    auto waitOrThrow = [&deadline, &name](const std::string &what) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        throw std::runtime_error("Timed out waiting for shared memory " +
+                                 name + " to be " + what);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    };
+    int fd;
+    while ((fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0) {
+      if (errno != ENOENT) {
+        throw std::runtime_error("Could not open shared memory " + name);
+      }
+      waitOrThrow("created");
+    }
+    // The creator sizes the memory after creating it
+    struct stat status;
+    int r;
+    while ((r = fstat(fd, &status)) == 0 &&
+           status.st_size < off_t(sizeof(Segment))) {
+      try {
+        waitOrThrow("sized");
+      } catch (...) {
+        close(fd);
+        throw;
+      }
+    }
+    if (r < 0 || status.st_size != off_t(sizeof(Segment))) {
+      close(fd);
+      throw std::runtime_error("Shared memory " + name +
+                               " is not the size expected");
+    }
+    void *memory = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Could not map shared memory " + name);
+    }
+    segment_ = static_cast<Segment *>(memory);
+    // and then constructs the object in it
+    while (segment_->ready.load(std::memory_order_acquire) != READY) {
+      try {
+        waitOrThrow("constructed");
+      } catch (...) {
+        munmap(segment_, sizeof(Segment));
+        throw;
+      }
+    }
+  }
+  SharedMemory(const SharedMemory &) = delete;
+  SharedMemory &operator=(const SharedMemory &) = delete;
+  virtual ~SharedMemory() {
+    if (owner_) {
+      get()->~T();
+    }
+    munmap(segment_, sizeof(Segment));
+    if (owner_ && !name_.empty()) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  T &operator*() const { return *get(); }
+  T *operator->() const { return get(); }
+  T *get() const { return reinterpret_cast<T *>(segment_->object); }
+
+protected:
+  static const uint32_t READY = 0x52454459;
+
+  /// What is mapped: the object, after a flag that the creator sets once
+  /// it has constructed it
+  struct Segment {
+    std::atomic<uint32_t> ready;
+    alignas(T) unsigned char object[sizeof(T)];
+  };
+
+  void construct(void *memory) {
+    segment_ = static_cast<Segment *>(memory);
+    new (&segment_->ready) std::atomic<uint32_t>(0);
+    new (segment_->object) T();
+    segment_->ready.store(READY, std::memory_order_release);
+  }
+
+  Segment *segment_;
+  const std::string name_;
+  const bool owner_;
+};
+}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+extern "C" {
+#include <lib/dealer.h>
+}
+
+namespace AcpcMatchLog {
+namespace Acpc {
+/// The time a dealer gives each seat, as it is passed to startMatch
+struct TimeLimits {
+  /// Limits for a match of @p numHands hands, from the same arguments as
+  /// startMatch and playMatch take
+  static TimeLimits
+  ofMatch(uint32_t numHands,
+          uint64_t maxResponseMicros = DEFAULT_MAX_RESPONSE_MICROS,
+          uint64_t maxUsedHandMicros = DEFAULT_MAX_USED_HAND_MICROS,
+          uint64_t maxUsedPerHandMicros = DEFAULT_MAX_USED_PER_HAND_MICROS) {
+    return TimeLimits{numHands, maxResponseMicros, maxUsedHandMicros,
+                      maxUsedPerHandMicros * numHands};
+  }
+
+  uint32_t numHands;
+  uint64_t maxResponseMicros;
+  uint64_t maxUsedHandMicros;
+  uint64_t maxUsedMatchMicros;
+};
+
+/**
+ * Tracks the time an agent spends on each decision, hand and match on a
+ * monotonic clock, the way the dealer charges it, and gives each decision
+ * a deadline that keeps it within every limit.
+ *
+ * The dealer times a response from when it sends the state until the
+ * action arrives, so its count includes the network both ways. The budget
+ * only sees the time in between, which is why deadlines are moved forward
+ * by a safety margin.
+ */
+class TimeBudget {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const uint64_t DEFAULT_MARGIN_MICROS = 20000;
+
+  TimeBudget(const TimeLimits &limits = TimeLimits::ofMatch(3000),
+             uint64_t marginMicros = DEFAULT_MARGIN_MICROS)
+      : limits_(limits), marginMicros_(marginMicros), usedHandMicros_(0),
+        usedMatchMicros_(0), numHandsFinished_(0), decisionStart_() {}
+
+  /// Starts timing a decision, normally as soon as its state is read
+  void startDecision(Clock::time_point now = Clock::now()) {
+    decisionStart_ = now;
+  }
+  /// Charges the decision started last, once its action has been sent
+  void endDecision(Clock::time_point now = Clock::now()) {
+    const uint64_t micros =
+        now > decisionStart_
+            ? std::chrono::duration_cast<std::chrono::microseconds>(
+                  now - decisionStart_)
+                  .count()
+            : 0;
+    usedHandMicros_ += micros;
+    usedMatchMicros_ += micros;
+  }
+  void endHand() {
+    usedHandMicros_ = 0;
+    ++numHandsFinished_;
+  }
+
+  /**
+   * The latest the current decision can respond without breaking the
+   * response, hand or match limit, less the margin.
+   */
+  Clock::time_point deadline() const {
+    return decisionStart_ + allowance(std::min(
+                                {limits_.maxResponseMicros,
+                                 remaining(limits_.maxUsedHandMicros,
+                                           usedHandMicros_),
+                                 remainingMatchMicros()}));
+  }
+  /**
+   * Like deadline, but the match budget left is shared evenly between the
+   * hands left, this one included, so that one hand can't use up the time
+   * of the hands after it.
+   */
+  Clock::time_point pacedDeadline() const {
+    const uint32_t handsLeft =
+        limits_.numHands > numHandsFinished_
+            ? limits_.numHands - numHandsFinished_
+            : 1;
+    // What was left when this hand started
+    const uint64_t handShare =
+        remaining(limits_.maxUsedMatchMicros,
+                  usedMatchMicros_ - usedHandMicros_) /
+        handsLeft;
+    return std::min(deadline(),
+                    decisionStart_ +
+                        allowance(remaining(handShare, usedHandMicros_)));
+  }
+
+  uint64_t usedHandMicros() const { return usedHandMicros_; }
+  uint64_t usedMatchMicros() const { return usedMatchMicros_; }
+  uint64_t remainingMatchMicros() const {
+    return remaining(limits_.maxUsedMatchMicros, usedMatchMicros_);
+  }
+  uint32_t numHandsFinished() const { return numHandsFinished_; }
+  const TimeLimits &limits() const { return limits_; }
+
+protected:
+  static uint64_t remaining(uint64_t limit, uint64_t used) {
+    return limit > used ? limit - used : 0;
+  }
+
+  std::chrono::microseconds allowance(uint64_t micros) const {
+    return std::chrono::microseconds(remaining(micros, marginMicros_));
+  }
+
+  TimeLimits limits_;
+  uint64_t marginMicros_;
+  uint64_t usedHandMicros_;
+  uint64_t usedMatchMicros_;
+  uint32_t numHandsFinished_;
+  Clock::time_point decisionStart_;
+};
+}
+}
@@ -0,0 +1,250 @@
+/**
+ * Measures how fast the log pipeline parses, on the logs in test/data and on
+ * larger logs played here, and prints one JSON object per line to stdout for
+ * each stage and corpus, like
+ *
+ *   {"benchmark":"newState","corpus":"test_data","lines":18000,...}
+ *
+ * Usage: bench_log_parsing [minimum seconds per measurement]
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lib/acpc.hpp>
+#include <lib/acpc_match_log.hpp>
+#include <lib/encapsulated_match_state.hpp>
+
+using namespace AcpcMatchLog;
+using namespace Acpc;
+
+const std::string &thisFile = std::string(__FILE__);
+
+std::string testDirectory() {
+  return thisFile.substr(0, thisFile.find_last_of("/\\"));
+}
+
+std::string gameDefPath(const std::string &gameFile) {
+  return testDirectory() + "/../vendor/project_acpc_server/" + gameFile;
+}
+
+/// Logs of one game, and their state lines read into memory
+struct Corpus {
+  std::string name;
+  const GameDef &gameDef;
+  std::vector<std::string> files;
+  std::vector<std::string> lines;
+  size_t lineBytes;
+  size_t fileBytes;
+};
+
+void load(Corpus &corpus) {
+  corpus.lineBytes = 0;
+  corpus.fileBytes = 0;
+  for (const auto &file : corpus.files) {
+    std::ifstream stream(file);
+    if (!stream.is_open()) {
+      fprintf(stderr, "ERROR: could not open %s\n", file.c_str());
+      exit(EXIT_FAILURE);
+    }
+    std::string line;
+    while (std::getline(stream, line)) {
+      corpus.fileBytes += line.size() + 1;
+      if (line.compare(0, 6, "STATE:") == 0) {
+        corpus.lineBytes += line.size();
+        corpus.lines.push_back(line);
+      }
+    }
+  }
+}
+
+/// Plays @p numFiles matches of @p numHands hands into @p directory with
+/// agents that choose their actions at random
+void playLogs(Corpus &corpus, const std::string &directory, size_t numFiles,
+              uint32_t numHands) {
+  const Game *game = corpus.gameDef.game_;
+  std::mt19937 choices(1);
+  auto randomAction = [game, &choices](const MatchState &view) {
+    Action action{ActionType(choices() % 3), 0};
+    int32_t minSize, maxSize;
+    if (action.type == a_raise &&
+        raiseIsValid(game, &view.state, &minSize, &maxSize)) {
+      action.size = minSize + choices() % (maxSize - minSize + 1);
+    }
+    if (!isValidAction(game, &view.state, 0, &action)) {
+      action = Action{a_call, 0};
+    }
+    return action;
+  };
+  std::vector<Dealer::Agent> agents;
+  for (uint8_t p = 0; p < game->numPlayers; ++p) {
+    agents.push_back(
+        Dealer::Agent{"player" + std::to_string(p), randomAction, nullptr});
+  }
+  // The dealer prints each match's score to stdout, which is kept for the
+  // results
+  fflush(stdout);
+  const int savedStdout = dup(STDOUT_FILENO);
+  const int devNull = open("/dev/null", O_WRONLY);
+  dup2(devNull, STDOUT_FILENO);
+  close(devNull);
+  for (size_t f = 0; f < numFiles; ++f) {
+    const std::string matchName = corpus.name + "." + std::to_string(f);
+    if (Dealer::playMatch(matchName, corpus.gameDef, agents, directory,
+                          numHands, 98723209 + f, DEFAULT_MAX_INVALID_ACTIONS,
+                          DEFAULT_MAX_RESPONSE_MICROS,
+                          DEFAULT_MAX_USED_HAND_MICROS,
+                          DEFAULT_MAX_USED_PER_HAND_MICROS, false, true, false,
+                          true) != EXIT_SUCCESS) {
+      fprintf(stderr, "ERROR: could not play %s\n", matchName.c_str());
+      exit(EXIT_FAILURE);
+    }
+    corpus.files.push_back(directory + "/" + matchName + ".log");
+  }
+  fflush(stdout);
+  dup2(savedStdout, STDOUT_FILENO);
+  close(savedStdout);
+}
+
+/// Runs @p pass until @p minSeconds have passed, at least once, and prints
+/// the time per line and throughput. @p pass returns the lines it parsed.
+void measure(const std::string &benchmark, const Corpus &corpus, size_t bytes,
+             double minSeconds, const std::function<size_t()> &pass) {
+  typedef std::chrono::steady_clock Clock;
+  const size_t expectedLines = corpus.lines.size();
+  uint32_t iterations = 0;
+  double seconds = 0;
+  const auto start = Clock::now();
+  do {
+    if (pass() != expectedLines) {
+      fprintf(stderr, "ERROR: %s parsed the wrong number of lines of %s\n",
+              benchmark.c_str(), corpus.name.c_str());
+      exit(EXIT_FAILURE);
+    }
+    ++iterations;
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (seconds < minSeconds);
+
+  const double totalLines = double(expectedLines) * iterations;
+  printf("{\"benchmark\":\"%s\",\"corpus\":\"%s\",\"lines\":%zu,"
+         "\"bytes\":%zu,\"iterations\":%u,\"seconds\":%.6f,"
+         "\"ns_per_line\":%.2f,\"mb_per_s\":%.2f}\n",
+         benchmark.c_str(), corpus.name.c_str(), expectedLines, bytes,
+         iterations, seconds, seconds * 1e9 / totalLines,
+         double(bytes) * iterations / seconds / 1e6);
+  fflush(stdout);
+}
+
+void benchmark(const Corpus &corpus, double minSeconds) {
+  // Keeps each parse from being optimized away
+  std::atomic<uint64_t> sink(0);
+  const GameDef &gameDef = corpus.gameDef;
+
+  measure("newState", corpus, corpus.lineBytes, minSeconds, [&]() {
+    uint64_t handIds = 0;
+    for (const auto &line : corpus.lines) {
+      handIds += newState(line, gameDef).handId;
+    }
+    sink += handIds;
+    return corpus.lines.size();
+  });
+  measure("players", corpus, corpus.lineBytes, minSeconds, [&]() {
+    uint64_t nameLengths = 0;
+    for (const auto &line : corpus.lines) {
+      nameLengths += players(line, gameDef)[0].size();
+    }
+    sink += nameLengths;
+    return corpus.lines.size();
+  });
+  measure("EncapsulatedMatchState", corpus, corpus.lineBytes, minSeconds,
+          [&]() {
+            uint64_t handNums = 0;
+            for (const auto &line : corpus.lines) {
+              handNums += EncapsulatedMatchState(line, gameDef).handNum();
+            }
+            sink += handNums;
+            return corpus.lines.size();
+          });
+
+  auto countStates = [&](std::atomic<size_t> &numStates) {
+    return [&numStates](const EncapsulatedMatchState &,
+                        const std::vector<std::string>) {
+      ++numStates;
+      return false;
+    };
+  };
+  measure("LogFile::eachState", corpus, corpus.fileBytes, minSeconds, [&]() {
+    std::atomic<size_t> numStates(0);
+    for (const auto &file : corpus.files) {
+      LogFile(file, gameDef).eachState(countStates(numStates));
+    }
+    return numStates.load();
+  });
+  measure("LogFileSet::processFiles", corpus, corpus.fileBytes, minSeconds,
+          [&]() {
+            std::atomic<size_t> numStates(0);
+            LogFileSet(corpus.files, gameDef)
+                .processFiles(countStates(numStates));
+            return numStates.load();
+          });
+  measure("LogFileSet::processFilesInParallel", corpus, corpus.fileBytes,
+          minSeconds, [&]() {
+            std::atomic<size_t> numStates(0);
+            LogFileSet(corpus.files, gameDef)
+                .processFilesInParallel(countStates(numStates));
+            return numStates.load();
+          });
+  if (sink == 0) {
+    fprintf(stderr, "ERROR: nothing was parsed from %s\n",
+            corpus.name.c_str());
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv) {
+  const double minSeconds = argc > 1 ? atof(argv[1]) : 0.5;
+
+  const GameDef kuhn(gameDefPath("kuhn.limit.3p.game"));
+  const GameDef holdem(gameDefPath("holdem.nolimit.2p.reverse_blinds.game"));
+
+  Corpus testData{"test_data", kuhn, {}, {}, 0, 0};
+  for (size_t f = 0; f < 6; ++f) {
+    testData.files.push_back(testDirectory() +
+                             "/data/3pk.HITSZ_CS.hyperborean3pk.RMPUE.Bluffer."
+                             "5." +
+                             std::to_string(f) + ".log");
+  }
+
+  char directoryName[] = "/tmp/acpc_match_log_bench_XXXXXX";
+  if (!mkdtemp(directoryName)) {
+    fprintf(stderr, "ERROR: could not make a directory for the logs\n");
+    return EXIT_FAILURE;
+  }
+  const std::string directory = directoryName;
+  fprintf(stderr, "Playing synthetic logs into %s\n", directory.c_str());
+  Corpus kuhnLogs{"kuhn.limit.3p", kuhn, {}, {}, 0, 0};
+  playLogs(kuhnLogs, directory, 8, 25000);
+  Corpus holdemLogs{"holdem.nolimit.2p", holdem, {}, {}, 0, 0};
+  playLogs(holdemLogs, directory, 8, 10000);
+
+  for (Corpus *corpus : {&testData, &kuhnLogs, &holdemLogs}) {
+    load(*corpus);
+    benchmark(*corpus, minSeconds);
+  }
+
+  for (const Corpus *corpus : {&kuhnLogs, &holdemLogs}) {
+    for (const auto &file : corpus->files) {
+      std::remove(file.c_str());
+    }
+  }
+  rmdir(directory.c_str());
+  return EXIT_SUCCESS;
+}
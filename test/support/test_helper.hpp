@@ -2,9 +2,30 @@
 #define __TEST_HELPER__
 
 #include <cstdio>
+#include <string>
 #include <catch.hpp>
 
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include <catch.hpp>
 
+#include <lib/acpc.hpp>
+
+/// The directory of the tests, which this file's directory is in
+inline std::string testDirectory() {
+  const std::string thisFile(__FILE__);
+  const std::string supportDirectory =
+      thisFile.substr(0, thisFile.find_last_of("/\\"));
+  return supportDirectory.substr(0, supportDirectory.find_last_of("/\\"));
+}
+
+/// The directory of the ACPC server's sources and game definitions
+inline std::string acpcServerDirectory() {
+  return testDirectory() + "/../vendor/project_acpc_server/";
+}
+
+inline AcpcMatchLog::Acpc::GameDef new3PlayerLimitKuhnGameDef() {
+  return AcpcMatchLog::Acpc::GameDef(acpcServerDirectory() +
+                                     "kuhn.limit.3p.game");
+}
+
 #endif
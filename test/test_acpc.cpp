@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN // This tells Catch to provide a main() - only do this
+                          // in one cpp file
+#include <test_helper.hpp>
+
+#include <lib/acpc.hpp>
+
+using namespace AcpcMatchLog;
+using namespace Acpc;
+
+SCENARIO("Regret matching over a block of information sets") {
+  GIVEN("Regrets for three information sets with three actions each") {
+    const std::vector<double> regrets{1.0, -2.0, 3.0,  // mixed
+                                      -1.0, 0.0, -5.0, // no positive regret
+                                      0.0, 2.0, 0.0};  // pure
+    const std::vector<double> xStrategies{0.25, 0.0, 0.75,
+                                          1.0 / 3, 1.0 / 3, 1.0 / 3,
+                                          0.0, 1.0, 0.0};
+    THEN("Each strategy matches the single action version") {
+      for (size_t i = 0; i < 3; ++i) {
+        const std::vector<double> infoSetRegrets(regrets.begin() + i * 3,
+                                                 regrets.begin() + i * 3 + 3);
+        for (size_t a = 0; a < 3; ++a) {
+          REQUIRE(regretMatching(infoSetRegrets, a) ==
+                  Approx(xStrategies[i * 3 + a]));
+        }
+      }
+    }
+    THEN("The batched version computes every strategy at once") {
+      std::vector<double> patient(regrets.size());
+      regretMatching(regrets.data(), size_t(3), size_t(3), patient.data());
+      for (size_t i = 0; i < patient.size(); ++i) {
+        REQUIRE(patient[i] == Approx(xStrategies[i]));
+      }
+    }
+    THEN("The fixed action count version agrees") {
+      std::vector<double> patient(regrets.size());
+      regretMatching<3>(regrets.data(), 3, patient.data());
+      for (size_t i = 0; i < patient.size(); ++i) {
+        REQUIRE(patient[i] == Approx(xStrategies[i]));
+      }
+    }
+  }
+}
+
+SCENARIO("Batched logsumexp and normalization") {
+  GIVEN("Two rows of log weights") {
+    const std::vector<double> rows{-1.0, 0.5, 2.0, -30.0,
+                                   700.0, 700.0, 699.0, 1.0};
+    const std::vector<double> row0(rows.begin(), rows.begin() + 4);
+    const std::vector<double> row1(rows.begin() + 4, rows.end());
+    THEN("Each row's logsumexp matches the single row version") {
+      double patient[2];
+      logsumexp(rows.data(), size_t(2), size_t(4), patient);
+      REQUIRE(patient[0] == Approx(logsumexp(row0)));
+      REQUIRE(patient[1] == Approx(logsumexp(row1)));
+    }
+    THEN("Fast exp gives the same result") {
+      double patient[2];
+      logsumexp<true>(rows.data(), size_t(2), size_t(4), patient);
+      REQUIRE(patient[0] == Approx(logsumexp(row0)));
+      REQUIRE(patient[1] == Approx(logsumexp(row1)));
+    }
+    THEN("Log weights are normalized in place") {
+      std::vector<double> patient(rows);
+      normalizeLogWeights<true>(patient.data(), size_t(2), size_t(4));
+      for (size_t j = 0; j < 4; ++j) {
+        REQUIRE(patient[j] == Approx(std::exp(row0[j] - logsumexp(row0))));
+        REQUIRE(patient[4 + j] ==
+                Approx(std::exp(row1[j] - logsumexp(row1))));
+      }
+    }
+  }
+  GIVEN("Two rows of weights") {
+    std::vector<double> patient{1.0, 3.0, 0.0, 0.0, 0.0, 0.0};
+    THEN("Each row is normalized in place") {
+      normalize(patient.data(), size_t(2), size_t(3));
+      REQUIRE(patient[0] == Approx(0.25));
+      REQUIRE(patient[1] == Approx(0.75));
+      REQUIRE(patient[2] == Approx(0.0));
+      for (size_t j = 3; j < 6; ++j) {
+        REQUIRE(patient[j] == Approx(1.0 / 3));
+      }
+    }
+  }
+  THEN("fastExp is close to exp") {
+    for (double x = -50.0; x < 50.0; x += 0.37) {
+      REQUIRE(fastExp(x) == Approx(std::exp(x)).epsilon(1e-7));
+    }
+  }
+}
+
+// Ranking and counting deals happens at compile time
+static_assert(KCardDeals<52, 2>::size == 1326, "Hold'em has 1326 hands");
+static_assert(choose(64, 32) == 1832624140942590534ull,
+              "Intermediate products don't overflow");
+static_assert(choose(67, 33) == 14226520737620288370ull,
+              "Intermediate products don't overflow");
+static_assert(KCardDeals<6, 2>::rank(0x30) == 14, "Last pair of six cards");
+static_assert(KCardDeals<6, 2>::unrank(14) == 0x30, "Last pair of six cards");
+
+SCENARIO("Enumerating the cards in a deck") {
+  GIVEN("A six card deck with two cards revealed") {
+    Deck<6> patient;
+    patient.reveal(1);
+    patient.reveal(4);
+    THEN("The hidden cards are listed without allocating") {
+      REQUIRE(patient.numHiddenCards() == 4);
+      size_t hidden[6];
+      REQUIRE(patient.hiddenCards(hidden) == 4);
+      REQUIRE(hidden[0] == 0);
+      REQUIRE(hidden[1] == 2);
+      REQUIRE(hidden[2] == 3);
+      REQUIRE(hidden[3] == 5);
+      REQUIRE(patient.hiddenCards<int>() == std::vector<int>({0, 2, 3, 5}));
+    }
+    THEN("Every two card deal of the hidden cards is enumerated") {
+      std::vector<uint64_t> ranks;
+      patient.forEachDeal<2>([&ranks](const size_t *cards) {
+        REQUIRE(cards[0] < cards[1]);
+        ranks.push_back(KCardDeals<6, 2>::rank((uint64_t(1) << cards[0]) |
+                                               (uint64_t(1) << cards[1])));
+      });
+      REQUIRE(ranks.size() == choose(4, 2));
+      REQUIRE(std::is_sorted(ranks.begin(), ranks.end()));
+    }
+  }
+  GIVEN("A deck larger than one word") {
+    Deck<70> patient;
+    patient.reveal(65);
+    THEN("Every card is accounted for") {
+      REQUIRE(patient.numHiddenCards() == 69);
+      REQUIRE(!patient.isRevealed(64));
+      REQUIRE(patient.isRevealed(65));
+      REQUIRE(patient.hiddenCards<size_t>().back() == 69);
+    }
+  }
+  THEN("Deals are enumerated in rank order") {
+    uint64_t i = 0;
+    KCardDeals<6, 3>::forEach([&i](uint64_t deal) {
+      REQUIRE(KCardDeals<6, 3>::rank(deal) == i);
+      REQUIRE(KCardDeals<6, 3>::unrank(i) == deal);
+      ++i;
+    });
+    REQUIRE(i == KCardDeals<6, 3>::size);
+  }
+}
+
+SCENARIO("Drawing random numbers from per-thread streams") {
+  GIVEN("A generator with the reference state") {
+    Xoshiro256StarStar patient(1, 2, 3, 4);
+    THEN("It reproduces the reference outputs") {
+      REQUIRE(patient() == 11520u);
+      REQUIRE(patient() == 0u);
+      REQUIRE(patient() == 1509978240u);
+      REQUIRE(patient() == 1215971899390074240u);
+    }
+  }
+  GIVEN("A seeded generator") {
+    const Xoshiro256StarStar seeded(98723209);
+    THEN("The same seed gives the same sequence") {
+      Xoshiro256StarStar a(seeded), b(98723209);
+      for (size_t i = 0; i < 100; ++i) {
+        REQUIRE(a() == b());
+      }
+    }
+    THEN("Streams are reproducible and distinct") {
+      Xoshiro256StarStar s0 = seeded.stream(0), s1 = seeded.stream(1),
+                         s1Again = seeded.stream(1);
+      const uint64_t first = s1();
+      REQUIRE(first == s1Again());
+      REQUIRE(first != s0());
+    }
+    THEN("Batched samples have the right distributions") {
+      Xoshiro256StarStar rng(seeded);
+      std::vector<double> uniforms(10000);
+      rng.fillUniform(uniforms.data(), uniforms.size());
+      double sum = 0.0;
+      for (const auto u : uniforms) {
+        REQUIRE(u >= 0.0);
+        REQUIRE(u < 1.0);
+        sum += u;
+      }
+      REQUIRE(sum / uniforms.size() == Approx(0.5).epsilon(0.05));
+
+      std::vector<uint8_t> coins(10000);
+      rng.fillBernoulli(0.25, coins.data(), coins.size());
+      REQUIRE(std::count(coins.begin(), coins.end(), 1) / 10000.0 ==
+              Approx(0.25).epsilon(0.1));
+
+      for (size_t i = 0; i < 1000; ++i) {
+        REQUIRE(rng.uniformInt(7) < 7u);
+      }
+    }
+  }
+  THEN("Coins can be flipped with either engine") {
+    std::mt19937 mt(1);
+    Xoshiro256StarStar x(1);
+    REQUIRE(flipCoin(1.0, &mt));
+    REQUIRE(!flipCoin(0.0, &mt));
+    REQUIRE(flipCoin(1.0, &x));
+    REQUIRE(!flipCoin(0.0, &x));
+  }
+}
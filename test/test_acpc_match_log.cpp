@@ -9,28 +9,15 @@
 
 #include <lib/acpc_match_log.hpp>
 #include <lib/encapsulated_match_state.hpp>
+#include <lib/betting_sequence_trie.hpp>
+#include <lib/game_tree.hpp>
 
 using namespace AcpcMatchLog;
 using namespace Acpc;
 
 #include <lib/acpc.hpp>
 
-const std::string &thisFile = std::string(__FILE__);
-
-GameDef new3PlayerLimitKuhnGameDef() {
-  const std::string &filePath = thisFile;
-  const auto pos = filePath.find_last_of("/\\");
-  std::string gameDefPath = filePath.substr(0, pos) +
-                            "/../vendor/project_acpc_server/kuhn.limit.3p.game";
-
-  return GameDef(gameDefPath);
-}
-
-std::string dataDirectory() {
-  const std::string &filePath = thisFile;
-  const auto pos = filePath.find_last_of("/\\");
-  return filePath.substr(0, pos) + "/data";
-}
+std::string dataDirectory() { return testDirectory() + "/data"; }
 
 SCENARIO("Parsing a log state line into a match state") {
   const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
@@ -3119,3 +3106,75 @@ SCENARIO("Parsing a log file into a sequence of match states") {
     }
   }
 }
+
+SCENARIO("Replaying hands through a betting sequence trie") {
+  const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
+  GIVEN("The hands of a log file") {
+    const std::vector<std::string> xStateStrings = expectedStatesFromLog0();
+    THEN("Each replay yields the same states as a replay from scratch") {
+      BettingSequenceTrie patient(myGameDef);
+      for (const auto &stateString : xStateStrings) {
+        const EncapsulatedMatchState hand(
+            stateString, myGameDef, EncapsulatedMatchState::OMNISCIENT_VIEWER);
+        std::vector<std::string> xReplay;
+        hand.replay<EncapsulatedMatchState>(
+            [&xReplay](const EncapsulatedMatchState &ms, const Action &action) {
+              xReplay.push_back(ms.toString() +
+                                actionToString(action, ms.gameDef().game_));
+              return false;
+            });
+        size_t i = 0;
+        patient.replay<EncapsulatedMatchState>(
+            hand, [&xReplay, &i](const EncapsulatedMatchState &ms,
+                                 const Action &action) {
+              REQUIRE(xReplay[i] ==
+                      ms.toString() +
+                          actionToString(action, ms.gameDef().game_));
+              ++i;
+              return false;
+            });
+        REQUIRE(i == xReplay.size());
+      }
+      // 3000 hands share the 25 betting sequences of three player Kuhn
+      REQUIRE(patient.size() == 25);
+    }
+  }
+}
+
+SCENARIO("Replaying hands through a precomputed game tree") {
+  const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
+  const GameTree tree(myGameDef);
+  THEN("The tree contains every betting sequence") {
+    REQUIRE(tree.size() == 25);
+    REQUIRE(tree.numTerminalNodes() == 13);
+    REQUIRE(tree[GameTree::ROOT].subtreeEnd == tree.size());
+  }
+  GIVEN("The hands of a log file") {
+    const std::vector<std::string> xStateStrings = expectedStatesFromLog0();
+    THEN("Table lookups agree with the game rules") {
+      for (const auto &stateString : xStateStrings) {
+        const EncapsulatedMatchState hand(stateString, myGameDef);
+        std::vector<EncapsulatedMatchState> xReplay;
+        hand.replay<EncapsulatedMatchState>(
+            [&xReplay](const EncapsulatedMatchState &ms, const Action &) {
+              xReplay.push_back(ms);
+              return false;
+            });
+        size_t i = 0;
+        const GameTreeMatchState patient(hand, tree);
+        REQUIRE(patient.isFinished());
+        REQUIRE(patient.node().isTerminal());
+        REQUIRE(patient.potSize() == hand.potSize());
+        patient.replay([&xReplay, &i](const GameTreeMatchState &ms,
+                                      const Action &) {
+          REQUIRE(ms.actor() == xReplay[i].actor());
+          REQUIRE(ms.potSize() == xReplay[i].potSize());
+          REQUIRE(ms.toString() == xReplay[i].toString());
+          ++i;
+          return false;
+        });
+        REQUIRE(i == xReplay.size());
+      }
+    }
+  }
+}
@@ -0,0 +1,1633 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define CATCH_CONFIG_MAIN // This tells Catch to provide a main() - only do this
+                          // in one cpp file
+#include <test_helper.hpp>
+
+#include <lib/acpc.hpp>
+#include <lib/acpc_match_log.hpp>
+#include <lib/async_client.hpp>
+#include <lib/duplicate_match.hpp>
+#include <lib/epoll_dealer.hpp>
+#include <lib/match_farm.hpp>
+
+using namespace AcpcMatchLog;
+using namespace Acpc;
+
+std::string newWorkingDirectory() {
+  char name[] = "/tmp/acpc_match_log_test_XXXXXX";
+  REQUIRE(mkdtemp(name));
+  return name;
+}
+
+SCENARIO("Playing a match between agents in the dealer's process") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const uint32_t numHands = 300;
+
+  GIVEN("Agents that always call") {
+    std::vector<size_t> numActions(3, 0), numHandsSeen(3, 0);
+    std::vector<double> totalValue(3, 0.0);
+    std::vector<Dealer::Agent> agents;
+    for (size_t s = 0; s < 3; ++s) {
+      agents.push_back(Dealer::Agent{
+          "caller" + std::to_string(s),
+          [&, s](const MatchState &view) {
+            ++numActions[s];
+            REQUIRE(currentPlayer(gameDef.game_, &view.state) ==
+                    view.viewingPlayer);
+            for (uint8_t p = 0; p < 3; ++p) {
+              const bool visible = view.state.holeCards[p][0] != 0;
+              REQUIRE(visible == (p == view.viewingPlayer));
+            }
+            return Action{a_call, 0};
+          },
+          [&, s](const MatchState &view) {
+            ++numHandsSeen[s];
+            REQUIRE(stateFinished(&view.state));
+            totalValue[s] +=
+                valueOfState(gameDef.game_, &view.state, view.viewingPlayer);
+          }});
+    }
+    THEN("Every hand is played and logged") {
+      const std::string workingDirectory = newWorkingDirectory();
+      REQUIRE(Dealer::playMatch("callers", gameDef, agents, workingDirectory,
+                                numHands, 98723209,
+                                DEFAULT_MAX_INVALID_ACTIONS,
+                                DEFAULT_MAX_RESPONSE_MICROS,
+                                DEFAULT_MAX_USED_HAND_MICROS,
+                                DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                                false, true) == EXIT_SUCCESS);
+
+      for (size_t s = 0; s < 3; ++s) {
+        REQUIRE(numHandsSeen[s] == numHands);
+        REQUIRE(numActions[s] == numHands);
+      }
+      REQUIRE(totalValue[0] + totalValue[1] + totalValue[2] == 0.0);
+
+      size_t numHandsLogged = 0;
+      LogFile(workingDirectory + "/callers.log", gameDef)
+          .eachState([&](const EncapsulatedMatchState &ms,
+                         const std::vector<std::string> &playerNames) {
+            ++numHandsLogged;
+            REQUIRE(ms.isFinished());
+            REQUIRE(playerNames.size() == 3);
+            return false;
+          });
+      REQUIRE(numHandsLogged == numHands);
+
+      std::remove((workingDirectory + "/callers.log").c_str());
+      rmdir(workingDirectory.c_str());
+    }
+  }
+  GIVEN("An agent that throws") {
+    std::vector<Dealer::Agent> agents(
+        3, Dealer::Agent{"caller",
+                         [](const MatchState &) { return Action{a_call, 0}; },
+                         nullptr});
+    agents[1].generateAction = [](const MatchState &view) -> Action {
+      if (view.state.handId == 10) {
+        throw std::runtime_error("Agent failed");
+      }
+      return Action{a_call, 0};
+    };
+    THEN("The match stops and the exception is rethrown") {
+      REQUIRE_THROWS_AS(Dealer::playMatch("thrower", gameDef, agents, "/tmp",
+                                          numHands),
+                        std::runtime_error);
+    }
+  }
+}
+
+SCENARIO("Running many matches concurrently on a match farm") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const Dealer::Agent caller{
+      "caller", [](const MatchState &) { return Action{a_call, 0}; },
+      nullptr};
+  const std::string workingDirectory = newWorkingDirectory();
+
+  std::vector<Dealer::MatchSpec> specs;
+  for (uint32_t m = 0; m < 8; ++m) {
+    specs.push_back(Dealer::MatchSpec{"farm." + std::to_string(m),
+                                      &gameDef,
+                                      {caller, caller, caller},
+                                      100 + m,
+                                      m,
+                                      workingDirectory,
+                                      false,
+                                      true,
+                                      false});
+  }
+  specs[3].agents[2].generateAction = [](const MatchState &) -> Action {
+    throw std::runtime_error("Agent failed");
+  };
+  // Its log file can't be opened
+  specs[5].workingDirectory = workingDirectory + "/missing";
+
+  WHEN("The matches are run") {
+    const Dealer::FarmReport report = Dealer::MatchFarm(3).run(specs);
+    THEN("Every match is run in isolation and failures are reported") {
+      REQUIRE(report.results.size() == specs.size());
+      REQUIRE(report.numFailures() == 2);
+      REQUIRE(report.results[3].error == "Agent failed");
+      REQUIRE(report.results[5].status == EXIT_FAILURE);
+
+      uint64_t numHands = 0;
+      for (size_t m = 0; m < specs.size(); ++m) {
+        REQUIRE(report.results[m].matchName == specs[m].matchName);
+        const std::string logPath =
+            workingDirectory + "/" + specs[m].matchName + ".log";
+        if (m != 3 && m != 5) {
+          REQUIRE(report.results[m].succeeded());
+          numHands += specs[m].numHands;
+
+          size_t numHandsLogged = 0;
+          LogFile(logPath, gameDef)
+              .eachState([&numHandsLogged](
+                  const EncapsulatedMatchState &,
+                  const std::vector<std::string> &) {
+                ++numHandsLogged;
+                return false;
+              });
+          REQUIRE(numHandsLogged == specs[m].numHands);
+        }
+        std::remove(logPath.c_str());
+      }
+      REQUIRE(report.numHands == numHands);
+      REQUIRE(report.handsPerSecond() > 0);
+    }
+  }
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Playing every seat permutation of a duplicate match") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::vector<std::string> players{"HITSZ_CS", "hyperborean3pk.RMPUE",
+                                         "Bluffer"};
+
+  THEN("Permutations are named like the duplicate match logs") {
+    Dealer::DuplicateMatch patient("3pk", gameDef, players, "data", 5,
+                                   629500866);
+    REQUIRE(patient.numPermutations() == 6);
+    for (size_t i = 0; i < patient.numPermutations(); ++i) {
+      REQUIRE(patient.matchNames()[i] ==
+              "3pk.HITSZ_CS.hyperborean3pk.RMPUE.Bluffer.5." +
+                  std::to_string(i));
+    }
+    REQUIRE(patient.seatPlayers(1) ==
+            std::vector<std::string>({"HITSZ_CS", "Bluffer",
+                                      "hyperborean3pk.RMPUE"}));
+    REQUIRE(patient.seatPlayers(4) ==
+            std::vector<std::string>({"Bluffer", "HITSZ_CS",
+                                      "hyperborean3pk.RMPUE"}));
+  }
+  GIVEN("Players that connect over the network and always call") {
+    const std::string workingDirectory = newWorkingDirectory();
+    const uint32_t numHands = 60;
+    Dealer::DuplicateMatch patient("3pk", gameDef, players, workingDirectory,
+                                   0, 98723209, numHands);
+
+    std::mutex playersMutex;
+    std::vector<std::thread> playerThreads;
+    auto launchPlayers = [&](const std::string &,
+                             const std::vector<std::string> &,
+                             const std::vector<uint16_t> &ports) {
+      std::lock_guard<std::mutex> lock(playersMutex);
+      for (const auto port : ports) {
+        playerThreads.emplace_back([&gameDef, port]() {
+          Configuration(gameDef, port)
+              .forEveryMatchState(
+                  [](const MatchState &) { return Action{a_call, 0}; },
+                  [](const MatchState &) {});
+        });
+      }
+    };
+
+    WHEN("The permutations are run") {
+      REQUIRE(patient.run(launchPlayers) == EXIT_SUCCESS);
+      for (auto &t : playerThreads) {
+        t.join();
+      }
+      THEN("Every permutation is logged and the set can be analyzed") {
+        std::mutex handsMutex;
+        size_t numHandsLogged = 0;
+        patient.analyze([&](const EncapsulatedMatchState &ms,
+                            const std::vector<std::string> playerNames) {
+          std::lock_guard<std::mutex> lock(handsMutex);
+          ++numHandsLogged;
+          REQUIRE(ms.isFinished());
+          REQUIRE(playerNames.size() == 3);
+          return false;
+        });
+        REQUIRE(numHandsLogged == numHands * 6);
+
+        // Every player saw every seat with the same cards and called
+        // throughout, so the duplicate totals cancel out
+        const auto totals = patient.totalValues();
+        REQUIRE(totals.size() == 3);
+        double sum = 0.0;
+        for (const auto &t : totals) {
+          sum += t.second;
+        }
+        REQUIRE(sum == 0.0);
+        REQUIRE(totals.at(players[0]) == totals.at(players[1]));
+        REQUIRE(totals.at(players[1]) == totals.at(players[2]));
+      }
+      for (const auto &path : patient.logFilePaths()) {
+        std::remove(path.c_str());
+      }
+    }
+    rmdir(workingDirectory.c_str());
+  }
+}
+
+SCENARIO("Hosting many matches in one thread with an epoll dealer") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::string workingDirectory = newWorkingDirectory();
+  const uint32_t numHands = 50;
+  const size_t numMatches = 8;
+
+  Dealer::EpollDealer patient;
+  std::vector<std::thread> playerThreads;
+  for (size_t m = 0; m < numMatches; ++m) {
+    const auto ports = patient.addMatch(
+        "epoll." + std::to_string(m), gameDef, {"a", "b", "c"},
+        workingDirectory, numHands, m, DEFAULT_MAX_INVALID_ACTIONS,
+        DEFAULT_MAX_RESPONSE_MICROS, DEFAULT_MAX_USED_HAND_MICROS,
+        DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000, false, true, false,
+        true);
+    REQUIRE(ports.size() == 3);
+    for (const auto port : ports) {
+      playerThreads.emplace_back([&gameDef, port]() {
+        Configuration(gameDef, port)
+            .forEveryMatchState(
+                [](const MatchState &) { return Action{a_call, 0}; },
+                [](const MatchState &) {});
+      });
+    }
+  }
+  REQUIRE(patient.numRunningMatches() == numMatches);
+
+  WHEN("The dealer runs") {
+    patient.run();
+    for (auto &t : playerThreads) {
+      t.join();
+    }
+    THEN("Every match finishes and matches its in-process equivalent") {
+      REQUIRE(patient.numRunningMatches() == 0);
+      for (size_t m = 0; m < numMatches; ++m) {
+        REQUIRE(patient.status(m) == EXIT_SUCCESS);
+
+        const Dealer::Agent caller{
+            "", [](const MatchState &) { return Action{a_call, 0}; },
+            nullptr};
+        const std::string expectedName = "expected." + std::to_string(m);
+        REQUIRE(Dealer::playMatch(
+                    expectedName, gameDef,
+                    {Dealer::Agent{"a", caller.generateAction, nullptr},
+                     Dealer::Agent{"b", caller.generateAction, nullptr},
+                     Dealer::Agent{"c", caller.generateAction, nullptr}},
+                    workingDirectory, numHands, m,
+                    DEFAULT_MAX_INVALID_ACTIONS, DEFAULT_MAX_RESPONSE_MICROS,
+                    DEFAULT_MAX_USED_HAND_MICROS,
+                    DEFAULT_MAX_USED_PER_HAND_MICROS, false, true, false,
+                    true) == EXIT_SUCCESS);
+
+        const std::string logPath =
+            workingDirectory + "/" + patient.matchName(m) + ".log";
+        const std::string expectedLogPath =
+            workingDirectory + "/" + expectedName + ".log";
+        std::ifstream log(logPath), expectedLog(expectedLogPath);
+        std::string line, expectedLine;
+        size_t numLines = 0;
+        while (std::getline(expectedLog, expectedLine)) {
+          REQUIRE(std::getline(log, line));
+          REQUIRE(line == expectedLine);
+          ++numLines;
+        }
+        REQUIRE(numLines == numHands + 1);
+        std::remove(logPath.c_str());
+        std::remove(expectedLogPath.c_str());
+      }
+    }
+  }
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Timing out a seat that never sends its version to an epoll "
+         "dealer") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  Dealer::EpollDealer patient;
+  const auto ports = patient.addMatch(
+      "silent", gameDef, {"a", "b", "c"}, "/tmp", 10, 0,
+      DEFAULT_MAX_INVALID_ACTIONS, 200000, DEFAULT_MAX_USED_HAND_MICROS,
+      DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000);
+  std::vector<int> seats;
+  char host[] = "localhost";
+  for (size_t s = 0; s < ports.size(); ++s) {
+    seats.push_back(connectTo(host, ports[s]));
+    REQUIRE(seats.back() >= 0);
+    // The last seat connects, but says nothing
+    if (s + 1 < ports.size()) {
+      const std::string version = "VERSION:2.0.0\r\n";
+      REQUIRE(write(seats.back(), version.data(), version.size()) ==
+              ssize_t(version.size()));
+    }
+  }
+  THEN("The match fails once the response timeout has passed") {
+    patient.run();
+    REQUIRE(patient.status(0) == EXIT_FAILURE);
+  }
+  for (const int seat : seats) {
+    close(seat);
+  }
+}
+
+SCENARIO("Writing log files from a background thread") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const uint32_t numHands = 500;
+  const Dealer::Agent caller{
+      "caller", [](const MatchState &) { return Action{a_call, 0}; },
+      nullptr};
+  const std::vector<Dealer::Agent> agents(3, caller);
+  const std::string workingDirectory = newWorkingDirectory();
+  auto readLines = [](const std::string &path) {
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line)) {
+      lines.push_back(line);
+    }
+    return lines;
+  };
+  auto play = [&](const std::string &matchName,
+                  const Dealer::LogPolicy &policy) {
+    return Dealer::playMatch(matchName, gameDef, agents, workingDirectory,
+                             numHands, 98723209, DEFAULT_MAX_INVALID_ACTIONS,
+                             DEFAULT_MAX_RESPONSE_MICROS,
+                             DEFAULT_MAX_USED_HAND_MICROS,
+                             DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                             false, true, true, policy, policy);
+  };
+  REQUIRE(play("direct", Dealer::LogPolicy::direct()) == EXIT_SUCCESS);
+  const auto expectedLog = readLines(workingDirectory + "/direct.log");
+  const auto expectedTransactions =
+      readLines(workingDirectory + "/direct.tlog");
+  REQUIRE(expectedLog.size() == numHands + 1);
+  // Transactions are stamped with the time of day, not the monotonic clock
+  // that times responses
+  const std::string &first = expectedTransactions.front();
+  const double sendTime =
+      std::stod(first.substr(first.find(' ', first.find(' ') + 1)));
+  REQUIRE(sendTime > double(time(nullptr)) - 3600);
+  REQUIRE(sendTime < double(time(nullptr)) + 3600);
+
+  const std::vector<Dealer::LogPolicy> policies{
+      Dealer::LogPolicy::background(LOG_FLUSH_EVERY_RECORD),
+      Dealer::LogPolicy::background(LOG_FLUSH_EVERY_N_RECORDS, 64),
+      Dealer::LogPolicy::background(LOG_FLUSH_EVERY_N_MICROS, 1000),
+      Dealer::LogPolicy::background(LOG_FLUSH_AT_CLOSE),
+      Dealer::LogPolicy::background(LOG_FLUSH_EVERY_N_RECORDS, 16, true)};
+  for (size_t i = 0; i < policies.size(); ++i) {
+    const std::string matchName = "buffered." + std::to_string(i);
+    THEN("Policy " + std::to_string(i) + " writes every record in order") {
+      REQUIRE(play(matchName, policies[i]) == EXIT_SUCCESS);
+      REQUIRE(readLines(workingDirectory + "/" + matchName + ".log") ==
+              expectedLog);
+      // Only the action and hand of a transaction, not when it was made
+      auto actionAndHand = [](const std::string &transaction) {
+        return transaction.substr(
+            0, transaction.find(' ', transaction.find(' ') + 1));
+      };
+      const auto transactions =
+          readLines(workingDirectory + "/" + matchName + ".tlog");
+      REQUIRE(transactions.size() == expectedTransactions.size());
+      for (size_t t = 0; t < transactions.size(); ++t) {
+        REQUIRE(actionAndHand(transactions[t]) ==
+                actionAndHand(expectedTransactions[t]));
+      }
+      std::remove((workingDirectory + "/" + matchName + ".log").c_str());
+      std::remove((workingDirectory + "/" + matchName + ".tlog").c_str());
+    }
+  }
+  THEN("A full buffer is written before the stream is closed, whatever "
+       "the policy") {
+    const std::string path = workingDirectory + "/large.log";
+    FILE *file = fopen(path.c_str(), "a+");
+    REQUIRE(file);
+    FILE *stream = openBufferedLog(file, LOG_FLUSH_AT_CLOSE, 0, 0);
+    REQUIRE(stream);
+    const std::string record(1000, 'x');
+    const size_t numRecords = 3 * MAX_LOG_BUFFER_BYTES / record.size();
+    for (size_t r = 0; r < numRecords; ++r) {
+      fputs(record.c_str(), stream);
+      fflush(stream);
+    }
+    // Filling the third buffer waited for the first to be written
+    struct stat written;
+    REQUIRE(stat(path.c_str(), &written) == 0);
+    REQUIRE(size_t(written.st_size) >= MAX_LOG_BUFFER_BYTES - record.size());
+    REQUIRE(fclose(stream) == 0);
+    REQUIRE(stat(path.c_str(), &written) == 0);
+    REQUIRE(size_t(written.st_size) == numRecords * record.size());
+    std::remove(path.c_str());
+  }
+  std::remove((workingDirectory + "/direct.log").c_str());
+  std::remove((workingDirectory + "/direct.tlog").c_str());
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Resuming an interrupted match from its transaction file") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const uint32_t numHandsBefore = 300;
+  const uint32_t numHands = 500;
+  // Bets with the two best cards, so the betting depends on the deal
+  const Dealer::Agent better{
+      "better",
+      [&gameDef](const MatchState &view) {
+        Action raise{a_raise, 0};
+        if (rankOfCard(view.state.holeCards[view.viewingPlayer][0]) >= 2 &&
+            isValidAction(gameDef.game_, &view.state, 0, &raise)) {
+          return raise;
+        }
+        return Action{a_call, 0};
+      },
+      nullptr};
+  const std::vector<Dealer::Agent> agents(3, better);
+  const std::string workingDirectory = newWorkingDirectory();
+  auto readLines = [](const std::string &path) {
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line)) {
+      lines.push_back(line);
+    }
+    return lines;
+  };
+  auto play = [&](const std::string &matchName, uint32_t hands, bool append,
+                  const Dealer::LogPolicy &policy) {
+    return Dealer::playMatch(matchName, gameDef, agents, workingDirectory,
+                             hands, 98723209, DEFAULT_MAX_INVALID_ACTIONS,
+                             DEFAULT_MAX_RESPONSE_MICROS,
+                             DEFAULT_MAX_USED_HAND_MICROS,
+                             DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                             append, true, true, Dealer::LogPolicy::direct(),
+                             policy);
+  };
+  REQUIRE(play("uninterrupted", numHands, false,
+               Dealer::LogPolicy::direct()) == EXIT_SUCCESS);
+  const auto expectedLog = readLines(workingDirectory + "/uninterrupted.log");
+  REQUIRE(expectedLog.size() == numHands + 1);
+
+  const std::vector<Dealer::LogPolicy> policies{
+      Dealer::LogPolicy::direct(), Dealer::LogPolicy::direct().checkpointed(64),
+      Dealer::LogPolicy::direct().checkpointed(numHandsBefore),
+      Dealer::LogPolicy::background(LOG_FLUSH_AT_CLOSE).checkpointed(50)};
+  for (size_t i = 0; i < policies.size(); ++i) {
+    const std::string matchName = "resumed." + std::to_string(i);
+    THEN("Policy " + std::to_string(i) + " carries on where the match was") {
+      REQUIRE(play(matchName, numHandsBefore, false, policies[i]) ==
+              EXIT_SUCCESS);
+      REQUIRE(play(matchName, numHands, true, policies[i]) == EXIT_SUCCESS);
+
+      // Each run logs its own hands and final values
+      const auto log = readLines(workingDirectory + "/" + matchName + ".log");
+      REQUIRE(log.size() == numHands + 2);
+      for (size_t h = 0; h < numHands; ++h) {
+        REQUIRE(log[h < numHandsBefore ? h : h + 1] == expectedLog[h]);
+      }
+      REQUIRE(log.back() == expectedLog.back());
+
+      std::remove((workingDirectory + "/" + matchName + ".log").c_str());
+      std::remove((workingDirectory + "/" + matchName + ".tlog").c_str());
+    }
+  }
+  GIVEN("Binary transaction files that end in part of a record") {
+    // As if the dealer was stopped while writing the first action of the
+    // next hand
+    const std::vector<std::string> tails{std::string("\x01\0\0\0\x05", 5),
+                                         std::string("\x02", 1)};
+    for (size_t i = 1; i < policies.size(); ++i) {
+      const std::string matchName = "partial." + std::to_string(i);
+      REQUIRE(play(matchName, numHandsBefore, false, policies[i]) ==
+              EXIT_SUCCESS);
+      const std::string tlog = workingDirectory + "/" + matchName + ".tlog";
+      std::ofstream(tlog, std::ios::app | std::ios::binary)
+          << tails[i % tails.size()];
+      THEN("Policy " + std::to_string(i) + " drops the partial record") {
+        REQUIRE(play(matchName, numHands, true, policies[i]) ==
+                EXIT_SUCCESS);
+        const auto log =
+            readLines(workingDirectory + "/" + matchName + ".log");
+        REQUIRE(log.size() == numHands + 2);
+        for (size_t h = 0; h < numHands; ++h) {
+          REQUIRE(log[h < numHandsBefore ? h : h + 1] == expectedLog[h]);
+        }
+        // and leaves a file that can be resumed again
+        REQUIRE(play(matchName, numHands, true, policies[i]) ==
+                EXIT_SUCCESS);
+      }
+      std::remove((workingDirectory + "/" + matchName + ".log").c_str());
+      std::remove(tlog.c_str());
+    }
+  }
+  GIVEN("A binary transaction file whose first record is overwritten") {
+    REQUIRE(play("overwritten", numHandsBefore, false, policies[1]) ==
+            EXIT_SUCCESS);
+    const std::string tlog = workingDirectory + "/overwritten.tlog";
+    {
+      std::fstream file(tlog, std::ios::in | std::ios::out |
+                                  std::ios::binary);
+      file.seekp(8);
+      file.write("\xff\xff\xff\xff", 4);
+      REQUIRE(file);
+    }
+    THEN("Only the records after the last checkpoint are read") {
+      REQUIRE(play("overwritten", numHands, true, policies[1]) ==
+              EXIT_SUCCESS);
+      const auto log = readLines(workingDirectory + "/overwritten.log");
+      REQUIRE(log.size() == numHands + 2);
+      for (size_t h = 0; h < numHands; ++h) {
+        REQUIRE(log[h < numHandsBefore ? h : h + 1] == expectedLog[h]);
+      }
+    }
+    std::remove((workingDirectory + "/overwritten.log").c_str());
+    std::remove(tlog.c_str());
+  }
+  GIVEN("A text transaction file") {
+    REQUIRE(play("text", 10, false, Dealer::LogPolicy::direct()) ==
+            EXIT_SUCCESS);
+    THEN("It can't be resumed as a binary one") {
+      REQUIRE(play("text", numHands, true,
+                   Dealer::LogPolicy::direct().checkpointed(64)) ==
+              EXIT_FAILURE);
+    }
+    std::remove((workingDirectory + "/text.log").c_str());
+    std::remove((workingDirectory + "/text.tlog").c_str());
+  }
+  std::remove((workingDirectory + "/uninterrupted.log").c_str());
+  std::remove((workingDirectory + "/uninterrupted.tlog").c_str());
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Recording each seat's response times") {
+  GIVEN("A latency histogram") {
+    LatencyHistogram histogram = {};
+    THEN("Short times are counted exactly") {
+      recordLatency(5, &histogram);
+      recordLatency(7, &histogram);
+      REQUIRE(histogram.numResponses == 2);
+      REQUIRE(latencyPercentile(&histogram, 50.0) == 5);
+      REQUIRE(latencyPercentile(&histogram, 100.0) == 7);
+    }
+    THEN("Long times are counted to within a bucket") {
+      for (uint64_t micros = 1; micros <= 100000; ++micros) {
+        recordLatency(micros, &histogram);
+      }
+      REQUIRE(histogram.maxMicros == 100000);
+      REQUIRE(histogram.totalMicros == uint64_t(100000) * 100001 / 2);
+      const double precision = 1.0 / LATENCY_SUB_BUCKETS;
+      for (const double percentile : {10.0, 50.0, 90.0, 99.0, 99.9}) {
+        const double expected = percentile * 1000;
+        REQUIRE(latencyPercentile(&histogram, percentile) >= expected);
+        REQUIRE(latencyPercentile(&histogram, percentile) <=
+                expected * (1 + precision));
+      }
+      REQUIRE(latencyPercentile(&histogram, 100.0) == 100000);
+    }
+    THEN("The longest times still have a bucket") {
+      recordLatency(UINT64_MAX, &histogram);
+      REQUIRE(latencyPercentile(&histogram, 50.0) == UINT64_MAX);
+    }
+  }
+  GIVEN("A match with one slow agent") {
+    const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+    const uint32_t numHands = 50;
+    size_t numSlowActions = 0;
+    std::vector<Dealer::Agent> agents(
+        3, Dealer::Agent{"fast",
+                         [](const MatchState &) { return Action{a_call, 0}; },
+                         nullptr});
+    agents[1] = Dealer::Agent{"slow",
+                              [&numSlowActions](const MatchState &) {
+                                ++numSlowActions;
+                                usleep(2000);
+                                return Action{a_call, 0};
+                              },
+                              nullptr};
+    std::vector<LatencyHistogram> latency(MAX_PLAYERS);
+    REQUIRE(Dealer::playMatch("latency", gameDef, agents, "/tmp", numHands,
+                              98723209, DEFAULT_MAX_INVALID_ACTIONS,
+                              DEFAULT_MAX_RESPONSE_MICROS,
+                              DEFAULT_MAX_USED_HAND_MICROS,
+                              DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                              false, false, false, Dealer::LogPolicy::direct(),
+                              Dealer::LogPolicy::direct(),
+                              latency.data()) == EXIT_SUCCESS);
+    THEN("Every response of every seat is recorded") {
+      for (uint8_t s = 0; s < 3; ++s) {
+        REQUIRE(latency[s].numResponses == numHands);
+      }
+      REQUIRE(numSlowActions == numHands);
+      REQUIRE(latencyPercentile(&latency[1], 1.0) >= 2000);
+      REQUIRE(latencyPercentile(&latency[0], 50.0) < 2000);
+      REQUIRE(latencyPercentile(&latency[2], 50.0) < 2000);
+    }
+  }
+}
+
+SCENARIO("Playing a match over local sockets") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::string workingDirectory = newWorkingDirectory();
+  const uint32_t numHands = 100;
+  const std::vector<std::string> players{"a", "b", "c"};
+  auto call = [](const MatchState &) { return Action{a_call, 0}; };
+
+  std::vector<int> sockets;
+  std::vector<std::thread> playerThreads;
+  auto requireSameAsInProcess = [&]() {
+    REQUIRE(Dealer::startMatch("local", gameDef, players, sockets,
+                               workingDirectory, numHands, 98723209,
+                               DEFAULT_MAX_INVALID_ACTIONS,
+                               DEFAULT_MAX_RESPONSE_MICROS,
+                               DEFAULT_MAX_USED_HAND_MICROS,
+                               DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000,
+                               false, true, false, true) == EXIT_SUCCESS);
+    for (auto &t : playerThreads) {
+      t.join();
+    }
+
+    std::vector<Dealer::Agent> agents;
+    for (const auto &player : players) {
+      agents.push_back(Dealer::Agent{player, call, nullptr});
+    }
+    REQUIRE(Dealer::playMatch("expected", gameDef, agents, workingDirectory,
+                              numHands, 98723209, DEFAULT_MAX_INVALID_ACTIONS,
+                              DEFAULT_MAX_RESPONSE_MICROS,
+                              DEFAULT_MAX_USED_HAND_MICROS,
+                              DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                              false, true) == EXIT_SUCCESS);
+    std::ifstream log(workingDirectory + "/local.log"),
+        expectedLog(workingDirectory + "/expected.log");
+    std::string line, expectedLine;
+    size_t numLines = 0;
+    while (std::getline(expectedLog, expectedLine)) {
+      REQUIRE(std::getline(log, line));
+      REQUIRE(line == expectedLine);
+      ++numLines;
+    }
+    REQUIRE(numLines == numHands + 1);
+    std::remove((workingDirectory + "/local.log").c_str());
+    std::remove((workingDirectory + "/expected.log").c_str());
+  };
+
+  GIVEN("Players that connect to unix domain sockets") {
+    std::vector<std::string> paths;
+    for (size_t s = 0; s < players.size(); ++s) {
+      paths.push_back(workingDirectory + "/seat" + std::to_string(s) +
+                      ".sock");
+      sockets.push_back(getUnixListenSocket(paths.back().c_str()));
+      REQUIRE(sockets.back() >= 0);
+      const std::string path = paths.back();
+      playerThreads.emplace_back([&gameDef, &call, path]() {
+        Configuration(gameDef, UnixSocketPath{path})
+            .forEveryMatchState(call, [](const MatchState &) {});
+      });
+    }
+    THEN("The match is the same as one played in-process") {
+      requireSameAsInProcess();
+    }
+    for (const auto &path : paths) {
+      std::remove(path.c_str());
+    }
+  }
+  GIVEN("Players that were given one end of a socketpair") {
+    for (size_t s = 0; s < players.size(); ++s) {
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      sockets.push_back(ends[0]);
+      const int playerEnd = ends[1];
+      playerThreads.emplace_back([&gameDef, &call, playerEnd]() {
+        Configuration(gameDef, ConnectedSocket{playerEnd})
+            .forEveryMatchState(call, [](const MatchState &) {});
+      });
+    }
+    THEN("The match is the same as one played in-process") {
+      requireSameAsInProcess();
+    }
+  }
+  GIVEN("Seats that never connect") {
+    int ends[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+    sockets.push_back(ends[0]);
+    std::vector<std::string> paths;
+    for (size_t s = 1; s < players.size(); ++s) {
+      paths.push_back(workingDirectory + "/seat" + std::to_string(s) +
+                      ".sock");
+      sockets.push_back(getUnixListenSocket(paths.back().c_str()));
+      REQUIRE(sockets.back() >= 0);
+    }
+    const int status = Dealer::startMatch(
+        "unseated", gameDef, players, sockets, workingDirectory, numHands,
+        98723209, DEFAULT_MAX_INVALID_ACTIONS, DEFAULT_MAX_RESPONSE_MICROS,
+        DEFAULT_MAX_USED_HAND_MICROS, DEFAULT_MAX_USED_PER_HAND_MICROS, 1000,
+        false, true, false, true, true,
+        Dealer::LogPolicy::background(LOG_FLUSH_AT_CLOSE),
+        Dealer::LogPolicy::background(LOG_FLUSH_AT_CLOSE));
+    THEN("The match fails and closes every seat's socket") {
+      REQUIRE(status == EXIT_FAILURE);
+      char c;
+      REQUIRE(recv(ends[1], &c, 1, MSG_DONTWAIT) == 0);
+      for (const auto &path : paths) {
+        REQUIRE(connectToUnixSocket(path.c_str()) < 0);
+      }
+    }
+    close(ends[1]);
+    for (const auto &path : paths) {
+      std::remove(path.c_str());
+    }
+    std::remove((workingDirectory + "/unseated.log").c_str());
+    std::remove((workingDirectory + "/unseated.tlog").c_str());
+  }
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Playing agents over shared memory") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::string workingDirectory = newWorkingDirectory();
+  const uint32_t numHands = 200;
+  // Bets with the two best cards, so the betting depends on the deal
+  auto better = [&gameDef](const MatchState &view) {
+    Action raise{a_raise, 0};
+    if (rankOfCard(view.state.holeCards[view.viewingPlayer][0]) >= 2 &&
+        isValidAction(gameDef.game_, &view.state, 0, &raise)) {
+      return raise;
+    }
+    return Action{a_call, 0};
+  };
+  std::vector<Dealer::Agent> expectedAgents;
+  for (const auto &name : {"a", "b", "c"}) {
+    expectedAgents.push_back(Dealer::Agent{name, better, nullptr});
+  }
+  REQUIRE(Dealer::playMatch("expected", gameDef, expectedAgents,
+                            workingDirectory, numHands, 98723209,
+                            DEFAULT_MAX_INVALID_ACTIONS,
+                            DEFAULT_MAX_RESPONSE_MICROS,
+                            DEFAULT_MAX_USED_HAND_MICROS,
+                            DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                            false, true) == EXIT_SUCCESS);
+  auto requireSameAsExpected = [&](const std::string &matchName) {
+    std::ifstream log(workingDirectory + "/" + matchName + ".log"),
+        expectedLog(workingDirectory + "/expected.log");
+    std::string line, expectedLine;
+    size_t numLines = 0;
+    while (std::getline(expectedLog, expectedLine)) {
+      REQUIRE(std::getline(log, line));
+      REQUIRE(line == expectedLine);
+      ++numLines;
+    }
+    REQUIRE(numLines == numHands + 1);
+    std::remove((workingDirectory + "/" + matchName + ".log").c_str());
+  };
+
+  GIVEN("Agents on threads sharing anonymous memory") {
+    std::vector<std::unique_ptr<SharedMemory<ShmChannel>>> channels;
+    std::vector<Dealer::Agent> agents;
+    std::vector<std::thread> agentThreads;
+    for (const auto &agent : expectedAgents) {
+      channels.emplace_back(new SharedMemory<ShmChannel>());
+      ShmChannel &channel = **channels.back();
+      agents.push_back(Dealer::shmAgent(agent.name, channel));
+      agentThreads.emplace_back([&gameDef, &better, &channel]() {
+        Configuration(gameDef, channel)
+            .forEveryMatchState(better, [](const MatchState &) {});
+      });
+    }
+    THEN("The match is the same as one played in-process") {
+      REQUIRE(Dealer::playMatch("threads", gameDef, agents,
+                                workingDirectory, numHands, 98723209,
+                                DEFAULT_MAX_INVALID_ACTIONS,
+                                DEFAULT_MAX_RESPONSE_MICROS,
+                                DEFAULT_MAX_USED_HAND_MICROS,
+                                DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                                false, true) == EXIT_SUCCESS);
+      requireSameAsExpected("threads");
+    }
+    for (auto &channel : channels) {
+      Dealer::endShmMatch(**channel);
+    }
+    for (auto &t : agentThreads) {
+      t.join();
+    }
+  }
+  GIVEN("Agents in other processes sharing named memory") {
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<SharedMemory<ShmChannel>>> channels;
+    std::vector<Dealer::Agent> agents;
+    std::vector<pid_t> children;
+    for (size_t s = 0; s < expectedAgents.size(); ++s) {
+      names.push_back("/acpc_match_log_test." + std::to_string(getpid()) +
+                      "." + std::to_string(s));
+    }
+    // The agents are started first, so they wait for the memory to be
+    // created and constructed
+    for (size_t s = 0; s < expectedAgents.size(); ++s) {
+      const pid_t child = fork();
+      if (child == 0) {
+        SharedMemory<ShmChannel> channel(names[s], false);
+        Configuration(gameDef, *channel)
+            .forEveryMatchState(better, [](const MatchState &) {});
+        _exit(EXIT_SUCCESS);
+      }
+      REQUIRE(child > 0);
+      children.push_back(child);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (size_t s = 0; s < expectedAgents.size(); ++s) {
+      channels.emplace_back(new SharedMemory<ShmChannel>(names[s], true));
+      agents.push_back(Dealer::shmAgent(expectedAgents[s].name,
+                                        **channels.back()));
+    }
+    THEN("The match is the same as one played in-process") {
+      REQUIRE(Dealer::playMatch("processes", gameDef, agents,
+                                workingDirectory, numHands, 98723209,
+                                DEFAULT_MAX_INVALID_ACTIONS,
+                                DEFAULT_MAX_RESPONSE_MICROS,
+                                DEFAULT_MAX_USED_HAND_MICROS,
+                                DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                                false, true) == EXIT_SUCCESS);
+      requireSameAsExpected("processes");
+    }
+    for (auto &channel : channels) {
+      Dealer::endShmMatch(**channel);
+    }
+    for (const auto child : children) {
+      int status;
+      REQUIRE(waitpid(child, &status, 0) == child);
+      REQUIRE(WIFEXITED(status));
+      REQUIRE(WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+  }
+  GIVEN("Named memory that is never created") {
+    const std::string name =
+        "/acpc_match_log_test." + std::to_string(getpid()) + ".missing";
+    THEN("Opening it times out") {
+      REQUIRE_THROWS_AS(SharedMemory<ShmChannel>(name, false, 20000),
+                        std::runtime_error);
+    }
+  }
+  std::remove((workingDirectory + "/expected.log").c_str());
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Playing a match from cards dealt ahead of time") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const uint32_t numHands = 200;
+  const uint32_t seed = 98723209;
+  // Bets with the two best cards, so the betting depends on the deal
+  const Dealer::Agent better{
+      "better",
+      [&gameDef](const MatchState &view) {
+        Action raise{a_raise, 0};
+        if (rankOfCard(view.state.holeCards[view.viewingPlayer][0]) >= 2 &&
+            isValidAction(gameDef.game_, &view.state, 0, &raise)) {
+          return raise;
+        }
+        return Action{a_call, 0};
+      },
+      nullptr};
+  const std::vector<Dealer::Agent> agents(3, better);
+  const std::string workingDirectory = newWorkingDirectory();
+  auto readLines = [](const std::string &path) {
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line)) {
+      lines.push_back(line);
+    }
+    return lines;
+  };
+  auto play = [&](const std::string &matchName, uint32_t matchSeed,
+                  const Dealer::Deals *deals) {
+    return Dealer::playMatch(matchName, gameDef, agents, workingDirectory,
+                             numHands, matchSeed, DEFAULT_MAX_INVALID_ACTIONS,
+                             DEFAULT_MAX_RESPONSE_MICROS,
+                             DEFAULT_MAX_USED_HAND_MICROS,
+                             DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                             false, true, false, Dealer::LogPolicy::direct(),
+                             Dealer::LogPolicy::direct(), NULL, deals);
+  };
+  REQUIRE(play("dealt", seed, nullptr) == EXIT_SUCCESS);
+  const auto expectedLog = readLines(workingDirectory + "/dealt.log");
+  REQUIRE(expectedLog.size() == numHands + 1);
+
+  const auto deals = Dealer::Deals::generate(gameDef, seed, numHands);
+  REQUIRE(deals.numHands() == numHands);
+  REQUIRE(deals.cards().size() == numHands * 3);
+
+  GIVEN("The deals of the match's seed") {
+    THEN("The match is the same, whatever its seed") {
+      REQUIRE(play("scheduled", seed + 1, &deals) == EXIT_SUCCESS);
+      REQUIRE(readLines(workingDirectory + "/scheduled.log") == expectedLog);
+      std::remove((workingDirectory + "/scheduled.log").c_str());
+    }
+  }
+  GIVEN("Deals generated for several seeds at once") {
+    const auto manyDeals =
+        Dealer::Deals::generate(gameDef, {seed + 1, seed, seed + 2}, numHands);
+    THEN("Each matches the deals of its seed") {
+      REQUIRE(manyDeals.size() == 3);
+      REQUIRE(manyDeals[1].cards() == deals.cards());
+      REQUIRE(manyDeals[0].cards() ==
+              Dealer::Deals::generate(gameDef, seed + 1, numHands).cards());
+      REQUIRE(manyDeals[0].cards() != deals.cards());
+    }
+  }
+  GIVEN("Deals generated for more seeds than there are hardware threads") {
+    std::vector<uint32_t> seeds;
+    for (uint32_t i = 0; i < 4 * std::thread::hardware_concurrency() + 3;
+         ++i) {
+      seeds.push_back(seed + i);
+    }
+    const auto manyDeals = Dealer::Deals::generate(gameDef, seeds, 20);
+    THEN("Each matches the deals of its seed") {
+      REQUIRE(manyDeals.size() == seeds.size());
+      for (size_t i = 0; i < seeds.size(); ++i) {
+        REQUIRE(manyDeals[i].cards() ==
+                Dealer::Deals::generate(gameDef, seeds[i], 20).cards());
+      }
+    }
+  }
+  GIVEN("Deals saved to a file") {
+    const std::string path = workingDirectory + "/match.deals";
+    deals.save(path);
+    THEN("They load the same for the same game") {
+      const auto loaded = Dealer::Deals::load(path, gameDef);
+      REQUIRE(loaded.numHands() == numHands);
+      REQUIRE(loaded.cards() == deals.cards());
+      REQUIRE(play("loaded", seed, &loaded) == EXIT_SUCCESS);
+      REQUIRE(readLines(workingDirectory + "/loaded.log") == expectedLog);
+      std::remove((workingDirectory + "/loaded.log").c_str());
+    }
+    std::remove(path.c_str());
+  }
+  GIVEN("Too few deals for the match") {
+    const auto fewDeals = Dealer::Deals::generate(gameDef, seed, numHands - 1);
+    THEN("The match fails before it starts") {
+      REQUIRE(play("short", seed, &fewDeals) == EXIT_FAILURE);
+      std::remove((workingDirectory + "/short.log").c_str());
+    }
+  }
+  std::remove((workingDirectory + "/dealt.log").c_str());
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Formatting state messages from the parts seats share") {
+  const std::string vendorDirectory = acpcServerDirectory();
+  for (const std::string gameFile :
+       {"kuhn.limit.3p.game", "holdem.limit.3p.game",
+        "holdem.nolimit.2p.reverse_blinds.game"}) {
+    GIVEN("Random hands of " + gameFile) {
+      const GameDef gameDef(vendorDirectory + gameFile);
+      const Game *game = gameDef.game();
+      rng_state_t rng;
+      init_genrand(&rng, 98723209);
+      std::mt19937 choices(1);
+      StateMessageFormatter formatter;
+      initStateMessageFormatter(&formatter);
+
+      THEN("Every seat's message is the same as printMatchState's") {
+        auto requireSameMessages = [&](const State &state) {
+          for (uint8_t p = 0; p < game->numPlayers; ++p) {
+            MatchState view;
+            view.state = state;
+            view.viewingPlayer = p;
+            char expected[MAX_LINE_LEN];
+            char message[MAX_LINE_LEN];
+            const int length =
+                printMatchState(game, &view, MAX_LINE_LEN, expected);
+            REQUIRE(printStateMessage(&formatter, game, &view, MAX_LINE_LEN,
+                                      message) == length);
+            REQUIRE(std::string(message) == std::string(expected));
+          }
+        };
+        for (uint32_t h = 0; h < 200; ++h) {
+          State state;
+          initState(game, h, &state);
+          dealCards(game, &rng, &state);
+          requireSameMessages(state);
+          while (!stateFinished(&state)) {
+            Action action{ActionType(choices() % 3), 0};
+            int32_t minSize, maxSize;
+            if (action.type == a_raise &&
+                raiseIsValid(game, &state, &minSize, &maxSize)) {
+              action.size = minSize + choices() % (maxSize - minSize + 1);
+            }
+            if (!isValidAction(game, &state, 0, &action)) {
+              action = Action{a_call, 0};
+            }
+            doAction(game, &action, &state);
+            requireSameMessages(state);
+          }
+        }
+      }
+    }
+  }
+}
+
+SCENARIO("Playing many matches from one asynchronous client") {
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::string workingDirectory = newWorkingDirectory();
+  const uint32_t numHands = 100;
+  const size_t numMatches = 4;
+  const std::vector<std::string> players{"a", "b", "c"};
+  // Bets with the two best cards, so the betting depends on the deal
+  auto better = [&gameDef](const MatchState &view) {
+    Action raise{a_raise, 0};
+    if (rankOfCard(view.state.holeCards[view.viewingPlayer][0]) >= 2 &&
+        isValidAction(gameDef.game_, &view.state, 0, &raise)) {
+      return raise;
+    }
+    return Action{a_call, 0};
+  };
+
+  GIVEN("Matches whose seats are all played by the client") {
+    AsyncClient client(3);
+    std::vector<std::vector<int>> sockets(numMatches);
+    std::vector<size_t> numHandsSeen(numMatches * players.size(), 0);
+    for (size_t m = 0; m < numMatches; ++m) {
+      for (size_t s = 0; s < players.size(); ++s) {
+        int ends[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+        sockets[m].push_back(ends[0]);
+        size_t &seen = numHandsSeen[m * players.size() + s];
+        client.addMatch(gameDef, ConnectedSocket{ends[1]}, better,
+                        [&seen](const MatchState &) { ++seen; });
+      }
+    }
+    std::vector<int> status(numMatches, EXIT_FAILURE);
+    std::vector<std::thread> dealers;
+    for (size_t m = 0; m < numMatches; ++m) {
+      dealers.emplace_back([&, m]() {
+        status[m] = Dealer::startMatch(
+            "async." + std::to_string(m), gameDef, players, sockets[m],
+            workingDirectory, numHands, 98723209 + m,
+            DEFAULT_MAX_INVALID_ACTIONS, DEFAULT_MAX_RESPONSE_MICROS,
+            DEFAULT_MAX_USED_HAND_MICROS, DEFAULT_MAX_USED_PER_HAND_MICROS,
+            10000000, false, true, false, true);
+      });
+    }
+    client.run();
+    for (auto &t : dealers) {
+      t.join();
+    }
+
+    THEN("Every match is the same as one played in-process") {
+      REQUIRE(client.numRunningMatches() == 0);
+      for (size_t c = 0; c < client.numMatches(); ++c) {
+        REQUIRE(client.status(c) == EXIT_SUCCESS);
+        REQUIRE(numHandsSeen[c] == numHands);
+      }
+      for (size_t m = 0; m < numMatches; ++m) {
+        REQUIRE(status[m] == EXIT_SUCCESS);
+        std::vector<Dealer::Agent> agents;
+        for (const auto &player : players) {
+          agents.push_back(Dealer::Agent{player, better, nullptr});
+        }
+        REQUIRE(Dealer::playMatch("expected", gameDef, agents,
+                                  workingDirectory, numHands, 98723209 + m,
+                                  DEFAULT_MAX_INVALID_ACTIONS,
+                                  DEFAULT_MAX_RESPONSE_MICROS,
+                                  DEFAULT_MAX_USED_HAND_MICROS,
+                                  DEFAULT_MAX_USED_PER_HAND_MICROS, false,
+                                  true, false, true) == EXIT_SUCCESS);
+        const std::string logPath =
+            workingDirectory + "/async." + std::to_string(m) + ".log";
+        std::ifstream log(logPath),
+            expectedLog(workingDirectory + "/expected.log");
+        std::string line, expectedLine;
+        size_t numLines = 0;
+        while (std::getline(expectedLog, expectedLine)) {
+          REQUIRE(std::getline(log, line));
+          REQUIRE(line == expectedLine);
+          ++numLines;
+        }
+        REQUIRE(numLines == numHands + 1);
+        std::remove(logPath.c_str());
+        std::remove((workingDirectory + "/expected.log").c_str());
+      }
+    }
+  }
+  GIVEN("An agent that throws") {
+    AsyncClient client(2);
+    std::vector<int> sockets;
+    for (size_t s = 0; s < players.size(); ++s) {
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      sockets.push_back(ends[0]);
+      if (s == 1) {
+        client.addMatch(gameDef, ConnectedSocket{ends[1]},
+                        [](const MatchState &) -> Action {
+                          throw std::runtime_error("agent failed");
+                        });
+      } else {
+        client.addMatch(gameDef, ConnectedSocket{ends[1]}, better);
+      }
+    }
+    int status = EXIT_SUCCESS;
+    std::thread dealer([&]() {
+      status = Dealer::startMatch("throws", gameDef, players, sockets,
+                                  workingDirectory, numHands);
+    });
+    client.run();
+    dealer.join();
+    THEN("Only its connection fails, and the dealer ends the match") {
+      REQUIRE(client.status(1) == EXIT_FAILURE);
+      REQUIRE(client.error(1) == "agent failed");
+      REQUIRE(status == EXIT_FAILURE);
+    }
+  }
+  GIVEN("A dealer that stops reading while it sends many states") {
+    AsyncClient client(2);
+    int stalled[2], live[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, stalled) == 0);
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, live) == 0);
+    // So the client can't send every response at once
+    const int bufferSize = 4096;
+    REQUIRE(setsockopt(stalled[1], SOL_SOCKET, SO_SNDBUF, &bufferSize,
+                       sizeof(bufferSize)) == 0);
+    auto call = [](const MatchState &) { return Action{a_call, 0}; };
+    client.addMatch(gameDef, ConnectedSocket{stalled[1]}, call);
+    client.addMatch(gameDef, ConnectedSocket{live[1]}, call);
+
+    // Reads from @p fd until @p numLines lines have arrived, for at most
+    // a few seconds
+    auto readLines = [](int fd, size_t numLines) {
+      std::string lines;
+      char buffer[4096];
+      while (size_t(std::count(lines.begin(), lines.end(), '\n')) <
+             numLines) {
+        pollfd readable{fd, POLLIN, 0};
+        if (poll(&readable, 1, 5000) <= 0) {
+          break;
+        }
+        const ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+          break;
+        }
+        lines.append(buffer, n);
+      }
+      return lines;
+    };
+    const size_t numStates = 5000;
+    std::atomic<bool> liveAnswered(false);
+    std::string stalledResponses, liveResponse;
+    std::thread stalledDealer([&]() {
+      std::string states;
+      for (size_t h = 0; h < numStates; ++h) {
+        states += "MATCHSTATE:0:" + std::to_string(h) + "::Ks||\r\n";
+      }
+      if (write(stalled[0], states.data(), states.size()) ==
+          ssize_t(states.size())) {
+        // The responses are only read once the other match has been
+        // answered
+        while (!liveAnswered) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        stalledResponses = readLines(stalled[0], numStates + 1);
+      }
+      close(stalled[0]);
+    });
+    std::thread liveDealer([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      const std::string state = "MATCHSTATE:0:0::Qs||\r\n";
+      if (write(live[0], state.data(), state.size()) ==
+          ssize_t(state.size())) {
+        liveResponse = readLines(live[0], 2);
+      }
+      liveAnswered = true;
+      close(live[0]);
+    });
+    client.run();
+    stalledDealer.join();
+    liveDealer.join();
+    THEN("The other match is answered, and every response is sent in "
+         "order") {
+      REQUIRE(liveResponse.find("MATCHSTATE:0:0::Qs||:c\r\n") !=
+              std::string::npos);
+      // after the version
+      REQUIRE(stalledResponses.compare(0, 8, "VERSION:") == 0);
+      std::string expected;
+      for (size_t h = 0; h < numStates; ++h) {
+        expected += "MATCHSTATE:0:" + std::to_string(h) + "::Ks||:c\r\n";
+      }
+      REQUIRE(stalledResponses.substr(stalledResponses.find('\n') + 1) ==
+              expected);
+      REQUIRE(client.status(0) == EXIT_SUCCESS);
+      REQUIRE(client.status(1) == EXIT_SUCCESS);
+    }
+  }
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Reading state messages where they arrive") {
+  const std::string vendorDirectory = acpcServerDirectory();
+  for (const std::string gameFile :
+       {"kuhn.limit.3p.game", "holdem.nolimit.2p.reverse_blinds.game"}) {
+    GIVEN("The messages of random hands of " + gameFile + " to one player") {
+      const GameDef gameDef(vendorDirectory + gameFile);
+      const Game *game = gameDef.game();
+      rng_state_t rng;
+      init_genrand(&rng, 98723209);
+      std::mt19937 choices(1);
+
+      std::vector<std::string> messages;
+      for (uint32_t h = 0; h < 100; ++h) {
+        MatchState view;
+        view.viewingPlayer = h % game->numPlayers;
+        initState(game, h, &view.state);
+        dealCards(game, &rng, &view.state);
+        while (true) {
+          char line[MAX_LINE_LEN];
+          printMatchState(game, &view, MAX_LINE_LEN, line);
+          messages.push_back(line);
+          if (stateFinished(&view.state)) {
+            break;
+          }
+          Action action{ActionType(choices() % 3), 0};
+          int32_t minSize, maxSize;
+          if (action.type == a_raise &&
+              raiseIsValid(game, &view.state, &minSize, &maxSize)) {
+            action.size = minSize + choices() % (maxSize - minSize + 1);
+          }
+          if (!isValidAction(game, &view.state, 0, &action)) {
+            action = Action{a_call, 0};
+          }
+          doAction(game, &action, &view.state);
+        }
+      }
+
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      // Sends each message in two pieces, with a comment now and then
+      bool sent = true;
+      std::thread dealer([&messages, &ends, &sent]() {
+        for (size_t i = 0; i < messages.size() && sent; ++i) {
+          std::string message = messages[i] + "\r\n";
+          if (i % 7 == 0) {
+            message = "# comment\n" + message;
+          }
+          const size_t half = message.size() / 2;
+          sent = write(ends[0], message.data(), half) == ssize_t(half) &&
+                 write(ends[0], message.data() + half,
+                       message.size() - half) ==
+                     ssize_t(message.size() - half);
+        }
+        close(ends[0]);
+      });
+
+      THEN("Each is framed and decoded like readMatchState") {
+        MatchState state;
+        MatchStateReader reader(game, &state);
+        size_t i = 0;
+        int len;
+        while ((len = reader.next(ends[1])) > 0) {
+          REQUIRE(i < messages.size());
+          REQUIRE(std::string(reader.line()) == messages[i]);
+          REQUIRE(len == int(messages[i].size()));
+
+          MatchState expected;
+          REQUIRE(readMatchState(messages[i].c_str(), game, &expected) > 0);
+          REQUIRE(reader.handId() == expected.state.handId);
+          REQUIRE(reader.viewingPlayer() == expected.viewingPlayer);
+          REQUIRE(reader.handFinished() ==
+                  bool(stateFinished(&expected.state)));
+          REQUIRE(reader.mustAct() ==
+                  (!stateFinished(&expected.state) &&
+                   currentPlayer(game, &expected.state) ==
+                       expected.viewingPlayer));
+          if (i % 3 == 0 || reader.handFinished()) {
+            REQUIRE(reader.parse());
+            REQUIRE(gameDef.toString(state) == messages[i]);
+          }
+          ++i;
+        }
+        REQUIRE(len == 0);
+        REQUIRE(i == messages.size());
+      }
+      dealer.join();
+      close(ends[1]);
+      REQUIRE(sent);
+    }
+  }
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  for (const std::string badBetting : {"rr", "cccc"}) {
+    GIVEN("A message whose betting " + badBetting + " the game does not "
+                                                    "allow") {
+      const std::string messages =
+          "MATCHSTATE:0:0::Ks||\nMATCHSTATE:0:0:" + badBetting + ":Ks||\n";
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      REQUIRE(write(ends[0], messages.data(), messages.size()) ==
+              ssize_t(messages.size()));
+      close(ends[0]);
+      THEN("It is not decoded") {
+        MatchState state;
+        MatchStateReader reader(gameDef.game(), &state);
+        REQUIRE(reader.next(ends[1]) > 0);
+        REQUIRE(reader.next(ends[1]) == -1);
+      }
+      close(ends[1]);
+    }
+  }
+}
+
+SCENARIO("Speculating while opponents act") {
+  GIVEN("A speculation slot") {
+    SpeculationSlot slot;
+    std::atomic<int> numStarted(0), numReturned(0);
+    auto spin = [&](const std::atomic<bool> &cancelled) {
+      ++numStarted;
+      while (!cancelled) {
+        std::this_thread::yield();
+      }
+      ++numReturned;
+    };
+    THEN("Starting a task cancels the one before it") {
+      slot.start(spin);
+      slot.start(spin);
+      slot.cancel();
+      REQUIRE(numReturned == numStarted);
+      REQUIRE(numStarted <= 2);
+    }
+    THEN("What a task throws is rethrown once it is cancelled") {
+      std::atomic<bool> ran(false);
+      slot.start([&ran](const std::atomic<bool> &) {
+        ran = true;
+        throw std::runtime_error("speculation failed");
+      });
+      while (!ran) {
+        std::this_thread::yield();
+      }
+      REQUIRE_THROWS_AS(slot.cancel(), std::runtime_error);
+      slot.start(spin);
+      slot.cancel();
+      REQUIRE(numReturned == numStarted);
+    }
+  }
+
+  const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+  const std::string workingDirectory = newWorkingDirectory();
+  const uint32_t numHands = 100;
+  const std::vector<std::string> players{"a", "b", "c"};
+  auto call = [](const MatchState &) { return Action{a_call, 0}; };
+  std::vector<Dealer::Agent> expectedAgents;
+  for (const auto &player : players) {
+    expectedAgents.push_back(Dealer::Agent{player, call, nullptr});
+  }
+  REQUIRE(Dealer::playMatch("expected", gameDef, expectedAgents,
+                            workingDirectory, numHands, 98723209,
+                            DEFAULT_MAX_INVALID_ACTIONS,
+                            DEFAULT_MAX_RESPONSE_MICROS,
+                            DEFAULT_MAX_USED_HAND_MICROS,
+                            DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                            false, true) == EXIT_SUCCESS);
+
+  // Agent s spins on its slot until cancelled, and notes any of its
+  // callbacks that run while its slot is busy, or any state it is handed to
+  // speculate on in which it must act
+  std::atomic<bool> speculating[3];
+  for (auto &agentSpeculating : speculating) {
+    agentSpeculating = false;
+  }
+  std::atomic<bool> overlapped(false), wrongState(false);
+  std::atomic<int> numStarted(0), numReturned(0);
+  auto playSpeculating = [&](size_t s, Configuration &&configuration) {
+    auto act = [&, s](const MatchState &view) {
+      if (speculating[s]) {
+        overlapped = true;
+      }
+      return call(view);
+    };
+    auto endHand = [&, s](const MatchState &) {
+      if (speculating[s]) {
+        overlapped = true;
+      }
+    };
+    auto whileOpponentActs = [&, s](const MatchState &view,
+                                    const std::atomic<bool> &cancelled) {
+      ++numStarted;
+      speculating[s] = true;
+      if (stateFinished(&view.state) ||
+          currentPlayer(gameDef.game_, &view.state) == view.viewingPlayer) {
+        wrongState = true;
+      }
+      while (!cancelled) {
+        std::this_thread::yield();
+      }
+      speculating[s] = false;
+      ++numReturned;
+    };
+    configuration.forEveryMatchState(act, endHand, whileOpponentActs);
+  };
+  auto requireSameAsExpected = [&](const std::string &matchName) {
+    std::ifstream log(workingDirectory + "/" + matchName + ".log"),
+        expectedLog(workingDirectory + "/expected.log");
+    std::string line, expectedLine;
+    size_t numLines = 0;
+    while (std::getline(expectedLog, expectedLine)) {
+      REQUIRE(std::getline(log, line));
+      REQUIRE(line == expectedLine);
+      ++numLines;
+    }
+    REQUIRE(numLines == numHands + 1);
+    std::remove((workingDirectory + "/" + matchName + ".log").c_str());
+  };
+  auto requireSpeculatedApart = [&]() {
+    REQUIRE(numStarted > 0);
+    REQUIRE(numReturned == numStarted);
+    REQUIRE_FALSE(overlapped);
+    REQUIRE_FALSE(wrongState);
+  };
+
+  GIVEN("Speculating agents on sockets") {
+    std::vector<int> sockets;
+    std::vector<std::thread> playerThreads;
+    for (size_t s = 0; s < players.size(); ++s) {
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      sockets.push_back(ends[0]);
+      const int playerEnd = ends[1];
+      playerThreads.emplace_back([&, s, playerEnd]() {
+        playSpeculating(s, Configuration(gameDef, ConnectedSocket{playerEnd}));
+      });
+    }
+    THEN("They speculate only while they wait, and play the same match") {
+      REQUIRE(Dealer::startMatch("sockets", gameDef, players, sockets,
+                                 workingDirectory, numHands, 98723209,
+                                 DEFAULT_MAX_INVALID_ACTIONS,
+                                 DEFAULT_MAX_RESPONSE_MICROS,
+                                 DEFAULT_MAX_USED_HAND_MICROS,
+                                 DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000,
+                                 false, true, false, true) == EXIT_SUCCESS);
+      for (auto &t : playerThreads) {
+        t.join();
+      }
+      requireSameAsExpected("sockets");
+      requireSpeculatedApart();
+    }
+  }
+  GIVEN("Speculating agents on shared memory") {
+    std::vector<std::unique_ptr<SharedMemory<ShmChannel>>> channels;
+    std::vector<Dealer::Agent> agents;
+    std::vector<std::thread> agentThreads;
+    for (size_t s = 0; s < players.size(); ++s) {
+      channels.emplace_back(new SharedMemory<ShmChannel>());
+      ShmChannel *channel = channels.back()->get();
+      agents.push_back(Dealer::shmAgent(players[s], *channel));
+      agentThreads.emplace_back([&, s, channel]() {
+        playSpeculating(s, Configuration(gameDef, *channel));
+      });
+    }
+    THEN("They speculate only while they wait, and play the same match") {
+      REQUIRE(Dealer::playMatch("shm", gameDef, agents, workingDirectory,
+                                numHands, 98723209,
+                                DEFAULT_MAX_INVALID_ACTIONS,
+                                DEFAULT_MAX_RESPONSE_MICROS,
+                                DEFAULT_MAX_USED_HAND_MICROS,
+                                DEFAULT_MAX_USED_PER_HAND_MICROS, false, true,
+                                false, true) == EXIT_SUCCESS);
+      for (auto &channel : channels) {
+        Dealer::endShmMatch(**channel);
+      }
+      for (auto &t : agentThreads) {
+        t.join();
+      }
+      requireSameAsExpected("shm");
+      requireSpeculatedApart();
+    }
+  }
+  std::remove((workingDirectory + "/expected.log").c_str());
+  rmdir(workingDirectory.c_str());
+}
+
+SCENARIO("Budgeting an agent's time by the dealer's limits") {
+  GIVEN("A budget for a match of two hands") {
+    // 100 ms a response, 150 ms a hand, and 100 ms a hand over the match
+    TimeBudget budget(TimeLimits::ofMatch(2, 100000, 150000, 100000), 10000);
+    const auto t0 = TimeBudget::Clock::now();
+    auto at = [t0](int64_t micros) {
+      return t0 + std::chrono::microseconds(micros);
+    };
+    THEN("Each deadline keeps within the tightest limit less the margin") {
+      budget.startDecision(at(0));
+      REQUIRE(budget.deadline() == at(90000));
+      budget.endDecision(at(80000));
+      REQUIRE(budget.usedHandMicros() == 80000);
+
+      budget.startDecision(at(100000));
+      REQUIRE(budget.deadline() == at(100000 + 60000));
+      // Half of the match is this hand's share
+      REQUIRE(budget.pacedDeadline() == at(100000 + 10000));
+      budget.endDecision(at(130000));
+      REQUIRE(budget.usedHandMicros() == 110000);
+      REQUIRE(budget.usedMatchMicros() == 110000);
+
+      budget.endHand();
+      REQUIRE(budget.numHandsFinished() == 1);
+      REQUIRE(budget.usedHandMicros() == 0);
+      budget.startDecision(at(200000));
+      REQUIRE(budget.deadline() == at(200000 + 80000));
+      REQUIRE(budget.pacedDeadline() == budget.deadline());
+
+      // Clocks that run backwards charge nothing
+      budget.endDecision(at(150000));
+      REQUIRE(budget.usedMatchMicros() == 110000);
+
+      budget.startDecision(at(300000));
+      budget.endDecision(at(400000));
+      REQUIRE(budget.remainingMatchMicros() == 0);
+      REQUIRE(budget.deadline() == at(300000));
+    }
+  }
+
+  GIVEN("Agents that think until their deadlines in a match with tight "
+        "limits") {
+    const GameDef gameDef = new3PlayerLimitKuhnGameDef();
+    const std::string workingDirectory = newWorkingDirectory();
+    const uint32_t numHands = 10;
+    const uint64_t maxResponseMicros = 60000;
+    const uint64_t maxUsedHandMicros = 90000;
+    const std::vector<std::string> players{"a", "b", "c"};
+    // The last to act raises, so the others act twice in a hand
+    auto thinkThenAct = [&gameDef](const MatchState &view,
+                                   const TimeBudget &budget) {
+      while (TimeBudget::Clock::now() < budget.deadline()) {
+        std::this_thread::yield();
+      }
+      Action raise{a_raise, 0};
+      if (view.state.numActions[0] == gameDef.game_->numPlayers - 1 &&
+          isValidAction(gameDef.game_, &view.state, 0, &raise)) {
+        return raise;
+      }
+      return Action{a_call, 0};
+    };
+
+    std::vector<int> sockets;
+    std::vector<std::thread> playerThreads;
+    std::vector<uint64_t> maxUsedHandMicrosSeen(players.size(), 0);
+    for (size_t s = 0; s < players.size(); ++s) {
+      int ends[2];
+      REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == 0);
+      sockets.push_back(ends[0]);
+      const int playerEnd = ends[1];
+      playerThreads.emplace_back([&, s, playerEnd]() {
+        Configuration configuration(gameDef, ConnectedSocket{playerEnd});
+        configuration.setTimeLimits(
+            TimeLimits::ofMatch(numHands, maxResponseMicros,
+                                maxUsedHandMicros),
+            20000);
+        configuration.forEveryMatchState(
+            [&, s](const MatchState &view, const TimeBudget &budget) {
+              maxUsedHandMicrosSeen[s] = std::max(maxUsedHandMicrosSeen[s],
+                                                  budget.usedHandMicros());
+              return thinkThenAct(view, budget);
+            },
+            [](const MatchState &) {});
+      });
+    }
+    THEN("None of them runs out of time, though they use a whole response's "
+         "allowance before acting again in a hand") {
+      REQUIRE(Dealer::startMatch("budgeted", gameDef, players, sockets,
+                                 workingDirectory, numHands, 98723209,
+                                 DEFAULT_MAX_INVALID_ACTIONS,
+                                 maxResponseMicros, maxUsedHandMicros,
+                                 DEFAULT_MAX_USED_PER_HAND_MICROS, 10000000,
+                                 false, true, false, true) == EXIT_SUCCESS);
+      for (auto &t : playerThreads) {
+        t.join();
+      }
+      for (const auto used : maxUsedHandMicrosSeen) {
+        REQUIRE(used >= maxResponseMicros - 20000);
+      }
+    }
+    std::remove((workingDirectory + "/budgeted.log").c_str());
+    rmdir(workingDirectory.c_str());
+  }
+}
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN // This tells Catch to provide a main() - only do this
+                          // in one cpp file
+#include <test_helper.hpp>
+
+#include <lib/acpc.hpp>
+#include <lib/best_response.hpp>
+#include <lib/game_tree.hpp>
+#include <lib/info_set_layout.hpp>
+#include <lib/mccfr.hpp>
+
+using namespace AcpcMatchLog;
+using namespace Acpc;
+
+SCENARIO("Laying out the information sets of a game") {
+  const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
+  const GameTree tree(myGameDef);
+  const InfoSetLayout patient(tree);
+  THEN("Every decision node has one information set per hole card") {
+    REQUIRE(patient.numInfoSets() == tree.numDecisionNodes() * 4);
+    REQUIRE(patient.infoSetIndex(GameTree::ROOT, 3) == 3);
+    REQUIRE(patient.size() == patient.numInfoSets() * 2);
+  }
+  THEN("The uniform strategy is a distribution in every information set") {
+    const std::vector<double> strategy = patient.uniformStrategy();
+    for (size_t n = 0; n < tree.size(); ++n) {
+      if (tree[n].isTerminal()) {
+        continue;
+      }
+      for (size_t v = 0; v < patient.numCardViews(n); ++v) {
+        for (size_t a = 0; a < patient.numActions(n); ++a) {
+          REQUIRE(strategy[patient.offset(n, v) + a] ==
+                  Approx(1.0 / patient.numActions(n)));
+        }
+      }
+    }
+  }
+}
+
+SCENARIO("Solving three player Kuhn poker with outcome sampling MCCFR") {
+  const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
+  const GameTree tree(myGameDef);
+  const InfoSetLayout layout(tree);
+  GIVEN("A solver run across several threads") {
+    OutcomeSamplingMccfr patient(layout, 98723209);
+    patient.run(200000, 4);
+    REQUIRE(patient.numIterations() == 200000);
+
+    const std::vector<double> strategy = patient.averageStrategy();
+    THEN("Dominated calls and folds are avoided") {
+      const size_t jack = myGameDef.cardIndex(makeCard(9, 3));
+      const size_t ace = myGameDef.cardIndex(makeCard(12, 3));
+      for (size_t n = 0; n < tree.size(); ++n) {
+        if (tree[n].isTerminal() || tree[n].child(a_fold) < 0) {
+          continue;
+        }
+        // Facing a bet, the jack never wins and the ace never loses
+        const size_t fold = layout.actionSlot(n, a_fold);
+        const size_t call = layout.actionSlot(n, a_call);
+        REQUIRE(strategy[layout.offset(n, jack) + fold] > 0.9);
+        REQUIRE(strategy[layout.offset(n, ace) + call] > 0.9);
+      }
+    }
+  }
+  GIVEN("A solver run across many threads") {
+    // Exposes the sums the average strategy is normalized from
+    class Solver : public OutcomeSamplingMccfr {
+    public:
+      using OutcomeSamplingMccfr::OutcomeSamplingMccfr;
+      double largestAverageStrategySum() const {
+        const std::vector<double> sums(load(averageStrategySums_.get()));
+        return *std::max_element(sums.begin(), sums.end());
+      }
+    };
+    const uint64_t numIterations = 100000;
+    Solver patient(layout, 98723209);
+    patient.run(numIterations, 8);
+    THEN("No information set is credited more iterations than were run") {
+      // Each credit is the iterations since the last visit times a reach
+      // probability of at most one
+      REQUIRE(patient.largestAverageStrategySum() > 0.0);
+      REQUIRE(patient.largestAverageStrategySum() <= double(numIterations));
+    }
+  }
+}
+
+SCENARIO("Evaluating strategies against best responses") {
+  const GameDef myGameDef = new3PlayerLimitKuhnGameDef();
+  const GameTree tree(myGameDef);
+  const InfoSetLayout layout(tree);
+  const BestResponse patient(layout);
+  REQUIRE(patient.numDeals() == 4 * 3 * 2);
+
+  GIVEN("The uniform strategy") {
+    const std::vector<double> uniform = layout.uniformStrategy();
+    THEN("The game is zero-sum") {
+      double total = 0.0;
+      for (uint8_t p = 0; p < 3; ++p) {
+        total += patient.value(uniform, p);
+      }
+      REQUIRE(total == Approx(0.0).margin(1e-12));
+    }
+    THEN("Best responses do at least as well as the strategy") {
+      for (uint8_t p = 0; p < 3; ++p) {
+        REQUIRE(patient.bestResponseValue(uniform, p) >=
+                patient.value(uniform, p));
+      }
+    }
+    THEN("Threads do not change the result") {
+      REQUIRE(patient.exploitability(uniform, 1) ==
+              Approx(patient.exploitability(uniform, 8)));
+    }
+    GIVEN("An MCCFR average strategy") {
+      OutcomeSamplingMccfr solver(layout, 98723209);
+      solver.run(200000, 4);
+      THEN("It is much less exploitable than uniform") {
+        REQUIRE(patient.exploitability(solver.averageStrategy()) <
+                patient.exploitability(uniform) / 4);
+      }
+    }
+  }
+}